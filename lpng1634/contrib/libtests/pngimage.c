@@ -529,6 +529,7 @@ typedef enum
 #define LOG_SKIPPED     0x200 /* Log skipped bugs */
 #define FIND_BAD_COMBOS 0x400 /* Attempt to deduce bad combos */
 #define LIST_COMBOS     0x800 /* List combos by name */
+#define RESET          0x1000 /* Repeat reads through one reset png_struct */
 
 /* Result masks apply to the result bits in the 'results' field below; these
  * bits are simple 1U<<error_level.  A pass requires either nothing worse than
@@ -576,6 +577,13 @@ struct display
    png_structp    read_pp;
    png_infop      read_ip;
 
+   /* With RESET every read is done again with this png_struct, which is kept
+    * for all the files on the command line and passed to png_reset_read_struct
+    * between reads.
+    */
+   png_structp    reset_pp;
+   png_infop      reset_ip;
+
 #  ifdef PNG_WRITE_PNG_SUPPORTED
       /* Used to write a new image (the original info_ptr is used) */
       png_structp   write_pp;
@@ -646,6 +654,9 @@ static void
 display_destroy(struct display *dp)
 {
     /* Release any memory held in the display. */
+   if (dp->reset_pp != NULL)
+      png_destroy_read_struct(&dp->reset_pp, &dp->reset_ip, NULL);
+
 #  ifdef PNG_WRITE_PNG_SUPPORTED
       buffer_destroy(&dp->written_file);
 #  endif
@@ -860,6 +871,107 @@ read_function(png_structp pp, png_bytep data, png_size_t size)
    buffer_read(get_dp(pp), get_buffer(pp), data, size);
 }
 
+static void
+reset_read_png(struct display *dp, struct buffer *bp, int transforms)
+   /* Read the PNG again with the png_struct that is kept across all the reads
+    * and check that the result is exactly what the new png_struct in read_pp
+    * produced.  The reads before this one were of other images, with other
+    * transforms, so this catches state that png_reset_read_struct fails to
+    * clear.
+    */
+{
+   png_structp pp = dp->reset_pp;
+   png_infop   ip = dp->reset_ip;
+
+   if (pp == NULL)
+   {
+      dp->reset_pp = pp = png_create_read_struct(PNG_LIBPNG_VER_STRING, dp,
+         display_error, display_warning);
+      if (pp == NULL)
+         display_log(dp, LIBPNG_ERROR, "failed to create reset read struct");
+
+      dp->reset_ip = ip = png_create_info_struct(pp);
+      if (ip == NULL)
+         display_log(dp, LIBPNG_ERROR, "failed to create reset info struct");
+   }
+
+   else
+      png_reset_read_struct(pp, ip, NULL);
+
+#  ifdef PNG_SET_USER_LIMITS_SUPPORTED
+      png_set_user_limits(pp, 0x7fffffff, 0x7fffffff);
+#  endif
+
+   buffer_start_read(bp);
+   png_set_read_fn(pp, bp, read_function);
+
+   png_read_png(pp, ip, transforms, NULL/*params*/);
+
+   {
+      png_uint_32 width, height, reset_width, reset_height;
+      int bit_depth, color_type, interlace_method;
+      int reset_bit_depth, reset_color_type, reset_interlace_method;
+      size_t rowbytes = png_get_rowbytes(dp->read_pp, dp->read_ip);
+      png_bytepp rows = png_get_rows(dp->read_pp, dp->read_ip);
+      png_bytepp reset_rows = png_get_rows(pp, ip);
+      unsigned int mask;
+      png_uint_32 y;
+
+      png_get_IHDR(dp->read_pp, dp->read_ip, &width, &height, &bit_depth,
+         &color_type, &interlace_method, NULL, NULL);
+      png_get_IHDR(pp, ip, &reset_width, &reset_height, &reset_bit_depth,
+         &reset_color_type, &reset_interlace_method, NULL, NULL);
+
+      if (reset_width != width || reset_height != height ||
+         reset_bit_depth != bit_depth || reset_color_type != color_type ||
+         reset_interlace_method != interlace_method ||
+         png_get_rowbytes(pp, ip) != rowbytes)
+         display_log(dp, LIBPNG_BUG, "reset read: IHDR differs");
+
+      if (png_get_valid(pp, ip, 0xffffffff) !=
+         png_get_valid(dp->read_pp, dp->read_ip, 0xffffffff))
+         display_log(dp, LIBPNG_BUG, "reset read: chunks differ");
+
+      if (rows == NULL || reset_rows == NULL)
+         display_log(dp, LIBPNG_BUG, "png_get_rows returned NULL");
+
+      /* As in compare_read the bits past the end of a packed row are not
+       * compared; PACKSWAP moves them to the low end of the final byte.
+       */
+      if (bit_depth < 8 && ((bit_depth * width) & 7) != 0)
+      {
+         if (transforms & PNG_TRANSFORM_PACKSWAP)
+            mask = 0xff >> (8 - ((bit_depth * width) & 7));
+
+         else
+            mask = 0xff & (0xff00 >> ((bit_depth * width) & 7));
+      }
+
+      else
+         mask = 0;
+
+      for (y=0; y<height; ++y)
+      {
+         png_bytep row = rows[y];
+         png_bytep reset_row = reset_rows[y];
+
+         if (memcmp(row, reset_row, rowbytes-(mask != 0)) != 0 ||
+            (mask != 0 &&
+             ((row[rowbytes-1] & mask) != (reset_row[rowbytes-1] & mask))))
+         {
+            size_t x;
+
+            for (x=0; x<rowbytes-1; ++x) if (row[x] != reset_row[x])
+               break;
+
+            display_log(dp, LIBPNG_BUG,
+               "reset read: byte(%lu,%lu) 0x%.2x, new struct 0x%.2x",
+               (unsigned long)x, (unsigned long)y, reset_row[x], row[x]);
+         }
+      }
+   }
+}
+
 static void
 read_png(struct display *dp, struct buffer *bp, const char *operation,
    int transforms)
@@ -901,6 +1013,9 @@ read_png(struct display *dp, struct buffer *bp, const char *operation,
 
    png_read_png(pp, ip, transforms, NULL/*params*/);
 
+   if (dp->options & RESET)
+      reset_read_png(dp, bp, transforms);
+
 #if 0 /* crazy debugging */
    {
       png_bytep pr = png_get_rows(pp, ip)[0];
@@ -1648,6 +1763,12 @@ main(const int argc, const char * const * const argv)
       else if (strcmp(name, "--nolist-combos") == 0)
          d.options &= ~LIST_COMBOS;
 
+      else if (strcmp(name, "--reset") == 0)
+         d.options |= RESET;
+
+      else if (strcmp(name, "--noreset") == 0)
+         d.options &= ~RESET;
+
       else if (name[0] == '-' && name[1] == '-')
       {
          fprintf(stderr, "pngimage: %s: unknown option\n", name);
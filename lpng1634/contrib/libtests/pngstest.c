@@ -335,6 +335,7 @@ compare_16bit(int v1, int v2, int error_limit, int multiple_algorithms)
 #define NO_RESEED  512   /* do not reseed on each new file */
 #define GBG_ERROR 1024   /* do not ignore the gamma+background_rgb_to_gray
                           * libpng warning. */
+#define USE_MMAP 2048    /* with USE_FILE and not USE_STDIO map the file */
 
 static void
 print_opts(png_uint_32 opts)
@@ -343,6 +344,8 @@ print_opts(png_uint_32 opts)
       printf(" --file");
    if (opts & USE_STDIO)
       printf(" --stdio");
+   if (opts & USE_MMAP)
+      printf(" --mmap");
    if (!(opts & STRICT))
       printf(" --nostrict");
    if (opts & VERBOSE)
@@ -2967,6 +2970,12 @@ read_file(Image *image, png_uint_32 format, png_const_colorp background)
             return logerror(image, "stdio init: ", image->file_name, "");
       }
 
+      else if (image->opts & USE_MMAP)
+      {
+         if (!png_image_begin_read_from_mmap(&image->image, image->file_name))
+            return logerror(image, "mmap init: ", image->file_name, "");
+      }
+
       else
       {
          if (!png_image_begin_read_from_file(&image->image, image->file_name))
@@ -3536,6 +3545,14 @@ main(int argc, char **argv)
 #        endif
       else if (strcmp(arg, "--name") == 0)
          opts &= ~USE_STDIO;
+      else if (strcmp(arg, "--mmap") == 0)
+#        ifdef PNG_STDIO_SUPPORTED
+            opts = (opts | USE_FILE | USE_MMAP) & ~USE_STDIO;
+#        else
+            return SKIP; /* skipped: no support */
+#        endif
+      else if (strcmp(arg, "--nommap") == 0)
+         opts &= ~USE_MMAP;
       else if (strcmp(arg, "--verbose") == 0)
          opts |= VERBOSE;
       else if (strcmp(arg, "--quiet") == 0)
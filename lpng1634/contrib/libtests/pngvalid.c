@@ -12001,6 +12001,12 @@ int main(int argc, char **argv)
 
          else
 #endif
+#ifdef PNG_INTEL_SIMD
+         if (strncmp(arg, "intel-simd:", 11) == 0)
+            option = PNG_INTEL_SIMD, arg += 11;
+
+         else
+#endif
 #ifdef PNG_EXTENSIONS
          if (strncmp(arg, "extensions:", 11) == 0)
             option = PNG_EXTENSIONS, arg += 11;
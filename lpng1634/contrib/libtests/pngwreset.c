@@ -0,0 +1,412 @@
+
+/* pngwreset.c - test png_reset_write_struct
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * NOTES:
+ *   This is a C program that is intended to be linked against libpng.  It
+ *   writes a fixed set of images, each once with a new png_struct and once
+ *   with a single png_struct that is passed to png_reset_write_struct between
+ *   the images, and checks that the two PNG files are identical byte for byte.
+ *   The images change color type, bit depth, interlacing, compression level,
+ *   strategy and window size from one to the next and some carry a large zTXt
+ *   or iCCP chunk, so the deflate stream kept by the reset is claimed for text
+ *   and for IDAT with different settings.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <setjmp.h>
+
+/* Define the following to use this test against your installed libpng, rather
+ * than the one being built here:
+ */
+#ifdef PNG_FREESTANDING_TESTS
+#  include <png.h>
+#else
+#  include "../../png.h"
+#endif
+
+#ifdef PNG_ZLIB_HEADER
+#  include PNG_ZLIB_HEADER
+#else
+#  include <zlib.h>   /* For the strategy values */
+#endif
+
+/* 1.6.1 added support for the configure test harness, which uses 77 to indicate
+ * a skipped test, in earlier versions we need to succeed on a skipped test, so:
+ */
+#if PNG_LIBPNG_VER >= 10601 && defined(HAVE_CONFIG_H)
+#  define SKIP 77
+#else
+#  define SKIP 0
+#endif
+
+#if defined(PNG_WRITE_SUPPORTED) && defined(PNG_WRITE_zTXt_SUPPORTED) &&\
+    defined(PNG_WRITE_iCCP_SUPPORTED) && defined(PNG_WRITE_tRNS_SUPPORTED) &&\
+    defined(PNG_WRITE_INTERLACING_SUPPORTED) &&\
+    defined(PNG_WRITE_CUSTOMIZE_COMPRESSION_SUPPORTED)
+
+/* The images and the large chunks are over 16K so that png_deflate_claim does
+ * not lower windowBits; only then is the stream reused with a new level or
+ * strategy rather than initialized again.
+ */
+#define WIDTH  131
+#define HEIGHT 97
+#define LARGE  40000 /* bytes of zTXt or iCCP */
+#define DEFAULT (-99) /* leave the setting alone */
+
+typedef struct
+{
+   int color_type;
+   int bit_depth;
+   int interlace;
+   int level;       /* png_set_compression_level */
+   int strategy;    /* png_set_compression_strategy */
+   int window_bits; /* png_set_compression_window_bits */
+   int text_level;  /* png_set_text_compression_level */
+   int filters;     /* png_set_filter */
+   size_t ztxt;     /* length of the zTXt text, 0 for none */
+   size_t iccp;     /* length of the iCCP profile, 0 for none */
+}  image_case;
+
+/* The order matters: each image has to change something the previous one
+ * set up, both the reused deflate stream and the settings the reset clears.
+ */
+static const image_case cases[] =
+{
+   { PNG_COLOR_TYPE_RGB, 8, PNG_INTERLACE_NONE, DEFAULT, DEFAULT, DEFAULT,
+      DEFAULT, DEFAULT, LARGE, 0 },
+   { PNG_COLOR_TYPE_PALETTE, 8, PNG_INTERLACE_NONE, 1, Z_FILTERED, DEFAULT,
+      DEFAULT, DEFAULT, 100, 0 },
+   { PNG_COLOR_TYPE_GRAY, 16, PNG_INTERLACE_ADAM7, 9, Z_RLE, DEFAULT,
+      DEFAULT, DEFAULT, 0, LARGE },
+   { PNG_COLOR_TYPE_RGB_ALPHA, 8, PNG_INTERLACE_NONE, 0, Z_HUFFMAN_ONLY,
+      DEFAULT, 9, PNG_FILTER_NONE, LARGE, LARGE },
+   { PNG_COLOR_TYPE_PALETTE, 2, PNG_INTERLACE_ADAM7, DEFAULT, DEFAULT,
+      DEFAULT, 1, DEFAULT, LARGE, LARGE },
+   { PNG_COLOR_TYPE_GRAY_ALPHA, 8, PNG_INTERLACE_NONE, 6, Z_FIXED, 9,
+      DEFAULT, PNG_ALL_FILTERS, LARGE, 0 },
+   { PNG_COLOR_TYPE_RGB, 16, PNG_INTERLACE_NONE, 3, DEFAULT, DEFAULT,
+      DEFAULT, PNG_FILTER_PAETH, 0, 0 },
+   { PNG_COLOR_TYPE_GRAY, 1, PNG_INTERLACE_NONE, DEFAULT, DEFAULT, DEFAULT,
+      DEFAULT, DEFAULT, 0, 0 }
+};
+
+#define NCASES (sizeof cases / sizeof cases[0])
+
+/* The PNG file is written to a growing block of memory */
+typedef struct
+{
+   png_bytep data;
+   size_t    size;
+   size_t    allocated;
+}  buffer;
+
+static void PNGCBAPI
+write_function(png_structp pp, png_bytep data, png_size_t size)
+{
+   buffer *bp = (buffer*)png_get_io_ptr(pp);
+
+   if (bp->size + size > bp->allocated)
+   {
+      size_t allocated = 2 * (bp->size + size);
+      png_bytep data_new = (png_bytep)realloc(bp->data, allocated);
+
+      if (data_new == NULL)
+         png_error(pp, "out of memory");
+
+      bp->data = data_new;
+      bp->allocated = allocated;
+   }
+
+   memcpy(bp->data + bp->size, data, size);
+   bp->size += size;
+}
+
+static void PNGCBAPI
+flush_function(png_structp pp)
+{
+   (void)pp;
+}
+
+static void PNGCBAPI
+error_function(png_structp pp, png_const_charp message)
+{
+   fprintf(stderr, "pngwreset: error: %s\n", message);
+   png_longjmp(pp, 1);
+}
+
+static void PNGCBAPI
+warning_function(png_structp pp, png_const_charp message)
+{
+   (void)pp;
+   fprintf(stderr, "pngwreset: warning: %s\n", message);
+}
+
+/* Deterministic bytes, 'seed' keeps the images apart */
+static png_byte
+pattern(png_uint_32 i, unsigned int seed)
+{
+   i = i * 2654435761U + seed * 40503U;
+   return (png_byte)((i >> 13) ^ (i >> 24));
+}
+
+/* A header that png_set_iCCP accepts, no tags, then filler */
+static void
+make_profile(png_bytep profile, size_t size, int color_type)
+{
+   static const png_byte D50[12] =
+      { 0x00,0x00,0xf6,0xd6, 0x00,0x01,0x00,0x00, 0x00,0x00,0xd3,0x2d };
+   size_t i;
+
+   memset(profile, 0, 132);
+   png_save_uint_32(profile, (png_uint_32)size);
+   profile[8] = 2; /* version 2.1 */
+   profile[9] = 0x10;
+   memcpy(profile+12, "mntr", 4);
+   memcpy(profile+16, (color_type & PNG_COLOR_MASK_COLOR) ? "RGB " : "GRAY",
+      4);
+   memcpy(profile+20, "XYZ ", 4);
+   memcpy(profile+36, "acsp", 4);
+   memcpy(profile+68, D50, 12);
+
+   for (i=132; i<size; ++i)
+      profile[i] = (png_byte)(pattern((png_uint_32)i, 7) & 0x3f);
+}
+
+/* Write the image of 'ic' to 'bp' with the png_struct and info struct given;
+ * returns 0 if libpng raised an error.
+ */
+static int
+write_image(png_structp pp, png_infop ip, const image_case *ic, unsigned int n,
+   buffer *bp)
+{
+   png_bytep image = NULL;
+   png_bytepp rows = NULL;
+   png_bytep profile = NULL;
+   png_charp text_data = NULL;
+   size_t rowbytes;
+   png_uint_32 y;
+   int channels;
+
+   bp->size = 0;
+
+   if (setjmp(png_jmpbuf(pp)))
+   {
+      free(image);
+      free(rows);
+      free(profile);
+      free(text_data);
+      return 0;
+   }
+
+   switch (ic->color_type)
+   {
+      case PNG_COLOR_TYPE_RGB:        channels = 3; break;
+      case PNG_COLOR_TYPE_GRAY_ALPHA: channels = 2; break;
+      case PNG_COLOR_TYPE_RGB_ALPHA:  channels = 4; break;
+      default:                        channels = 1; break;
+   }
+
+   rowbytes = (WIDTH * channels * ic->bit_depth + 7) / 8;
+   image = (png_bytep)malloc(rowbytes * HEIGHT);
+   rows = (png_bytepp)malloc(HEIGHT * sizeof *rows);
+   if (image == NULL || rows == NULL)
+      png_error(pp, "out of memory");
+
+   /* Runs of a few values so that the filters and strategies differ */
+   for (y=0; y<HEIGHT; ++y)
+   {
+      size_t x;
+
+      rows[y] = image + y * rowbytes;
+      for (x=0; x<rowbytes; ++x)
+         rows[y][x] = pattern((png_uint_32)((y * rowbytes + x) / 5), n) &
+            (png_byte)(0xf0 | y);
+   }
+
+   png_set_write_fn(pp, bp, write_function, flush_function);
+
+   if (ic->level != DEFAULT)
+      png_set_compression_level(pp, ic->level);
+
+   if (ic->strategy != DEFAULT)
+      png_set_compression_strategy(pp, ic->strategy);
+
+   if (ic->window_bits != DEFAULT)
+      png_set_compression_window_bits(pp, ic->window_bits);
+
+#  ifdef PNG_WRITE_CUSTOMIZE_ZTXT_COMPRESSION_SUPPORTED
+      if (ic->text_level != DEFAULT)
+         png_set_text_compression_level(pp, ic->text_level);
+#  endif
+
+   if (ic->filters != DEFAULT)
+      png_set_filter(pp, PNG_FILTER_TYPE_BASE, ic->filters);
+
+   png_set_IHDR(pp, ip, WIDTH, HEIGHT, ic->bit_depth, ic->color_type,
+      ic->interlace, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+   if (ic->color_type == PNG_COLOR_TYPE_PALETTE)
+   {
+      png_color palette[256];
+      png_byte trans[256];
+      int num = 1 << ic->bit_depth;
+      int i;
+
+      for (i=0; i<num; ++i)
+      {
+         palette[i].red = pattern((png_uint_32)i, n);
+         palette[i].green = pattern((png_uint_32)i, n+1);
+         palette[i].blue = pattern((png_uint_32)i, n+2);
+         trans[i] = (png_byte)(255 - i);
+      }
+
+      png_set_PLTE(pp, ip, palette, num);
+      png_set_tRNS(pp, ip, trans, num > 16 ? 16 : num, NULL);
+   }
+
+   if (ic->iccp > 0)
+   {
+      profile = (png_bytep)malloc(ic->iccp);
+      if (profile == NULL)
+         png_error(pp, "out of memory");
+
+      make_profile(profile, ic->iccp, ic->color_type);
+      png_set_iCCP(pp, ip, "test profile", PNG_COMPRESSION_TYPE_BASE, profile,
+         (png_uint_32)ic->iccp);
+   }
+
+   if (ic->ztxt > 0)
+   {
+      png_text text;
+      size_t i;
+
+      text_data = (png_charp)malloc(ic->ztxt + 1);
+      if (text_data == NULL)
+         png_error(pp, "out of memory");
+
+      for (i=0; i<ic->ztxt; ++i)
+         text_data[i] = (char)('a' + pattern((png_uint_32)i, n) % 26);
+      text_data[ic->ztxt] = 0;
+
+      memset(&text, 0, sizeof text);
+      text.compression = PNG_TEXT_COMPRESSION_zTXt;
+      text.key = (png_charp)"Comment";
+      text.text = text_data;
+      text.text_length = ic->ztxt;
+      png_set_text(pp, ip, &text, 1);
+   }
+
+   png_write_info(pp, ip);
+   png_write_image(pp, rows);
+   png_write_end(pp, ip);
+
+   free(image);
+   free(rows);
+   free(profile);
+   free(text_data);
+   return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+   png_structp reset_pp = NULL;
+   png_infop reset_ip = NULL;
+   buffer fresh, reset;
+   unsigned int n, pass;
+   int errors = 0;
+
+   (void)argc;
+   (void)argv;
+
+   memset(&fresh, 0, sizeof fresh);
+   memset(&reset, 0, sizeof reset);
+
+   /* Twice through, so every image also follows the last */
+   for (pass = 0; pass < 2; ++pass) for (n = 0; n < NCASES; ++n)
+   {
+      const image_case *ic = cases + n;
+      png_structp pp = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
+         error_function, warning_function);
+      png_infop ip = pp != NULL ? png_create_info_struct(pp) : NULL;
+      int ok;
+
+      if (ip == NULL)
+      {
+         fprintf(stderr, "pngwreset: out of memory\n");
+         return 1;
+      }
+
+      ok = write_image(pp, ip, ic, n, &fresh);
+      png_destroy_write_struct(&pp, &ip);
+
+      if (!ok)
+      {
+         fprintf(stderr, "pngwreset: image %u: new png_struct failed\n", n);
+         ++errors;
+         continue;
+      }
+
+      if (reset_pp == NULL)
+      {
+         reset_pp = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
+            error_function, warning_function);
+         reset_ip = reset_pp != NULL ? png_create_info_struct(reset_pp) : NULL;
+
+         if (reset_ip == NULL)
+         {
+            fprintf(stderr, "pngwreset: out of memory\n");
+            return 1;
+         }
+      }
+
+      else
+         png_reset_write_struct(reset_pp, reset_ip);
+
+      if (!write_image(reset_pp, reset_ip, ic, n, &reset))
+      {
+         fprintf(stderr, "pngwreset: image %u: reset png_struct failed\n", n);
+         ++errors;
+      }
+
+      else if (reset.size != fresh.size ||
+         memcmp(reset.data, fresh.data, fresh.size) != 0)
+      {
+         fprintf(stderr,
+            "pngwreset: image %u: %lu bytes after reset, %lu new\n", n,
+            (unsigned long)reset.size, (unsigned long)fresh.size);
+         ++errors;
+      }
+   }
+
+   png_destroy_write_struct(&reset_pp, &reset_ip);
+   free(fresh.data);
+   free(reset.data);
+
+   if (errors)
+   {
+      fprintf(stderr, "pngwreset: %d images differ (zlib %s)\n", errors,
+         zlibVersion());
+      return 1;
+   }
+
+   printf("PASS: pngwreset: %u images (zlib %s)\n",
+      (unsigned int)(2 * NCASES), zlibVersion());
+   return 0;
+}
+#else /* !(WRITE && zTXt && iCCP && tRNS && INTERLACING && CUSTOMIZE) */
+int
+main(void)
+{
+   fprintf(stderr,
+      "pngwreset: no write support with zTXt, iCCP and compression settings\n");
+   /* So the test is skipped: */
+   return SKIP;
+}
+#endif
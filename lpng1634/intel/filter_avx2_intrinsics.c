@@ -0,0 +1,139 @@
+
+/* filter_avx2_intrinsics.c - AVX2 optimized filter functions
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * Only Up and the Sub filter of 4 and 8 byte pixels are here: both run over
+ * the whole row without waiting on the pixel just decoded, so they scale with
+ * register width.  Avg and Paeth are one pixel per step and stay in
+ * filter_sse2_intrinsics.c.
+ */
+
+#include "../pngpriv.h"
+
+#ifdef PNG_READ_SUPPORTED
+
+#if PNG_INTEL_SSE_IMPLEMENTATION > 0
+
+#include <immintrin.h>
+
+PNG_INTEL_TARGET("avx2") void
+png_read_filter_row_up_avx2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_size_t rb = row_info->rowbytes;
+
+   png_debug(1, "in png_read_filter_row_up_avx2");
+
+   while (rb >= 32)
+   {
+      __m256i x = _mm256_loadu_si256((const __m256i *)row);
+      __m256i b = _mm256_loadu_si256((const __m256i *)prev);
+
+      _mm256_storeu_si256((__m256i *)row, _mm256_add_epi8(x, b));
+      row += 32;
+      prev += 32;
+      rb -= 32;
+   }
+
+   while (rb > 0)
+   {
+      *row = (png_byte)(*row + *prev++);
+      row++;
+      rb--;
+   }
+}
+
+/* The running sum is done in each 128-bit lane as in the SSE2 version, then
+ * the last pixel of the low lane is carried into the high lane and the last
+ * pixel of the previous step into both.
+ */
+PNG_INTEL_TARGET("avx2") void
+png_read_filter_row_sub4_avx2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_size_t rb = row_info->rowbytes;
+   __m256i carry = _mm256_setzero_si256();
+   __m128i last;
+
+   png_debug(1, "in png_read_filter_row_sub4_avx2");
+   PNG_UNUSED(prev)
+
+   while (rb >= 32)
+   {
+      __m256i x = _mm256_loadu_si256((const __m256i *)row);
+      __m256i lane;
+
+      x = _mm256_add_epi8(x, _mm256_slli_si256(x, 4));
+      x = _mm256_add_epi8(x, _mm256_slli_si256(x, 8));
+
+      lane = _mm256_shuffle_epi32(x, 0xff);
+      x = _mm256_add_epi8(x, _mm256_permute2x128_si256(lane, lane, 0x08));
+      x = _mm256_add_epi8(x, carry);
+      _mm256_storeu_si256((__m256i *)row, x);
+
+      carry = _mm256_shuffle_epi32(_mm256_permute4x64_epi64(x, 0xff), 0xff);
+      row += 32;
+      rb -= 32;
+   }
+
+   last = _mm256_castsi256_si128(carry);
+
+   while (rb >= 4)
+   {
+      png_uint_32 x;
+
+      memcpy(&x, row, 4);
+      last = _mm_add_epi8(last, _mm_cvtsi32_si128((int)x));
+      x = (png_uint_32)_mm_cvtsi128_si32(last);
+      memcpy(row, &x, 4);
+
+      row += 4;
+      rb -= 4;
+   }
+}
+
+PNG_INTEL_TARGET("avx2") void
+png_read_filter_row_sub8_avx2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_size_t rb = row_info->rowbytes;
+   __m256i carry = _mm256_setzero_si256();
+
+   png_debug(1, "in png_read_filter_row_sub8_avx2");
+   PNG_UNUSED(prev)
+
+   while (rb >= 32)
+   {
+      __m256i x = _mm256_loadu_si256((const __m256i *)row);
+      __m256i lane;
+
+      x = _mm256_add_epi8(x, _mm256_slli_si256(x, 8));
+
+      lane = _mm256_unpackhi_epi64(x, x);
+      x = _mm256_add_epi8(x, _mm256_permute2x128_si256(lane, lane, 0x08));
+      x = _mm256_add_epi8(x, carry);
+      _mm256_storeu_si256((__m256i *)row, x);
+
+      carry = _mm256_permute4x64_epi64(x, 0xff);
+      row += 32;
+      rb -= 32;
+   }
+
+   while (rb >= 8)
+   {
+      __m128i x = _mm_loadl_epi64((const __m128i *)row);
+
+      x = _mm_add_epi8(x, _mm256_castsi256_si128(carry));
+      _mm_storel_epi64((__m128i *)row, x);
+
+      carry = _mm256_castsi128_si256(x);
+      row += 8;
+      rb -= 8;
+   }
+}
+
+#endif /* PNG_INTEL_SSE_IMPLEMENTATION > 0 */
+#endif /* PNG_READ_SUPPORTED */
@@ -0,0 +1,415 @@
+
+/* filter_sse2_intrinsics.c - SSE2 and SSSE3 optimized filter functions
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * Sub of 4 and 8 byte pixels runs a prefix sum over 16 bytes at a time, the
+ * other Sub, Avg and Paeth filters depend on the pixel just decoded and so
+ * work one pixel per step with all of its channels in one register.
+ */
+
+#include "../pngpriv.h"
+
+#ifdef PNG_READ_SUPPORTED
+
+#if PNG_INTEL_SSE_IMPLEMENTATION > 0
+
+#include <emmintrin.h>
+#include <tmmintrin.h>
+
+/* Pixels of 3 and 6 bytes are loaded through memcpy so that the last pixel of
+ * the row is never read past.
+ */
+static __m128i
+load3(const void *p)
+{
+   png_uint_32 tmp = 0;
+
+   memcpy(&tmp, p, 3);
+   return _mm_cvtsi32_si128((int)tmp);
+}
+
+static __m128i
+load4(const void *p)
+{
+   png_uint_32 tmp;
+
+   memcpy(&tmp, p, 4);
+   return _mm_cvtsi32_si128((int)tmp);
+}
+
+static __m128i
+load6(const void *p)
+{
+   png_byte tmp[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+   memcpy(tmp, p, 6);
+   return _mm_loadl_epi64((const __m128i *)tmp);
+}
+
+static __m128i
+load8(const void *p)
+{
+   return _mm_loadl_epi64((const __m128i *)p);
+}
+
+static void
+store3(void *p, __m128i v)
+{
+   png_uint_32 tmp = (png_uint_32)_mm_cvtsi128_si32(v);
+
+   memcpy(p, &tmp, 3);
+}
+
+static void
+store4(void *p, __m128i v)
+{
+   png_uint_32 tmp = (png_uint_32)_mm_cvtsi128_si32(v);
+
+   memcpy(p, &tmp, 4);
+}
+
+static void
+store6(void *p, __m128i v)
+{
+   png_byte tmp[8];
+
+   _mm_storel_epi64((__m128i *)tmp, v);
+   memcpy(p, tmp, 6);
+}
+
+static void
+store8(void *p, __m128i v)
+{
+   _mm_storel_epi64((__m128i *)p, v);
+}
+
+void png_read_filter_row_up_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_size_t rb = row_info->rowbytes;
+
+   png_debug(1, "in png_read_filter_row_up_sse2");
+
+   while (rb >= 16)
+   {
+      __m128i x = _mm_loadu_si128((const __m128i *)row);
+      __m128i b = _mm_loadu_si128((const __m128i *)prev);
+
+      _mm_storeu_si128((__m128i *)row, _mm_add_epi8(x, b));
+      row += 16;
+      prev += 16;
+      rb -= 16;
+   }
+
+   while (rb > 0)
+   {
+      *row = (png_byte)(*row + *prev++);
+      row++;
+      rb--;
+   }
+}
+
+/* Pixels of 3 and 6 bytes are read 4 or 8 bytes at a time while another
+ * pixel follows, only the last one is loaded exactly.  Results are always
+ * stored exactly, the extra bytes belong to the next pixel.  The row bodies
+ * are macros so that each pixel size gets its own loop with the loads and
+ * stores inlined.
+ */
+#define PNG_PIXEL_LOOP(bpp, step, wide, exact, store)\
+   while (rb > bpp)\
+   {\
+      step(wide, store)\
+      row += bpp;\
+      prev += bpp;\
+      rb -= bpp;\
+   }\
+\
+   if (rb == bpp)\
+   {\
+      step(exact, store)\
+   }
+
+/* The Sub filter predicts each pixel from the one before it:
+ *   Ra = Xa + a, with a = 0 for the first pixel.
+ */
+#define PNG_SUB_STEP(load, store)\
+      a = _mm_add_epi8(a, load(row));\
+      store(row, a);
+
+#define PNG_SUB_ROW(bpp, wide, exact, store)\
+   {\
+      png_size_t rb = row_info->rowbytes;\
+      __m128i a = _mm_setzero_si128();\
+\
+      PNG_PIXEL_LOOP(bpp, PNG_SUB_STEP, wide, exact, store)\
+   }
+
+void png_read_filter_row_sub3_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_sub3_sse2");
+
+   PNG_SUB_ROW(3, load4, load3, store3)
+}
+
+void png_read_filter_row_sub6_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_sub6_sse2");
+
+   PNG_SUB_ROW(6, load8, load6, store6)
+}
+
+void png_read_filter_row_sub4_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   /* Four pixels per step: two shifted adds give the running sum within the
+    * register, then the last pixel of the previous step is added to all four.
+    */
+   png_size_t rb = row_info->rowbytes;
+   __m128i carry = _mm_setzero_si128();
+
+   png_debug(1, "in png_read_filter_row_sub4_sse2");
+   PNG_UNUSED(prev)
+
+   while (rb >= 16)
+   {
+      __m128i x = _mm_loadu_si128((const __m128i *)row);
+
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+      x = _mm_add_epi8(x, carry);
+      _mm_storeu_si128((__m128i *)row, x);
+
+      carry = _mm_shuffle_epi32(x, 0xff);
+      row += 16;
+      rb -= 16;
+   }
+
+   while (rb >= 4)
+   {
+      carry = _mm_add_epi8(carry, load4(row));
+      store4(row, carry);
+      row += 4;
+      rb -= 4;
+   }
+}
+
+void png_read_filter_row_sub8_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_size_t rb = row_info->rowbytes;
+   __m128i carry = _mm_setzero_si128();
+
+   png_debug(1, "in png_read_filter_row_sub8_sse2");
+   PNG_UNUSED(prev)
+
+   while (rb >= 16)
+   {
+      __m128i x = _mm_loadu_si128((const __m128i *)row);
+
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+      x = _mm_add_epi8(x, carry);
+      _mm_storeu_si128((__m128i *)row, x);
+
+      carry = _mm_unpackhi_epi64(x, x);
+      row += 16;
+      rb -= 16;
+   }
+
+   if (rb >= 8)
+      store8(row, _mm_add_epi8(carry, load8(row)));
+}
+
+/* The Avg filter predicts each pixel as the average of the pixel to the left
+ * and the one above, rounded down:
+ *   Ra = Xa + floor((a + b) / 2)
+ * _mm_avg_epu8 rounds up, so the low bit of an odd sum is taken off.
+ */
+#define PNG_AVG_STEP(load, store)\
+   {\
+      __m128i b = load(prev);\
+      __m128i avg = _mm_avg_epu8(a, b);\
+\
+      avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));\
+      a = _mm_add_epi8(avg, load(row));\
+      store(row, a);\
+   }
+
+#define PNG_AVG_ROW(bpp, wide, exact, store)\
+   {\
+      png_size_t rb = row_info->rowbytes;\
+      __m128i a = _mm_setzero_si128();\
+      const __m128i one = _mm_set1_epi8(1);\
+\
+      PNG_PIXEL_LOOP(bpp, PNG_AVG_STEP, wide, exact, store)\
+   }
+
+void png_read_filter_row_avg3_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_avg3_sse2");
+
+   PNG_AVG_ROW(3, load4, load3, store3)
+}
+
+void png_read_filter_row_avg4_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_avg4_sse2");
+
+   PNG_AVG_ROW(4, load4, load4, store4)
+}
+
+void png_read_filter_row_avg6_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_avg6_sse2");
+
+   PNG_AVG_ROW(6, load8, load6, store6)
+}
+
+void png_read_filter_row_avg8_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_avg8_sse2");
+
+   PNG_AVG_ROW(8, load8, load8, store8)
+}
+
+/* Returns bytes from x where the mask is set, otherwise from y. */
+static __m128i
+if_then_else(__m128i c, __m128i x, __m128i y)
+{
+   return _mm_or_si128(_mm_and_si128(c, x), _mm_andnot_si128(c, y));
+}
+
+static __m128i
+abs_i16(__m128i x)
+{
+   return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static PNG_INTEL_TARGET("ssse3") __m128i
+abs_i16_ssse3(__m128i x)
+{
+   return _mm_abs_epi16(x);
+}
+
+/* The Paeth filter is the same in both instruction sets apart from the
+ * absolute value.  The channels are widened to 16 bits to hold a + b - c; the
+ * predictor is chosen as in png_read_filter_row_paeth_multibyte_pixel, with
+ * ties going to a, then b.
+ */
+#define PNG_PAETH_STEP(load, store, abs_fn)\
+   {\
+      __m128i b = _mm_unpacklo_epi8(load(prev), zero);\
+      __m128i x = load(row);\
+      __m128i pa, pb, pc, smallest, nearest;\
+\
+      pa = _mm_sub_epi16(b, c);\
+      pb = _mm_sub_epi16(a, c);\
+      pc = _mm_add_epi16(pa, pb);\
+\
+      pa = abs_fn(pa);\
+      pb = abs_fn(pb);\
+      pc = abs_fn(pc);\
+\
+      smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));\
+\
+      nearest = if_then_else(_mm_cmpeq_epi16(smallest, pa), a,\
+                if_then_else(_mm_cmpeq_epi16(smallest, pb), b, c));\
+\
+      x = _mm_add_epi8(x, _mm_packus_epi16(nearest, nearest));\
+      store(row, x);\
+\
+      a = _mm_unpacklo_epi8(x, zero);\
+      c = b;\
+   }
+
+#define PNG_PAETH_STEP_SSE2(load, store) PNG_PAETH_STEP(load, store, abs_i16)
+#define PNG_PAETH_STEP_SSSE3(load, store)\
+   PNG_PAETH_STEP(load, store, abs_i16_ssse3)
+
+#define PNG_PAETH_ROW(bpp, step, wide, exact, store)\
+   {\
+      png_size_t rb = row_info->rowbytes;\
+      const __m128i zero = _mm_setzero_si128();\
+      __m128i a = zero, c = zero;\
+\
+      PNG_PIXEL_LOOP(bpp, step, wide, exact, store)\
+   }
+
+void png_read_filter_row_paeth3_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_paeth3_sse2");
+
+   PNG_PAETH_ROW(3, PNG_PAETH_STEP_SSE2, load4, load3, store3)
+}
+
+void png_read_filter_row_paeth4_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_paeth4_sse2");
+
+   PNG_PAETH_ROW(4, PNG_PAETH_STEP_SSE2, load4, load4, store4)
+}
+
+void png_read_filter_row_paeth6_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_paeth6_sse2");
+
+   PNG_PAETH_ROW(6, PNG_PAETH_STEP_SSE2, load8, load6, store6)
+}
+
+void png_read_filter_row_paeth8_sse2(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_paeth8_sse2");
+
+   PNG_PAETH_ROW(8, PNG_PAETH_STEP_SSE2, load8, load8, store8)
+}
+
+PNG_INTEL_TARGET("ssse3") void
+png_read_filter_row_paeth3_ssse3(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_paeth3_ssse3");
+
+   PNG_PAETH_ROW(3, PNG_PAETH_STEP_SSSE3, load4, load3, store3)
+}
+
+PNG_INTEL_TARGET("ssse3") void
+png_read_filter_row_paeth4_ssse3(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_paeth4_ssse3");
+
+   PNG_PAETH_ROW(4, PNG_PAETH_STEP_SSSE3, load4, load4, store4)
+}
+
+PNG_INTEL_TARGET("ssse3") void
+png_read_filter_row_paeth6_ssse3(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_paeth6_ssse3");
+
+   PNG_PAETH_ROW(6, PNG_PAETH_STEP_SSSE3, load8, load6, store6)
+}
+
+PNG_INTEL_TARGET("ssse3") void
+png_read_filter_row_paeth8_ssse3(png_row_infop row_info, png_bytep row,
+   png_const_bytep prev)
+{
+   png_debug(1, "in png_read_filter_row_paeth8_ssse3");
+
+   PNG_PAETH_ROW(8, PNG_PAETH_STEP_SSSE3, load8, load8, store8)
+}
+
+#endif /* PNG_INTEL_SSE_IMPLEMENTATION > 0 */
+#endif /* PNG_READ_SUPPORTED */
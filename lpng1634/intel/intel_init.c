@@ -0,0 +1,242 @@
+
+/* intel_init.c - x86 SIMD filter and transform function selection
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * The SSE2 filters are always usable when PNG_INTEL_SSE_IMPLEMENTATION is
+ * set, the SSSE3 and AVX2 versions are only installed when CPUID says the
+ * processor (and, for AVX2, the operating system) supports them.  The choice
+ * can be turned off with png_set_option(png_ptr, PNG_INTEL_SIMD,
+ * PNG_OPTION_OFF), which leaves the generic C filters in place.  The same
+ * option keeps the C byte map for fused read transforms.
+ */
+
+#include "../pngpriv.h"
+
+#ifdef PNG_READ_SUPPORTED
+
+#if PNG_INTEL_SSE_IMPLEMENTATION > 0
+
+#if defined(_MSC_VER)
+#  include <intrin.h>
+#elif defined(__GNUC__) || defined(__clang__)
+#  include <cpuid.h>
+#endif
+
+#define PNG_INTEL_SSSE3 0x01U
+#define PNG_INTEL_AVX2  0x02U
+#define PNG_INTEL_VALID 0x80U
+
+/* The feature cache is read and written by any thread that sets up a read
+ * struct, so it goes through atomic loads and stores.  Every thread computes
+ * the same value, so no stronger ordering is needed.
+ */
+#if defined(_MSC_VER)
+#  define PNG_INTEL_LOAD(p) \
+      ((unsigned int)_InterlockedOr((volatile long *)(p), 0))
+#  define PNG_INTEL_STORE(p, v) \
+      ((void)_InterlockedExchange((volatile long *)(p), (long)(v)))
+#elif defined(__GNUC__) || defined(__clang__)
+#  define PNG_INTEL_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#  define PNG_INTEL_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#else
+#  define PNG_INTEL_LOAD(p) (*(p))
+#  define PNG_INTEL_STORE(p, v) ((void)(*(p) = (v)))
+#endif
+
+static unsigned int
+png_intel_cpuid(unsigned int leaf, unsigned int regs[4])
+{
+#if defined(_MSC_VER)
+   int info[4];
+
+   __cpuid(info, 0);
+   if ((unsigned int)info[0] < leaf)
+      return 0;
+
+   __cpuidex(info, (int)leaf, 0);
+   regs[0] = (unsigned int)info[0];
+   regs[1] = (unsigned int)info[1];
+   regs[2] = (unsigned int)info[2];
+   regs[3] = (unsigned int)info[3];
+   return 1;
+#elif defined(__GNUC__) || defined(__clang__)
+   if (__get_cpuid_max(0, NULL) < leaf)
+      return 0;
+
+   __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+   return 1;
+#else
+   PNG_UNUSED(leaf)
+   PNG_UNUSED(regs)
+   return 0;
+#endif
+}
+
+/* The YMM state must be enabled by the OS (XCR0 bits 1 and 2) before AVX2 can
+ * be used, CPUID alone only says the processor has it.
+ */
+static unsigned int
+png_intel_ymm_enabled(void)
+{
+#if defined(_MSC_VER)
+   return (_xgetbv(0) & 6) == 6;
+#elif defined(__GNUC__) || defined(__clang__)
+   unsigned int eax, edx;
+
+   __asm__ ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+   PNG_UNUSED(edx)
+   return (eax & 6) == 6;
+#else
+   return 0;
+#endif
+}
+
+static unsigned int
+png_intel_features(void)
+{
+   static unsigned int features = 0;
+   unsigned int found = PNG_INTEL_LOAD(&features);
+
+   if (found == 0)
+   {
+      unsigned int regs[4];
+
+      found = PNG_INTEL_VALID;
+
+      if (png_intel_cpuid(1, regs) != 0)
+      {
+         if ((regs[2] & (1U << 9)) != 0)
+            found |= PNG_INTEL_SSSE3;
+
+         /* OSXSAVE and AVX, then AVX2 in leaf 7 */
+         if ((regs[2] & (1U << 27)) != 0 && (regs[2] & (1U << 28)) != 0 &&
+             png_intel_ymm_enabled() != 0 &&
+             png_intel_cpuid(7, regs) != 0 && (regs[1] & (1U << 5)) != 0)
+            found |= PNG_INTEL_AVX2;
+      }
+
+      PNG_INTEL_STORE(&features, found);
+   }
+
+   return found;
+}
+
+void
+png_init_filter_functions_sse2(png_structp pp, unsigned int bpp)
+{
+   unsigned int features;
+
+#ifdef PNG_SET_OPTION_SUPPORTED
+   if (((pp->options >> PNG_INTEL_SIMD) & 3) == PNG_OPTION_OFF)
+      return;
+#endif
+
+   features = png_intel_features();
+
+   if ((features & PNG_INTEL_AVX2) != 0)
+      pp->read_filter[PNG_FILTER_VALUE_UP-1] = png_read_filter_row_up_avx2;
+   else
+      pp->read_filter[PNG_FILTER_VALUE_UP-1] = png_read_filter_row_up_sse2;
+
+   /* Sub, Avg and Paeth depend on the pixel size; 1 and 2 byte pixels are
+    * left to the C code, there is too little in each pixel to gain from SIMD.
+    */
+   switch (bpp)
+   {
+      case 3:
+         pp->read_filter[PNG_FILTER_VALUE_SUB-1] =
+            png_read_filter_row_sub3_sse2;
+         pp->read_filter[PNG_FILTER_VALUE_AVG-1] =
+            png_read_filter_row_avg3_sse2;
+         pp->read_filter[PNG_FILTER_VALUE_PAETH-1] =
+            (features & PNG_INTEL_SSSE3) != 0 ?
+            png_read_filter_row_paeth3_ssse3 : png_read_filter_row_paeth3_sse2;
+         break;
+
+      case 4:
+         pp->read_filter[PNG_FILTER_VALUE_SUB-1] =
+            (features & PNG_INTEL_AVX2) != 0 ?
+            png_read_filter_row_sub4_avx2 : png_read_filter_row_sub4_sse2;
+         pp->read_filter[PNG_FILTER_VALUE_AVG-1] =
+            png_read_filter_row_avg4_sse2;
+         pp->read_filter[PNG_FILTER_VALUE_PAETH-1] =
+            (features & PNG_INTEL_SSSE3) != 0 ?
+            png_read_filter_row_paeth4_ssse3 : png_read_filter_row_paeth4_sse2;
+         break;
+
+      case 6:
+         pp->read_filter[PNG_FILTER_VALUE_SUB-1] =
+            png_read_filter_row_sub6_sse2;
+         pp->read_filter[PNG_FILTER_VALUE_AVG-1] =
+            png_read_filter_row_avg6_sse2;
+         pp->read_filter[PNG_FILTER_VALUE_PAETH-1] =
+            (features & PNG_INTEL_SSSE3) != 0 ?
+            png_read_filter_row_paeth6_ssse3 : png_read_filter_row_paeth6_sse2;
+         break;
+
+      case 8:
+         pp->read_filter[PNG_FILTER_VALUE_SUB-1] =
+            (features & PNG_INTEL_AVX2) != 0 ?
+            png_read_filter_row_sub8_avx2 : png_read_filter_row_sub8_sse2;
+         pp->read_filter[PNG_FILTER_VALUE_AVG-1] =
+            png_read_filter_row_avg8_sse2;
+         pp->read_filter[PNG_FILTER_VALUE_PAETH-1] =
+            (features & PNG_INTEL_SSSE3) != 0 ?
+            png_read_filter_row_paeth8_ssse3 : png_read_filter_row_paeth8_sse2;
+         break;
+
+      default:
+         break;
+   }
+}
+
+#ifdef PNG_READ_TRANSFORMS_SUPPORTED
+/* Called when png_init_read_fused has made a byte map of the transforms;
+ * byte p*in+map[k] of four input pixels becomes byte p*out+k, from the first
+ * load if below 16, else from the second, and the filler is ORed in after.
+ */
+void
+png_init_read_fused_sse2(png_structrp pp)
+{
+   png_bytep shuffle = pp->read_fused_shuffle;
+   unsigned int in = pp->read_fused_in;
+   unsigned int out = pp->read_fused_out;
+   unsigned int p, k;
+
+#ifdef PNG_SET_OPTION_SUPPORTED
+   if (((pp->options >> PNG_INTEL_SIMD) & 3) == PNG_OPTION_OFF)
+      return;
+#endif
+
+   if ((png_intel_features() & PNG_INTEL_SSSE3) == 0)
+      return;
+
+   memset(shuffle, 0x80, 32);
+   memset(shuffle + 32, 0, 16);
+
+   for (p = 0; p < 4; ++p)
+   {
+      for (k = 0; k < out; ++k)
+      {
+         unsigned int to = p * out + k;
+         unsigned int from = pp->read_fused_map[k];
+
+         if (from == in)
+            shuffle[32 + to] = pp->read_fused_filler;
+
+         else if ((from += p * in) < 16)
+            shuffle[to] = (png_byte)from;
+
+         else
+            shuffle[16 + to] = (png_byte)(from - 16);
+      }
+   }
+
+   pp->read_fused = png_do_read_fused_ssse3;
+}
+#endif /* READ_TRANSFORMS */
+#endif /* PNG_INTEL_SSE_IMPLEMENTATION > 0 */
+#endif /* PNG_READ_SUPPORTED */
@@ -0,0 +1,134 @@
+
+/* transform_ssse3_intrinsics.c - SSSE3 fused read transforms
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * png_init_read_fused describes the transforms as a byte map of one pixel;
+ * png_init_read_fused_sse2 turns that into pshufb controls for four pixels,
+ * which go through one or two 16-byte loads and come out as 4 to 16 bytes.
+ */
+
+#include "../pngpriv.h"
+
+#ifdef PNG_READ_SUPPORTED
+#ifdef PNG_READ_TRANSFORMS_SUPPORTED
+
+#if PNG_INTEL_SSE_IMPLEMENTATION > 0
+
+#include <immintrin.h>
+
+PNG_INTEL_TARGET("ssse3") void
+png_do_read_fused_ssse3(png_structrp png_ptr, png_row_infop row_info,
+    png_bytep row)
+{
+   png_uint_32 width = row_info->width;
+   png_size_t in = 4 * png_ptr->read_fused_in;
+   png_size_t out = 4 * png_ptr->read_fused_out;
+   const __m128i lo = _mm_loadu_si128(
+       (const __m128i *)png_ptr->read_fused_shuffle);
+   const __m128i hi = _mm_loadu_si128(
+       (const __m128i *)(png_ptr->read_fused_shuffle + 16));
+   const __m128i fill = _mm_loadu_si128(
+       (const __m128i *)(png_ptr->read_fused_shuffle + 32));
+   png_uint_32 blocks = width >> 2;
+   png_uint_32 i;
+
+   png_debug(1, "in png_do_read_fused_ssse3");
+
+   if (out <= in)
+   {
+      /* Forwards: a block is stored over the input already loaded, but its
+       * loads reach up to 32 bytes on so the last blocks may be left to C.
+       */
+      png_size_t span = in > 16 ? 32 : 16;
+      png_size_t in_bytes = (png_size_t)width * (in >> 2);
+
+      while (blocks > 0 && (blocks - 1) * in + span > in_bytes)
+         --blocks;
+
+      for (i = 0; i < blocks; ++i)
+      {
+         png_const_bytep sp = row + i * in;
+         png_bytep dp = row + i * out;
+         __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)sp),
+             lo);
+
+         if (in > 16)
+            x = _mm_or_si128(x, _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i *)(sp + 16)), hi));
+
+         x = _mm_or_si128(x, fill);
+
+         if (out == 16)
+            _mm_storeu_si128((__m128i *)dp, x);
+
+         else
+         {
+            if ((out & 8) != 0)
+            {
+               _mm_storel_epi64((__m128i *)dp, x);
+               x = _mm_srli_si128(x, 8);
+               dp += 8;
+            }
+
+            if ((out & 4) != 0)
+            {
+               png_uint_32 v = (png_uint_32)_mm_cvtsi128_si32(x);
+
+               memcpy(dp, &v, 4);
+            }
+         }
+      }
+
+      png_do_read_fused_pixels(png_ptr, row, blocks << 2,
+          width - (blocks << 2));
+   }
+
+   else
+   {
+      /* Backwards, with at most 12 input bytes in a block; the pixels past
+       * the last block whose 16-byte load stays inside the output row are
+       * done first, in C.
+       */
+      png_size_t out_bytes = (png_size_t)width * (out >> 2);
+
+      while (blocks > 0 && (blocks - 1) * in + 16 > out_bytes)
+         --blocks;
+
+      png_do_read_fused_pixels(png_ptr, row, blocks << 2,
+          width - (blocks << 2));
+
+      for (i = blocks; i > 0; --i)
+      {
+         png_const_bytep sp = row + (i - 1) * in;
+         png_bytep dp = row + (i - 1) * out;
+         __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)sp),
+             lo);
+
+         x = _mm_or_si128(x, fill);
+
+         if (out == 16)
+            _mm_storeu_si128((__m128i *)dp, x);
+
+         else
+         {
+            /* 8 or 12: two or three bytes per pixel */
+            _mm_storel_epi64((__m128i *)dp, x);
+
+            if ((out & 4) != 0)
+            {
+               png_uint_32 v = (png_uint_32)_mm_cvtsi128_si32(
+                   _mm_srli_si128(x, 8));
+
+               memcpy(dp + 8, &v, 4);
+            }
+         }
+      }
+   }
+}
+
+#endif /* PNG_INTEL_SSE_IMPLEMENTATION > 0 */
+#endif /* READ_TRANSFORMS */
+#endif /* PNG_READ_SUPPORTED */
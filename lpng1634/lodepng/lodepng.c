@@ -3052,82 +3052,64 @@ static void addColorBits(unsigned char* out, size_t index, unsigned bits, unsign
   else out[index * bits / 8] |= in;
 }
 
-typedef struct ColorTree ColorTree;
+typedef struct ColorTable ColorTable;
 
 /*
-One node of a color tree
+Open addressing hash table of colors, keyed by the packed 32-bit RGBA value.
 This is the data structure used to count the number of unique colors and to get a palette
-index for a color. It's like an octree, but because the alpha channel is used too, each
-node has 16 instead of 8 children.
+index for a color. It lives on the stack, never allocates and holds at most
+COLOR_TABLE_MAX colors, which is one more than a palette can have.
 */
-struct ColorTree
+#define COLOR_TABLE_MAX 257
+#define COLOR_TABLE_SIZE 512 /*power of two, keeps the load factor at or below one half*/
+struct ColorTable
 {
-  ColorTree* children[16]; /*up to 16 pointers to ColorTree of next level*/
-  int index; /*the payload. Only has a meaningful value if this is in the last level*/
+  unsigned keys[COLOR_TABLE_SIZE]; /*packed RGBA, only meaningful where index is not -1*/
+  short index[COLOR_TABLE_SIZE]; /*the payload, -1 for an empty slot*/
+  unsigned count;
 };
 
-static void color_tree_init(ColorTree* tree)
+static void color_table_init(ColorTable* table)
 {
-  int i;
-  for(i = 0; i != 16; ++i) tree->children[i] = 0;
-  tree->index = -1;
+  unsigned i;
+  for(i = 0; i != COLOR_TABLE_SIZE; ++i) table->index[i] = -1;
+  table->count = 0;
 }
 
-static void color_tree_cleanup(ColorTree* tree)
+static unsigned color_table_key(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
-  int i;
-  for(i = 0; i != 16; ++i)
-  {
-    if(tree->children[i])
-    {
-      color_tree_cleanup(tree->children[i]);
-      lodepng_free(tree->children[i]);
-    }
-  }
+  return ((unsigned)r << 24) | ((unsigned)g << 16) | ((unsigned)b << 8) | (unsigned)a;
 }
 
-/*returns -1 if color not present, its index otherwise*/
-static int color_tree_get(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+/*returns the slot holding key, or the empty slot where it would go*/
+static unsigned color_table_slot(const ColorTable* table, unsigned key)
 {
-  int bit = 0;
-  for(bit = 0; bit < 8; ++bit)
-  {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i]) return -1;
-    else tree = tree->children[i];
-  }
-  return tree ? tree->index : -1;
+  unsigned slot = ((key * 2654435761u) >> 16) & (COLOR_TABLE_SIZE - 1);
+  while(table->index[slot] >= 0 && table->keys[slot] != key) slot = (slot + 1) & (COLOR_TABLE_SIZE - 1);
+  return slot;
 }
 
-#ifdef LODEPNG_COMPILE_ENCODER
-static int color_tree_has(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+/*returns -1 if color not present, its index otherwise*/
+static int color_table_get(const ColorTable* table, unsigned key)
 {
-  return color_tree_get(tree, r, g, b, a) >= 0;
+  return table->index[color_table_slot(table, key)];
 }
-#endif /*LODEPNG_COMPILE_ENCODER*/
 
-/*color is not allowed to already exist.
-Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")*/
-static void color_tree_add(ColorTree* tree,
-                           unsigned char r, unsigned char g, unsigned char b, unsigned char a, unsigned index)
+/*Adds the color if it is not present yet and there is room.
+Returns 1 if it was added, 0 if it was already present or the table is full.*/
+static unsigned color_table_add(ColorTable* table, unsigned key, unsigned index)
 {
-  int bit;
-  for(bit = 0; bit < 8; ++bit)
-  {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i])
-    {
-      tree->children[i] = (ColorTree*)lodepng_malloc(sizeof(ColorTree));
-      color_tree_init(tree->children[i]);
-    }
-    tree = tree->children[i];
-  }
-  tree->index = (int)index;
+  unsigned slot = color_table_slot(table, key);
+  if(table->index[slot] >= 0 || table->count >= COLOR_TABLE_MAX) return 0;
+  table->keys[slot] = key;
+  table->index[slot] = (short)index;
+  ++table->count;
+  return 1;
 }
 
 /*put a pixel, given its RGBA color, into image of any color type*/
 static unsigned rgba8ToPixel(unsigned char* out, size_t i,
-                             const LodePNGColorMode* mode, ColorTree* tree /*for palette*/,
+                             const LodePNGColorMode* mode, const ColorTable* table /*for palette*/,
                              unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
   if(mode->colortype == LCT_GREY)
@@ -3159,7 +3141,7 @@ static unsigned rgba8ToPixel(unsigned char* out, size_t i,
   }
   else if(mode->colortype == LCT_PALETTE)
   {
-    int index = color_tree_get(tree, r, g, b, a);
+    int index = color_table_get(table, color_table_key(r, g, b, a));
     if(index < 0) return 82; /*color not in palette*/
     if(mode->bitdepth == 8) out[i] = index;
     else addColorBits(out, i, mode->bitdepth, (unsigned)index);
@@ -3524,7 +3506,7 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
                          unsigned w, unsigned h)
 {
   size_t i;
-  ColorTree tree;
+  ColorTable table;
   size_t numpixels = (size_t)w * (size_t)h;
   unsigned error = 0;
 
@@ -3558,11 +3540,11 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
       }
     }
     if(palettesize < palsize) palsize = palettesize;
-    color_tree_init(&tree);
+    color_table_init(&table);
     for(i = 0; i != palsize; ++i)
     {
       const unsigned char* p = &palette[i * 4];
-      color_tree_add(&tree, p[0], p[1], p[2], p[3], (unsigned)i);
+      color_table_add(&table, color_table_key(p[0], p[1], p[2], p[3]), (unsigned)i);
     }
   }
 
@@ -3589,16 +3571,11 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
     for(i = 0; i != numpixels; ++i)
     {
       getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
-      error = rgba8ToPixel(out, i, mode_out, &tree, r, g, b, a);
+      error = rgba8ToPixel(out, i, mode_out, &table, r, g, b, a);
       if (error) break;
     }
   }
 
-  if(mode_out->colortype == LCT_PALETTE)
-  {
-    color_tree_cleanup(&tree);
-  }
-
   return error;
 }
 
@@ -3644,7 +3621,7 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 {
   unsigned error = 0;
   size_t i;
-  ColorTree tree;
+  ColorTable table;
   size_t numpixels = (size_t)w * (size_t)h;
 
   unsigned colored_done = lodepng_is_greyscale_type(mode) ? 1 : 0;
@@ -3654,9 +3631,10 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
   unsigned bits_done = bpp == 1 ? 1 : 0;
   unsigned maxnumcolors = 257;
   unsigned sixteen = 0;
+  unsigned lastkey = 0;
   if(bpp <= 8) maxnumcolors = bpp == 1 ? 2 : (bpp == 2 ? 4 : (bpp == 4 ? 16 : 256));
 
-  color_tree_init(&tree);
+  color_table_init(&table);
 
   /*Check if the 16-bit input is truly 16-bit*/
   if(mode->bitdepth == 16)
@@ -3783,9 +3761,10 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 
       if(!numcolors_done)
       {
-        if(!color_tree_has(&tree, r, g, b, a))
+        unsigned key = color_table_key(r, g, b, a);
+        /*runs of the same color are common, skip the lookup for them*/
+        if((i == 0 || key != lastkey) && color_table_add(&table, key, profile->numcolors))
         {
-          color_tree_add(&tree, r, g, b, a, profile->numcolors);
           if(profile->numcolors < 256)
           {
             unsigned char* p = profile->palette;
@@ -3798,6 +3777,7 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
           ++profile->numcolors;
           numcolors_done = profile->numcolors >= maxnumcolors;
         }
+        lastkey = key;
       }
 
       if(alpha_done && numcolors_done && colored_done && bits_done) break;
@@ -3824,8 +3804,6 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
     profile->key_g += (profile->key_g << 8);
     profile->key_b += (profile->key_b << 8);
   }
-
-  color_tree_cleanup(&tree);
   return error;
 }
 
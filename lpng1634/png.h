@@ -1447,10 +1447,24 @@ PNG_EXPORT(63, void, png_destroy_info_struct, (png_const_structrp png_ptr,
 PNG_EXPORT(64, void, png_destroy_read_struct, (png_structpp png_ptr_ptr,
     png_infopp info_ptr_ptr, png_infopp end_info_ptr_ptr));
 
+/* Return the png_struct to its state after png_create_read_struct and empty the
+ * png_info_structs, keeping the zlib stream, buffers and png_set_option
+ * settings for the next image
+ */
+PNG_EXPORT(250, void, png_reset_read_struct, (png_structrp png_ptr,
+    png_inforp info_ptr, png_inforp end_info_ptr));
+
 /* Free any memory associated with the png_struct and the png_info_structs */
 PNG_EXPORT(65, void, png_destroy_write_struct, (png_structpp png_ptr_ptr,
     png_infopp info_ptr_ptr));
 
+/* Return the png_struct to its state after png_create_write_struct and empty
+ * the png_info_struct, keeping the zlib stream, buffers and png_set_option
+ * settings for the next image
+ */
+PNG_EXPORT(251, void, png_reset_write_struct, (png_structrp png_ptr,
+    png_inforp info_ptr));
+
 /* Set the libpng method of handling chunk CRC errors */
 PNG_EXPORT(66, void, png_set_crc_action, (png_structrp png_ptr, int crit_action,
     int ancil_action));
@@ -1622,6 +1636,16 @@ PNG_EXPORT(77, void, png_set_write_fn, (png_structrp png_ptr, png_voidp io_ptr,
 PNG_EXPORT(78, void, png_set_read_fn, (png_structrp png_ptr, png_voidp io_ptr,
     png_rw_ptr read_data_fn));
 
+#ifdef PNG_READ_SUPPORTED
+/* Read the PNG from size bytes at buffer, which must stay readable and
+ * unchanged until the image has been read.  Chunk headers, CRCs and IDAT
+ * data are used from the buffer where they lie instead of being copied out
+ * first.  png_set_read_fn or png_reset_read_struct ends it.
+ */
+PNG_EXPORT(252, void, png_set_read_memory, (png_structrp png_ptr,
+    png_const_voidp buffer, png_size_t size));
+#endif
+
 /* Return the user pointer associated with the I/O functions */
 PNG_EXPORT(79, png_voidp, png_get_io_ptr, (png_const_structrp png_ptr));
 
@@ -3023,6 +3047,16 @@ PNG_EXPORT(236, int, png_image_begin_read_from_memory, (png_imagep image,
    png_const_voidp memory, png_size_t size));
    /* The PNG header is read from the given memory buffer. */
 
+#ifdef PNG_STDIO_SUPPORTED
+PNG_EXPORT(253, int, png_image_begin_read_from_mmap, (png_imagep image,
+   const char *file_name));
+   /* The named file is mapped into memory and read from the mapping as by
+    * png_image_begin_read_from_memory; the mapping is released with the rest
+    * of the png_image.  Where files cannot be mapped this is the same as
+    * png_image_begin_read_from_file.
+    */
+#endif /* STDIO */
+
 PNG_EXPORT(237, int, png_image_finish_read, (png_imagep image,
    png_const_colorp background, void *buffer, png_int_32 row_stride,
    void *colormap));
@@ -3242,7 +3276,10 @@ PNG_EXPORT(245, int, png_image_write_to_memory, (png_imagep image, void *memory,
 #ifdef PNG_POWERPC_VSX_API_SUPPORTED
 #  define PNG_POWERPC_VSX   10 /* HARDWARE: PowerPC VSX SIMD instructions supported */
 #endif
-#define PNG_OPTION_NEXT  12 /* Next option - numbers must be even */
+#define PNG_INTEL_SIMD 12 /* HARDWARE: x86 SSE2/SSSE3/AVX2 filters, CPUID checked */
+#define PNG_IDAT_BATCH 14 /* SOFTWARE: inflate many rows at once, unless OFF */
+#define PNG_READ_FUSED 16 /* SOFTWARE: one pass row transforms, unless OFF */
+#define PNG_OPTION_NEXT  18 /* Next option - numbers must be even */
 
 /* Return values: NOTE: there are four values and 'off' is *not* zero */
 #define PNG_OPTION_UNSET   0 /* Unset - defaults to off */
@@ -3266,7 +3303,7 @@ PNG_EXPORT(244, int, png_set_option, (png_structrp png_ptr, int option,
  * one to use is one more than this.)
  */
 #ifdef PNG_EXPORT_LAST_ORDINAL
-  PNG_EXPORT_LAST_ORDINAL(249);
+  PNG_EXPORT_LAST_ORDINAL(253);
 #endif
 
 #ifdef __cplusplus
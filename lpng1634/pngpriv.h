@@ -204,7 +204,7 @@
 #   ifdef PNG_INTEL_SSE
       /* Only check for SSE if the build configuration has been modified to
        * enable SSE optimizations.  This means that these optimizations will
-       * be off by default.  See contrib/intel for more details.
+       * be off by default.  See intel/intel_init.c for more details.
        */
 #     if defined(__SSE4_1__) || defined(__AVX__) || defined(__SSSE3__) || \
        defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || \
@@ -233,6 +233,17 @@
 
 #   if PNG_INTEL_SSE_IMPLEMENTATION > 0
 #      define PNG_FILTER_OPTIMIZATIONS png_init_filter_functions_sse2
+#      define PNG_READ_FUSED_OPTIMIZATIONS png_init_read_fused_sse2
+#   endif
+
+   /* The SSSE3 and AVX2 filters are built whatever the implementation level
+    * and only installed when CPUID reports the instructions, so GCC and clang
+    * have to be told per function which instructions they may use.
+    */
+#   if defined(__GNUC__) || defined(__clang__)
+#      define PNG_INTEL_TARGET(isa) __attribute__((target(isa)))
+#   else
+#      define PNG_INTEL_TARGET(isa)
 #   endif
 #endif
 
@@ -1082,6 +1093,12 @@ PNG_INTERNAL_FUNCTION(png_uint_32,png_read_chunk_header,(png_structrp png_ptr),
 PNG_INTERNAL_FUNCTION(void,png_read_data,(png_structrp png_ptr, png_bytep data,
     png_size_t length),PNG_EMPTY);
 
+/* With png_set_read_memory return a pointer to the next length bytes where they
+ * lie and step over them, otherwise return NULL and read nothing.
+ */
+PNG_INTERNAL_FUNCTION(png_const_bytep,png_read_data_in_place,
+    (png_structrp png_ptr, png_size_t length),PNG_EMPTY);
+
 /* Read bytes into buf, and update png_ptr->crc */
 PNG_INTERNAL_FUNCTION(void,png_crc_read,(png_structrp png_ptr, png_bytep buf,
     png_uint_32 length),PNG_EMPTY);
@@ -1341,18 +1358,52 @@ PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth4_vsx,(png_row_infop
 #endif
 
 #if PNG_INTEL_SSE_IMPLEMENTATION > 0
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_up_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
 PNG_INTERNAL_FUNCTION(void,png_read_filter_row_sub3_sse2,(png_row_infop
     row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
 PNG_INTERNAL_FUNCTION(void,png_read_filter_row_sub4_sse2,(png_row_infop
     row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_sub6_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_sub8_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
 PNG_INTERNAL_FUNCTION(void,png_read_filter_row_avg3_sse2,(png_row_infop
     row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
 PNG_INTERNAL_FUNCTION(void,png_read_filter_row_avg4_sse2,(png_row_infop
     row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_avg6_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_avg8_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
 PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth3_sse2,(png_row_infop
     row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
 PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth4_sse2,(png_row_infop
     row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth6_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth8_sse2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth3_ssse3,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth4_ssse3,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth6_ssse3,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth8_ssse3,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_up_avx2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_sub4_avx2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_read_filter_row_sub8_avx2,(png_row_infop
+    row_info, png_bytep row, png_const_bytep prev_row),PNG_EMPTY);
+#ifdef PNG_READ_TRANSFORMS_SUPPORTED
+PNG_INTERNAL_FUNCTION(void,png_do_read_fused_ssse3,(png_structrp png_ptr,
+    png_row_infop row_info, png_bytep row),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_init_read_fused_sse2,(png_structrp png_ptr),
+    PNG_EMPTY);
+#endif
 #endif
 
 /* Choose the best filter to use and filter the row data */
@@ -1367,6 +1418,12 @@ PNG_INTERNAL_FUNCTION(void,png_read_IDAT_data,(png_structrp png_ptr,
     * case a benign error will be issued if the stream end is not found or if
     * extra data has to be consumed.
     */
+PNG_INTERNAL_FUNCTION(void,png_read_IDAT_row,(png_structrp png_ptr,
+   png_row_infop row_info),PNG_EMPTY);
+   /* Unfilter the next row of the batch into row_buf, inflating more rows when
+    * the batch runs out.  png_read_row uses this instead of png_read_IDAT_data
+    * while png_read_start_row has left image bytes in idat_batch_left.
+    */
 PNG_INTERNAL_FUNCTION(void,png_read_finish_IDAT,(png_structrp png_ptr),
    PNG_EMPTY);
    /* This cleans up when the IDAT LZ stream does not end when the last image
@@ -1563,6 +1620,12 @@ PNG_INTERNAL_FUNCTION(void,png_do_write_transformations,(png_structrp png_ptr,
 #ifdef PNG_READ_TRANSFORMS_SUPPORTED
 PNG_INTERNAL_FUNCTION(void,png_init_read_transformations,(png_structrp png_ptr),
     PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_init_read_fused,(png_structrp png_ptr),
+    PNG_EMPTY);
+#ifdef PNG_READ_FUSED_OPTIMIZATIONS
+PNG_INTERNAL_FUNCTION(void,png_do_read_fused_pixels,(png_structrp png_ptr,
+    png_bytep row, png_uint_32 first, png_uint_32 count),PNG_EMPTY);
+#endif
 #endif
 
 #ifdef PNG_PROGRESSIVE_READ_SUPPORTED
@@ -2034,8 +2097,23 @@ typedef struct png_control
 
    unsigned int for_write       :1; /* Otherwise it is a read structure */
    unsigned int owned_file      :1; /* We own the file in io_ptr */
+   unsigned int owned_mapping   :1; /* memory is a mapping of the file */
 } png_control;
 
+/* Where png_image_begin_read_from_mmap can map the file; elsewhere it reads
+ * the file with stdio.
+ */
+#if defined(_WIN32) || defined(__WIN32__)
+#  define PNG_IMAGE_MMAP_WIN32
+#elif defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#  define PNG_IMAGE_MMAP_POSIX
+#endif
+
+#if defined(PNG_SIMPLIFIED_READ_SUPPORTED) && defined(PNG_STDIO_SUPPORTED)
+/* Release the file mapped by png_image_begin_read_from_mmap, if any. */
+PNG_INTERNAL_FUNCTION(void,png_image_unmap_file,(png_controlp cp),PNG_EMPTY);
+#endif
+
 /* Return the pointer to the jmp_buf from a png_control: necessary because C
  * does not reveal the type of the elements of jmp_buf.
  */
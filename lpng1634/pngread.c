@@ -17,10 +17,52 @@
 #include "pngpriv.h"
 #if defined(PNG_SIMPLIFIED_READ_SUPPORTED) && defined(PNG_STDIO_SUPPORTED)
 #  include <errno.h>
+#  if defined(PNG_IMAGE_MMAP_WIN32) || defined(PNG_IMAGE_MMAP_POSIX)
+#    include <sys/types.h>
+#    include <sys/stat.h>
+#  endif
+#  ifdef PNG_IMAGE_MMAP_POSIX
+#    include <sys/mman.h>
+#    include <fcntl.h>
+#    include <unistd.h>
+#  endif
 #endif
 
 #ifdef PNG_READ_SUPPORTED
 
+/* Set up the read specific defaults of a new png_struct, shared by
+ * png_create_read_struct_2 and png_reset_read_struct.
+ */
+static void
+png_read_struct_defaults(png_structrp png_ptr)
+{
+   png_ptr->mode = PNG_IS_READ_STRUCT;
+
+   /* Added in libpng-1.6.0; this can be used to detect a read structure if
+    * required (it will be zero in a write structure.)
+    */
+#  ifdef PNG_SEQUENTIAL_READ_SUPPORTED
+      png_ptr->IDAT_read_size = PNG_IDAT_READ_SIZE;
+#  endif
+
+#  ifdef PNG_BENIGN_READ_ERRORS_SUPPORTED
+      png_ptr->flags |= PNG_FLAG_BENIGN_ERRORS_WARN;
+
+      /* In stable builds only warn if an application error can be completely
+       * handled.
+       */
+#     if PNG_RELEASE_BUILD
+         png_ptr->flags |= PNG_FLAG_APP_WARNINGS_WARN;
+#     endif
+#  endif
+
+   /* TODO: delay this, it can be done in png_init_io (if the app doesn't
+    * do it itself) avoiding setting the default function if it is not
+    * required.
+    */
+   png_set_read_fn(png_ptr, NULL, NULL);
+}
+
 /* Create a PNG structure for reading, and allocate any memory needed. */
 PNG_FUNCTION(png_structp,PNGAPI
 png_create_read_struct,(png_const_charp user_png_ver, png_voidp error_ptr,
@@ -47,33 +89,7 @@ png_create_read_struct_2,(png_const_charp user_png_ver, png_voidp error_ptr,
 #endif /* USER_MEM */
 
    if (png_ptr != NULL)
-   {
-      png_ptr->mode = PNG_IS_READ_STRUCT;
-
-      /* Added in libpng-1.6.0; this can be used to detect a read structure if
-       * required (it will be zero in a write structure.)
-       */
-#     ifdef PNG_SEQUENTIAL_READ_SUPPORTED
-         png_ptr->IDAT_read_size = PNG_IDAT_READ_SIZE;
-#     endif
-
-#     ifdef PNG_BENIGN_READ_ERRORS_SUPPORTED
-         png_ptr->flags |= PNG_FLAG_BENIGN_ERRORS_WARN;
-
-         /* In stable builds only warn if an application error can be completely
-          * handled.
-          */
-#        if PNG_RELEASE_BUILD
-            png_ptr->flags |= PNG_FLAG_APP_WARNINGS_WARN;
-#        endif
-#     endif
-
-      /* TODO: delay this, it can be done in png_init_io (if the app doesn't
-       * do it itself) avoiding setting the default function if it is not
-       * required.
-       */
-      png_set_read_fn(png_ptr, NULL, NULL);
-   }
+      png_read_struct_defaults(png_ptr);
 
    return png_ptr;
 }
@@ -538,25 +554,35 @@ png_read_row(png_structrp png_ptr, png_bytep row, png_bytep dsp_row)
    if ((png_ptr->mode & PNG_HAVE_IDAT) == 0)
       png_error(png_ptr, "Invalid attempt to read row data");
 
-   /* Fill the row with IDAT data: */
-   png_ptr->row_buf[0]=255; /* to force error if no data was found */
-   png_read_IDAT_data(png_ptr, png_ptr->row_buf, row_info.rowbytes + 1);
+   /* Rows inflated together are unfiltered in the batch buffer and copied to
+    * row_buf, see png_read_start_row for when this is done.
+    */
+   if (png_ptr->idat_batch_left > 0 ||
+       png_ptr->idat_batch_next < png_ptr->idat_batch_end)
+      png_read_IDAT_row(png_ptr, &row_info);
 
-   if (png_ptr->row_buf[0] > PNG_FILTER_VALUE_NONE)
+   else
    {
-      if (png_ptr->row_buf[0] < PNG_FILTER_VALUE_LAST)
-         png_read_filter_row(png_ptr, &row_info, png_ptr->row_buf + 1,
-             png_ptr->prev_row + 1, png_ptr->row_buf[0]);
-      else
-         png_error(png_ptr, "bad adaptive filter value");
-   }
+      /* Fill the row with IDAT data: */
+      png_ptr->row_buf[0]=255; /* to force error if no data was found */
+      png_read_IDAT_data(png_ptr, png_ptr->row_buf, row_info.rowbytes + 1);
 
-   /* libpng 1.5.6: the following line was copying png_ptr->rowbytes before
-    * 1.5.6, while the buffer really is this big in current versions of libpng
-    * it may not be in the future, so this was changed just to copy the
-    * interlaced count:
-    */
-   memcpy(png_ptr->prev_row, png_ptr->row_buf, row_info.rowbytes + 1);
+      if (png_ptr->row_buf[0] > PNG_FILTER_VALUE_NONE)
+      {
+         if (png_ptr->row_buf[0] < PNG_FILTER_VALUE_LAST)
+            png_read_filter_row(png_ptr, &row_info, png_ptr->row_buf + 1,
+                png_ptr->prev_row + 1, png_ptr->row_buf[0]);
+         else
+            png_error(png_ptr, "bad adaptive filter value");
+      }
+
+      /* libpng 1.5.6: the following line was copying png_ptr->rowbytes before
+       * 1.5.6, while the buffer really is this big in current versions of
+       * libpng it may not be in the future, so this was changed just to copy
+       * the interlaced count:
+       */
+      memcpy(png_ptr->prev_row, png_ptr->row_buf, row_info.rowbytes + 1);
+   }
 
 #ifdef PNG_MNG_FEATURES_SUPPORTED
    if ((png_ptr->mng_features_permitted & PNG_FLAG_MNG_FILTER_64) != 0 &&
@@ -951,6 +977,15 @@ png_read_destroy(png_structrp png_ptr)
    png_ptr->big_prev_row = NULL;
    png_free(png_ptr, png_ptr->read_buffer);
    png_ptr->read_buffer = NULL;
+#ifdef PNG_SEQUENTIAL_READ_SUPPORTED
+   png_free(png_ptr, png_ptr->idat_batch);
+   png_ptr->idat_batch = NULL;
+#endif
+
+#ifdef PNG_READ_TRANSFORMS_SUPPORTED
+   png_free(png_ptr, png_ptr->read_fused_table);
+   png_ptr->read_fused_table = NULL;
+#endif
 
 #ifdef PNG_READ_QUANTIZE_SUPPORTED
    png_free(png_ptr, png_ptr->palette_lookup);
@@ -976,8 +1011,6 @@ png_read_destroy(png_structrp png_ptr)
    png_ptr->free_me &= ~PNG_FREE_TRNS;
 #endif
 
-   inflateEnd(&png_ptr->zstream);
-
 #ifdef PNG_PROGRESSIVE_READ_SUPPORTED
    png_free(png_ptr, png_ptr->save_buffer);
    png_ptr->save_buffer = NULL;
@@ -1024,9 +1057,126 @@ png_destroy_read_struct(png_structpp png_ptr_ptr, png_infopp info_ptr_ptr,
 
    *png_ptr_ptr = NULL;
    png_read_destroy(png_ptr);
+   inflateEnd(&png_ptr->zstream);
    png_destroy_png_struct(png_ptr);
 }
 
+/* Return a read struct to the state png_create_read_struct left it in so that
+ * the next PNG can be read with it, without giving back what is costly to set
+ * up again: the inflate state with its window, the row buffers, the IDAT read
+ * buffer and the fused transform table.  The error, warning and memory
+ * functions, the setjmp buffer allocation and the png_set_option settings are
+ * kept; every other setting (transforms, read function, user limits, chunk
+ * handling) goes back to its default.  The info structs are emptied as if they
+ * had just been created.  Call this between images, the application has to
+ * call setjmp again before reading the next one.
+ */
+void PNGAPI
+png_reset_read_struct(png_structrp png_ptr, png_inforp info_ptr,
+    png_inforp end_info_ptr)
+{
+   png_struct keep;
+
+   png_debug(1, "in png_reset_read_struct");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (info_ptr != NULL)
+   {
+      png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
+      memset(info_ptr, 0, (sizeof *info_ptr));
+   }
+
+   if (end_info_ptr != NULL)
+   {
+      png_free_data(png_ptr, end_info_ptr, PNG_FREE_ALL, -1);
+      memset(end_info_ptr, 0, (sizeof *end_info_ptr));
+   }
+
+   /* Take the kept buffers out of the struct while the rest is freed. */
+   keep = *png_ptr;
+   png_ptr->big_row_buf = NULL;
+   png_ptr->big_prev_row = NULL;
+   png_ptr->read_buffer = NULL;
+#  ifdef PNG_SEQUENTIAL_READ_SUPPORTED
+      png_ptr->idat_batch = NULL;
+#  endif
+#  ifdef PNG_READ_TRANSFORMS_SUPPORTED
+      png_ptr->read_fused_table = NULL;
+#  endif
+   png_read_destroy(png_ptr);
+
+   memset(png_ptr, 0, (sizeof *png_ptr));
+
+#  ifdef PNG_USER_LIMITS_SUPPORTED
+      png_ptr->user_width_max = PNG_USER_WIDTH_MAX;
+      png_ptr->user_height_max = PNG_USER_HEIGHT_MAX;
+
+#     ifdef PNG_USER_CHUNK_CACHE_MAX
+      png_ptr->user_chunk_cache_max = PNG_USER_CHUNK_CACHE_MAX;
+#     endif
+
+#     ifdef PNG_USER_CHUNK_MALLOC_MAX
+      png_ptr->user_chunk_malloc_max = PNG_USER_CHUNK_MALLOC_MAX;
+#     endif
+#  endif
+
+#  ifdef PNG_SETJMP_SUPPORTED
+      png_ptr->longjmp_fn = keep.longjmp_fn;
+      png_ptr->jmp_buf_size = keep.jmp_buf_size;
+
+      /* The local jmp_buf is at the same address, an allocated one is kept. */
+      png_ptr->jmp_buf_ptr = keep.jmp_buf_ptr;
+#  endif
+
+   png_ptr->error_fn = keep.error_fn;
+#  ifdef PNG_WARNINGS_SUPPORTED
+      png_ptr->warning_fn = keep.warning_fn;
+#  endif
+   png_ptr->error_ptr = keep.error_ptr;
+
+#  ifdef PNG_USER_MEM_SUPPORTED
+      png_ptr->mem_ptr = keep.mem_ptr;
+      png_ptr->malloc_fn = keep.malloc_fn;
+      png_ptr->free_fn = keep.free_fn;
+#  endif
+
+#  ifdef PNG_SET_OPTION_SUPPORTED
+      /* Options such as PNG_INTEL_SIMD are set once for the struct. */
+      png_ptr->options = keep.options;
+#  endif
+
+   /* png_inflate_claim resets the stream with inflateReset2 when the next IDAT
+    * (or compressed chunk) claims it, so the state and window are reused.
+    */
+   png_ptr->zstream = keep.zstream;
+   png_ptr->flags = keep.flags & PNG_FLAG_ZSTREAM_INITIALIZED;
+
+   /* png_read_start_row only reallocates the row buffers when they are too
+    * small, row_buf and prev_row must keep pointing into them.
+    */
+   png_ptr->big_row_buf = keep.big_row_buf;
+   png_ptr->big_prev_row = keep.big_prev_row;
+   png_ptr->row_buf = keep.row_buf;
+   png_ptr->prev_row = keep.prev_row;
+   png_ptr->old_big_row_buf_size = keep.old_big_row_buf_size;
+   png_ptr->read_buffer = keep.read_buffer;
+   png_ptr->read_buffer_size = keep.read_buffer_size;
+
+#  ifdef PNG_SEQUENTIAL_READ_SUPPORTED
+      png_ptr->idat_batch = keep.idat_batch;
+      png_ptr->idat_batch_size = keep.idat_batch_size;
+#  endif
+
+   /* Always 256 entries, png_init_read_fused only fills it in again. */
+#  ifdef PNG_READ_TRANSFORMS_SUPPORTED
+      png_ptr->read_fused_table = keep.read_fused_table;
+#  endif
+
+   png_read_struct_defaults(png_ptr);
+}
+
 void PNGAPI
 png_set_read_status_fn(png_structrp png_ptr, png_read_status_ptr read_row_fn)
 {
@@ -1531,69 +1681,165 @@ png_image_begin_read_from_file(png_imagep image, const char *file_name)
 }
 #endif /* STDIO */
 
-static void PNGCBAPI
-png_image_memory_read(png_structp png_ptr, png_bytep out, png_size_t need)
+int PNGAPI png_image_begin_read_from_memory(png_imagep image,
+    png_const_voidp memory, png_size_t size)
 {
-   if (png_ptr != NULL)
+   if (image != NULL && image->version == PNG_IMAGE_VERSION)
    {
-      png_imagep image = png_voidcast(png_imagep, png_ptr->io_ptr);
-      if (image != NULL)
+      if (memory != NULL && size > 0)
       {
-         png_controlp cp = image->opaque;
-         if (cp != NULL)
+         if (png_image_read_init(image) != 0)
          {
-            png_const_bytep memory = cp->memory;
-            png_size_t size = cp->size;
-
-            if (memory != NULL && size >= need)
-            {
-               memcpy(out, memory, need);
-               cp->memory = memory + need;
-               cp->size = size - need;
-               return;
-            }
+            /* Now read straight from the memory buffer.  png_set_read_memory
+             * cannot fail with a buffer, so it needs no error handling.
+             */
+            png_set_read_memory(image->opaque->png_ptr, memory, size);
 
-            png_error(png_ptr, "read beyond end of data");
+            return png_safe_execute(image, png_image_read_header, image);
          }
       }
 
-      png_error(png_ptr, "invalid memory read");
+      else
+         return png_image_error(image,
+             "png_image_begin_read_from_memory: invalid argument");
    }
+
+   else if (image != NULL)
+      return png_image_error(image,
+          "png_image_begin_read_from_memory: incorrect PNG_IMAGE_VERSION");
+
+   return 0;
 }
 
-int PNGAPI png_image_begin_read_from_memory(png_imagep image,
-    png_const_voidp memory, png_size_t size)
+#ifdef PNG_STDIO_SUPPORTED
+static void
+png_image_unmap(png_const_bytep memory, png_size_t size)
+{
+   png_voidp mapping = png_constcast(png_voidp, memory);
+
+#  if defined(PNG_IMAGE_MMAP_WIN32)
+      PNG_UNUSED(size)
+      (void)UnmapViewOfFile(mapping);
+#  elif defined(PNG_IMAGE_MMAP_POSIX)
+      (void)munmap(mapping, size);
+#  else
+      PNG_UNUSED(mapping)
+      PNG_UNUSED(size)
+#  endif
+}
+
+void /* PRIVATE */
+png_image_unmap_file(png_controlp cp)
+{
+   if (cp->owned_mapping != 0)
+   {
+      cp->owned_mapping = 0;
+      png_image_unmap(cp->memory, cp->size);
+      cp->memory = NULL;
+      cp->size = 0;
+   }
+}
+
+/* Map the whole file, or return NULL so that the caller reads it with stdio;
+ * empty files, pipes and file systems that cannot be mapped take that route.
+ */
+static png_const_bytep
+png_image_map_file(const char *file_name, png_size_t *size)
+{
+#  if defined(PNG_IMAGE_MMAP_WIN32)
+      HANDLE file, mapping;
+      LARGE_INTEGER file_size;
+      png_voidp view = NULL;
+
+      file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL,
+          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+      if (file == INVALID_HANDLE_VALUE)
+         return NULL;
+
+      if (GetFileSizeEx(file, &file_size) != 0 && file_size.QuadPart > 0 &&
+          (unsigned __int64)file_size.QuadPart <= PNG_SIZE_MAX)
+      {
+         /* The view keeps the mapping open once both handles are closed. */
+         mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+         if (mapping != NULL)
+         {
+            view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            (void)CloseHandle(mapping);
+         }
+
+         *size = (png_size_t)file_size.QuadPart;
+      }
+
+      (void)CloseHandle(file);
+      return png_voidcast(png_const_bytep, view);
+
+#  elif defined(PNG_IMAGE_MMAP_POSIX)
+      struct stat st;
+      png_voidp view = MAP_FAILED;
+      int fd = open(file_name, O_RDONLY);
+
+      if (fd < 0)
+         return NULL;
+
+      if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+          (unsigned long long)st.st_size <= PNG_SIZE_MAX)
+      {
+         *size = (png_size_t)st.st_size;
+         view = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+      }
+
+      (void)close(fd);
+      return view != MAP_FAILED ? png_voidcast(png_const_bytep, view) : NULL;
+
+#  else
+      PNG_UNUSED(file_name)
+      PNG_UNUSED(size)
+      return NULL;
+#  endif
+}
+
+int PNGAPI
+png_image_begin_read_from_mmap(png_imagep image, const char *file_name)
 {
    if (image != NULL && image->version == PNG_IMAGE_VERSION)
    {
-      if (memory != NULL && size > 0)
+      if (file_name != NULL)
       {
+         png_size_t size = 0;
+         png_const_bytep memory = png_image_map_file(file_name, &size);
+
+         if (memory == NULL)
+            return png_image_begin_read_from_file(image, file_name);
+
          if (png_image_read_init(image) != 0)
          {
-            /* Now set the IO functions to read from the memory buffer and
-             * store it into io_ptr.  Again do this in-place to avoid calling a
-             * libpng function that requires error handling.
-             */
-            image->opaque->memory = png_voidcast(png_const_bytep, memory);
+            /* png_image_free_function unmaps the file with the rest. */
+            image->opaque->memory = memory;
             image->opaque->size = size;
-            image->opaque->png_ptr->io_ptr = image;
-            image->opaque->png_ptr->read_data_fn = png_image_memory_read;
+            image->opaque->owned_mapping = 1;
+            png_set_read_memory(image->opaque->png_ptr, memory, size);
 
             return png_safe_execute(image, png_image_read_header, image);
          }
+
+         /* Clean up: just the mapping. */
+         png_image_unmap(memory, size);
       }
 
       else
          return png_image_error(image,
-             "png_image_begin_read_from_memory: invalid argument");
+             "png_image_begin_read_from_mmap: invalid argument");
    }
 
    else if (image != NULL)
       return png_image_error(image,
-          "png_image_begin_read_from_memory: incorrect PNG_IMAGE_VERSION");
+          "png_image_begin_read_from_mmap: incorrect PNG_IMAGE_VERSION");
 
    return 0;
 }
+#endif /* STDIO */
 
 /* Utility function to skip chunks that are not used by the simplified image
  * read functions and an appropriate macro to call it.
@@ -40,6 +40,38 @@ png_read_data(png_structrp png_ptr, png_bytep data, png_size_t length)
       png_error(png_ptr, "Call to NULL read function");
 }
 
+/* The read function installed by png_set_read_memory, used for everything
+ * that is not read in place.
+ */
+static void PNGCBAPI
+png_memory_read_data(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+   png_const_bytep in_place = png_read_data_in_place(png_ptr, length);
+
+   if (in_place == NULL)
+      png_error(png_ptr, "read beyond end of data");
+
+   memcpy(data, in_place, length);
+}
+
+png_const_bytep /* PRIVATE */
+png_read_data_in_place(png_structrp png_ptr, png_size_t length)
+{
+   png_const_bytep in_place;
+
+   if (png_ptr->read_memory == NULL ||
+       png_ptr->read_data_fn != png_memory_read_data)
+      return NULL;
+
+   if (length > png_ptr->read_memory_size - png_ptr->read_memory_pos)
+      png_error(png_ptr, "read beyond end of data");
+
+   in_place = png_ptr->read_memory + png_ptr->read_memory_pos;
+   png_ptr->read_memory_pos += length;
+
+   return in_place;
+}
+
 #ifdef PNG_STDIO_SUPPORTED
 /* This is the function that does the actual reading of data.  If you are
  * not reading from a standard C stream, you should create a replacement
@@ -91,6 +123,7 @@ png_set_read_fn(png_structrp png_ptr, png_voidp io_ptr,
       return;
 
    png_ptr->io_ptr = io_ptr;
+   png_ptr->read_memory = NULL;
 
 #ifdef PNG_STDIO_SUPPORTED
    if (read_data_fn != NULL)
@@ -117,4 +150,27 @@ png_set_read_fn(png_structrp png_ptr, png_voidp io_ptr,
    png_ptr->output_flush_fn = NULL;
 #endif
 }
+
+/* Reading from memory needs no read function of the application's, and the
+ * data can be given to inflate and the CRC code without copying it.
+ */
+void PNGAPI
+png_set_read_memory(png_structrp png_ptr, png_const_voidp buffer,
+    png_size_t size)
+{
+   if (png_ptr == NULL)
+      return;
+
+   if (buffer == NULL && size > 0)
+   {
+      png_app_error(png_ptr, "png_set_read_memory: no buffer");
+      return;
+   }
+
+   png_set_read_fn(png_ptr, NULL, png_memory_read_data);
+
+   png_ptr->read_memory = png_voidcast(png_const_bytep, buffer);
+   png_ptr->read_memory_size = size;
+   png_ptr->read_memory_pos = 0;
+}
 #endif /* READ */
@@ -4709,6 +4709,355 @@ png_do_quantize(png_row_infop row_info, png_bytep row,
 }
 #endif /* READ_QUANTIZE */
 
+/* Fused transforms.  The common chains - palette or gray to RGB or RGBA, RGB
+ * with a filler and 16 to 8 bit stripping, with BGR, filler and alpha
+ * stripping on top - only move or copy bytes.  png_init_read_fused, called
+ * at the end of png_read_start_row, recognizes them and describes the output
+ * pixel either as four bytes looked up by the palette index or gray value or
+ * as a byte map of one input pixel, which needs a SIMD kernel to be worth
+ * it; png_do_read_transformations then makes one pass over the row.  Anything
+ * else uses the passes one after another.
+ */
+#define PNG_FUSED_TRANSFORMS (PNG_EXPAND | PNG_EXPAND_tRNS | PNG_STRIP_ALPHA |\
+   PNG_GRAY_TO_RGB | PNG_16_TO_8 | PNG_SCALE_16_TO_8 | PNG_BGR | PNG_FILLER |\
+   PNG_ADD_ALPHA | PNG_INTERLACE | PNG_PACK | PNG_PACKSWAP | PNG_SWAP_BYTES)
+#define PNG_FUSED_FILL 4 /* output channel holding the filler */
+
+/* Palette and gray rows of 1, 2, 4 or 8 bits; the table has four bytes for
+ * each value, the first read_fused_out are the output pixel.
+ */
+static void
+png_do_read_fused_lookup(png_structrp png_ptr, png_row_infop row_info,
+    png_bytep row)
+{
+   png_const_bytep table = png_ptr->read_fused_table;
+   unsigned int out = png_ptr->read_fused_out;
+   unsigned int depth = row_info->bit_depth;
+   png_uint_32 i = row_info->width;
+   png_bytep dp = row + (png_size_t)i * out;
+
+   png_debug(1, "in png_do_read_fused_lookup");
+
+   /* Backwards, as no output pixel is shorter than its input pixel. */
+   if (depth == 8 && out == 4)
+   {
+      while (i-- > 0)
+      {
+         dp -= 4;
+         memcpy(dp, table + 4 * row[i], 4);
+      }
+   }
+
+   else if (depth == 8 && out == 3)
+   {
+      while (i-- > 0)
+      {
+         png_const_bytep tp = table + 4 * row[i];
+
+         dp -= 3;
+         dp[0] = tp[0];
+         dp[1] = tp[1];
+         dp[2] = tp[2];
+      }
+   }
+
+   else
+   {
+      unsigned int mask = (1U << depth) - 1;
+
+      while (i-- > 0)
+      {
+         png_size_t bit = (png_size_t)i * depth;
+         png_const_bytep tp = table +
+             4 * ((row[bit >> 3] >> (8 - depth - (bit & 7))) & mask);
+         unsigned int k;
+
+         dp -= out;
+         for (k = 0; k < out; ++k)
+            dp[k] = tp[k];
+      }
+   }
+}
+
+#ifdef PNG_READ_FUSED_OPTIMIZATIONS
+/* Map pixels first to first+count-1 of the row; the SIMD kernels use this for
+ * the pixels at the end of the row.  All the bytes of a pixel are read before
+ * any is written, each as (input byte & keep) | filler so that the filler
+ * needs no test.
+ */
+void /* PRIVATE */
+png_do_read_fused_pixels(png_structrp png_ptr, png_bytep row,
+    png_uint_32 first, png_uint_32 count)
+{
+   unsigned int in = png_ptr->read_fused_in;
+   unsigned int out = png_ptr->read_fused_out;
+   unsigned int at[4];
+   png_byte keep[4], fill[4];
+   png_const_bytep sp;
+   png_bytep dp;
+   int step;
+   unsigned int k;
+
+   if (count == 0)
+      return;
+
+   for (k = 0; k < 4; ++k)
+   {
+      unsigned int from = k < out ? png_ptr->read_fused_map[k] : 0;
+
+      at[k] = from < in ? from : 0;
+      keep[k] = (png_byte)(from < in ? 0xff : 0);
+      fill[k] = (png_byte)(from == in ? png_ptr->read_fused_filler : 0);
+   }
+
+   /* Forwards when the pixels shrink, else backwards from the last one */
+   if (out <= in)
+   {
+      sp = row + (png_size_t)first * in;
+      dp = row + (png_size_t)first * out;
+      step = 1;
+   }
+
+   else
+   {
+      sp = row + (png_size_t)(first + count - 1) * in;
+      dp = row + (png_size_t)(first + count - 1) * out;
+      step = -1;
+   }
+
+   for (; count > 0; --count, sp += step * (int)in, dp += step * (int)out)
+   {
+      png_byte b0 = (png_byte)((sp[at[0]] & keep[0]) | fill[0]);
+      png_byte b1 = (png_byte)((sp[at[1]] & keep[1]) | fill[1]);
+      png_byte b2 = (png_byte)((sp[at[2]] & keep[2]) | fill[2]);
+      png_byte b3 = (png_byte)((sp[at[3]] & keep[3]) | fill[3]);
+
+      switch (out)
+      {
+         case 4:
+            dp[3] = b3;
+            /* FALLTHROUGH */
+         case 3:
+            dp[2] = b2;
+            /* FALLTHROUGH */
+         case 2:
+            dp[1] = b1;
+            /* FALLTHROUGH */
+         default:
+            dp[0] = b0;
+      }
+   }
+}
+#endif /* READ_FUSED_OPTIMIZATIONS */
+
+void /* PRIVATE */
+png_init_read_fused(png_structrp png_ptr)
+{
+   png_uint_32 transformations = png_ptr->transformations;
+   unsigned int color_type = png_ptr->color_type;
+   unsigned int bit_depth = png_ptr->bit_depth;
+   int expand = (transformations & PNG_EXPAND) != 0;
+   int trns = expand && png_ptr->num_trans != 0 &&
+       (transformations & PNG_EXPAND_tRNS) != 0;
+   int lookup = color_type == PNG_COLOR_TYPE_PALETTE || bit_depth < 8;
+   unsigned int channels, sample, k;
+   png_byte slot[4];
+
+   png_debug(1, "in png_init_read_fused");
+
+   png_ptr->read_fused = NULL;
+
+#ifdef PNG_SET_OPTION_SUPPORTED
+   if (((png_ptr->options >> PNG_READ_FUSED) & 3) == PNG_OPTION_OFF)
+      return;
+#endif
+
+   if ((transformations & ~(png_uint_32)PNG_FUSED_TRANSFORMS) != 0)
+      return;
+
+   /* 16-bit samples are only chopped, scaling needs arithmetic */
+   if (bit_depth == 16 && ((transformations & PNG_16_TO_8) == 0 ||
+       (transformations & PNG_SCALE_16_TO_8) != 0))
+      return;
+
+   /* The expansion, with the channels it leaves */
+   switch (color_type)
+   {
+      case PNG_COLOR_TYPE_PALETTE:
+         if (expand == 0)
+            return;
+
+         /* png_do_expand_palette adds alpha for any tRNS */
+         color_type = png_ptr->num_trans > 0 ? PNG_COLOR_TYPE_RGB_ALPHA :
+             PNG_COLOR_TYPE_RGB;
+         channels = png_ptr->num_trans > 0 ? 4 : 3;
+         break;
+
+      case PNG_COLOR_TYPE_GRAY:
+         if (bit_depth < 8 && expand == 0)
+            return;
+
+         channels = 1;
+         if (trns != 0)
+         {
+            if (bit_depth == 16)
+               return;
+
+            lookup = 1;
+            color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+            channels = 2;
+         }
+         break;
+
+      case PNG_COLOR_TYPE_RGB:
+         if (trns != 0)
+            return;
+
+         channels = 3;
+         break;
+
+      case PNG_COLOR_TYPE_GRAY_ALPHA:
+         channels = 2;
+         break;
+
+      case PNG_COLOR_TYPE_RGB_ALPHA:
+         channels = 4;
+         break;
+
+      default:
+         return;
+   }
+
+   for (k = 0; k < 4; ++k)
+      slot[k] = (png_byte)k;
+
+   if ((transformations & PNG_STRIP_ALPHA) != 0 &&
+       (color_type & PNG_COLOR_MASK_ALPHA) != 0)
+   {
+      --channels;
+      color_type &= ~(unsigned int)PNG_COLOR_MASK_ALPHA;
+   }
+
+   if ((transformations & PNG_GRAY_TO_RGB) != 0 &&
+       (color_type & PNG_COLOR_MASK_COLOR) == 0)
+   {
+      slot[1] = slot[2] = 0;
+      slot[3] = 1;
+      channels += 2;
+      color_type |= PNG_COLOR_MASK_COLOR;
+   }
+
+   if ((transformations & PNG_BGR) != 0 &&
+       (color_type & PNG_COLOR_MASK_COLOR) != 0)
+   {
+      png_byte red = slot[0];
+
+      slot[0] = slot[2];
+      slot[2] = red;
+   }
+
+   /* png_do_read_filler does not change the color type */
+   if ((transformations & PNG_FILLER) != 0 &&
+       (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_RGB))
+   {
+      if ((png_ptr->flags & PNG_FLAG_FILLER_AFTER) != 0)
+         slot[channels] = PNG_FUSED_FILL;
+
+      else
+      {
+         for (k = channels; k > 0; --k)
+            slot[k] = slot[k-1];
+
+         slot[0] = PNG_FUSED_FILL;
+      }
+
+      ++channels;
+   }
+
+   sample = bit_depth == 16 ? 2 : 1;
+
+   png_ptr->read_fused_in = (png_byte)(lookup != 0 ? 1 :
+       png_ptr->channels * sample);
+   png_ptr->read_fused_out = (png_byte)channels;
+   png_ptr->read_fused_color_type = (png_byte)color_type;
+   png_ptr->read_fused_filler = (png_byte)png_ptr->filler;
+
+   if (lookup != 0)
+   {
+      png_const_colorp palette = png_ptr->palette;
+      png_const_bytep trans_alpha = png_ptr->trans_alpha;
+      unsigned int scale = bit_depth == 1 ? 0xff : bit_depth == 2 ? 0x55 :
+          bit_depth == 4 ? 0x11 : 1;
+      unsigned int mask = (1U << bit_depth) - 1;
+      unsigned int gray = (png_ptr->trans_color.gray & mask) * scale;
+      unsigned int v;
+      png_bytep tp;
+
+      if (png_ptr->read_fused_table == NULL)
+         png_ptr->read_fused_table = png_voidcast(png_bytep,
+             png_malloc(png_ptr, 256 * 4));
+
+      tp = png_ptr->read_fused_table;
+
+      /* The values as png_do_expand_palette and png_do_expand make them */
+      for (v = 0; v < 256; ++v, tp += 4)
+      {
+         png_byte pixel[5];
+
+         if (png_ptr->color_type == PNG_COLOR_TYPE_PALETTE)
+         {
+            pixel[0] = palette[v].red;
+            pixel[1] = palette[v].green;
+            pixel[2] = palette[v].blue;
+            pixel[3] = (png_byte)((int)v < png_ptr->num_trans ?
+                trans_alpha[v] : 0xff);
+         }
+
+         else
+         {
+            unsigned int value = (v & mask) * scale;
+
+            pixel[0] = (png_byte)value;
+            pixel[1] = (png_byte)(value == gray ? 0 : 0xff);
+            pixel[2] = pixel[3] = 0;
+         }
+
+         pixel[PNG_FUSED_FILL] = png_ptr->read_fused_filler;
+
+         for (k = 0; k < 4; ++k)
+            tp[k] = pixel[k < channels ? slot[k] : 0];
+      }
+
+      png_ptr->read_fused = png_do_read_fused_lookup;
+      return;
+   }
+
+   for (k = 0; k < channels; ++k)
+      png_ptr->read_fused_map[k] = (png_byte)(slot[k] == PNG_FUSED_FILL ?
+          png_ptr->read_fused_in : slot[k] * sample);
+
+   /* Nothing to do when the map is the identity (the transforms set are no
+    * ops for this image.)
+    */
+   if (sample == 1 && channels == png_ptr->read_fused_in)
+   {
+      for (k = 0; k < channels; ++k)
+         if (png_ptr->read_fused_map[k] != k)
+            break;
+
+      if (k == channels)
+         return;
+   }
+
+#ifdef PNG_READ_FUSED_OPTIMIZATIONS
+   /* A byte map in C is no quicker than the separate passes, which are each
+    * written for one pixel layout, so it is only used vectorized; this sets
+    * read_fused if the hardware has what the kernel needs.
+    */
+   PNG_READ_FUSED_OPTIMIZATIONS(png_ptr);
+#endif
+}
+
 /* Transform the row.  The order of transformations is significant,
  * and is very touchy.  If you add a transformation, take care to
  * decide how it fits in with the other transformations here.
@@ -4743,6 +5092,18 @@ png_do_read_transformations(png_structrp png_ptr, png_row_infop row_info)
       png_error(png_ptr, "Uninitialized row");
    }
 
+   if (png_ptr->read_fused != NULL)
+   {
+      png_ptr->read_fused(png_ptr, row_info, png_ptr->row_buf + 1);
+
+      row_info->color_type = png_ptr->read_fused_color_type;
+      row_info->bit_depth = 8;
+      row_info->channels = png_ptr->read_fused_out;
+      row_info->pixel_depth = (png_byte)(8 * row_info->channels);
+      row_info->rowbytes = (png_size_t)row_info->width * row_info->channels;
+      return;
+   }
+
 #ifdef PNG_READ_EXPAND_SUPPORTED
    if ((png_ptr->transformations & PNG_EXPAND) != 0)
    {
@@ -155,7 +155,8 @@ png_read_sig(png_structrp png_ptr, png_inforp info_ptr)
 png_uint_32 /* PRIVATE */
 png_read_chunk_header(png_structrp png_ptr)
 {
-   png_byte buf[8];
+   png_byte tmpbuf[8];
+   png_const_bytep buf;
    png_uint_32 length;
 
 #ifdef PNG_IO_STATE_SUPPORTED
@@ -165,7 +166,14 @@ png_read_chunk_header(png_structrp png_ptr)
    /* Read the length and the chunk name.
     * This must be performed in a single I/O call.
     */
-   png_read_data(png_ptr, buf, 8);
+   buf = png_read_data_in_place(png_ptr, 8);
+
+   if (buf == NULL)
+   {
+      png_read_data(png_ptr, tmpbuf, 8);
+      buf = tmpbuf;
+   }
+
    length = png_get_uint_31(png_ptr, buf);
 
    /* Put the chunk name into png_ptr->chunk_name. */
@@ -212,7 +220,19 @@ png_crc_finish(png_structrp png_ptr, png_uint_32 skip)
 {
    /* The size of the local buffer for inflate is a good guess as to a
     * reasonable size to use for buffering reads from the application.
+    * Data in memory is run through the CRC where it lies.
     */
+   if (skip > 0)
+   {
+      png_const_bytep in_place = png_read_data_in_place(png_ptr, skip);
+
+      if (in_place != NULL)
+      {
+         png_calculate_crc(png_ptr, in_place, skip);
+         skip = 0;
+      }
+   }
+
    while (skip > 0)
    {
       png_uint_32 len;
@@ -4125,16 +4145,40 @@ png_read_filter_row(png_structrp pp, png_row_infop row_info, png_bytep row,
 }
 
 #ifdef PNG_SEQUENTIAL_READ_SUPPORTED
-void /* PRIVATE */
-png_read_IDAT_data(png_structrp png_ptr, png_bytep output,
+static png_alloc_size_t
+png_inflate_IDAT(png_structrp png_ptr, png_bytep output, png_alloc_size_t need,
     png_alloc_size_t avail_out)
 {
-   /* Loop reading IDATs and decompressing the result into output[avail_out] */
+   /* Loop reading IDATs and decompressing the result into output[avail_out],
+    * stopping early once 'need' bytes are there and the IDAT read so far has
+    * all been used.  Returns the number of bytes decompressed.  An error after
+    * 'need' bytes is kept for the next call, so the rows before the damage are
+    * returned just as when each row is inflated on its own.
+    */
+   png_alloc_size_t size = avail_out;
+
    png_ptr->zstream.next_out = output;
    png_ptr->zstream.avail_out = 0; /* safety: set below */
 
    if (output == NULL)
-      avail_out = 0;
+      avail_out = size = 0;
+
+   if (png_ptr->idat_batch_error != 0)
+   {
+      int ret = png_ptr->idat_batch_error;
+
+      png_ptr->idat_batch_error = 0;
+      png_zstream_error(png_ptr, ret);
+
+      if (output != NULL)
+         png_chunk_error(png_ptr, png_ptr->zstream.msg);
+
+      else /* checking */
+      {
+         png_chunk_benign_error(png_ptr, png_ptr->zstream.msg);
+         return 0;
+      }
+   }
 
    do
    {
@@ -4144,7 +4188,10 @@ png_read_IDAT_data(png_structrp png_ptr, png_bytep output,
       if (png_ptr->zstream.avail_in == 0)
       {
          uInt avail_in;
-         png_bytep buffer;
+         png_const_bytep buffer;
+
+         if (output != NULL && size - avail_out >= need)
+            break;
 
          while (png_ptr->idat_size == 0)
          {
@@ -4158,22 +4205,51 @@ png_read_IDAT_data(png_structrp png_ptr, png_bytep output,
                png_error(png_ptr, "Not enough image data");
          }
 
-         avail_in = png_ptr->IDAT_read_size;
+         /* From memory the whole IDAT is given to inflate where it lies,
+          * nothing is copied so there is no buffer size to keep to.
+          */
+         avail_in = ZLIB_IO_MAX;
 
          if (avail_in > png_ptr->idat_size)
             avail_in = (uInt)png_ptr->idat_size;
 
-         /* A PNG with a gradually increasing IDAT size will defeat this attempt
-          * to minimize memory usage by causing lots of re-allocs, but
-          * realistically doing IDAT_read_size re-allocs is not likely to be a
-          * big problem.
+         /* A damaged length may run past the end; inflate still gets the rest
+          * of the data, the next read reports the end.
           */
-         buffer = png_read_buffer(png_ptr, avail_in, 0/*error*/);
+         if (png_ptr->read_memory != NULL &&
+             png_ptr->read_memory_size > png_ptr->read_memory_pos &&
+             avail_in > png_ptr->read_memory_size - png_ptr->read_memory_pos)
+            avail_in = (uInt)(png_ptr->read_memory_size -
+                png_ptr->read_memory_pos);
+
+         buffer = png_read_data_in_place(png_ptr, avail_in);
+
+         if (buffer != NULL)
+            png_calculate_crc(png_ptr, buffer, avail_in);
+
+         else
+         {
+            png_bytep read_buffer;
+
+            avail_in = png_ptr->IDAT_read_size;
+
+            if (avail_in > png_ptr->idat_size)
+               avail_in = (uInt)png_ptr->idat_size;
+
+            /* A PNG with a gradually increasing IDAT size will defeat this
+             * attempt to minimize memory usage by causing lots of re-allocs,
+             * but realistically doing IDAT_read_size re-allocs is not likely
+             * to be a big problem.
+             */
+            read_buffer = png_read_buffer(png_ptr, avail_in, 0/*error*/);
+
+            png_crc_read(png_ptr, read_buffer, avail_in);
+            buffer = read_buffer;
+         }
 
-         png_crc_read(png_ptr, buffer, avail_in);
          png_ptr->idat_size -= avail_in;
 
-         png_ptr->zstream.next_in = buffer;
+         png_ptr->zstream.next_in = PNGZ_INPUT_CAST(buffer);
          png_ptr->zstream.avail_in = avail_in;
       }
 
@@ -4228,6 +4304,12 @@ png_read_IDAT_data(png_structrp png_ptr, png_bytep output,
 
       if (ret != Z_OK)
       {
+         if (output != NULL && size - avail_out >= need)
+         {
+            png_ptr->idat_batch_error = ret;
+            break;
+         }
+
          png_zstream_error(png_ptr, ret);
 
          if (output != NULL)
@@ -4236,22 +4318,116 @@ png_read_IDAT_data(png_structrp png_ptr, png_bytep output,
          else /* checking */
          {
             png_chunk_benign_error(png_ptr, png_ptr->zstream.msg);
-            return;
+            return 0;
          }
       }
    } while (avail_out > 0);
 
-   if (avail_out > 0)
+   if (output != NULL)
    {
       /* The stream ended before the image; this is the same as too few IDATs so
        * should be handled the same way.
        */
-      if (output != NULL)
+      if (size - avail_out < need)
          png_error(png_ptr, "Not enough image data");
+   }
+
+   else if (avail_out > 0) /* the deflate stream contained extra data */
+   {
+      png_chunk_benign_error(png_ptr, "Too much image data");
+      return 0;
+   }
+
+   return size - avail_out;
+}
+
+void /* PRIVATE */
+png_read_IDAT_data(png_structrp png_ptr, png_bytep output,
+    png_alloc_size_t avail_out)
+{
+   (void)png_inflate_IDAT(png_ptr, output, avail_out, avail_out);
+}
 
-      else /* the deflate stream contained extra data */
-         png_chunk_benign_error(png_ptr, "Too much image data");
+void /* PRIVATE */
+png_read_IDAT_row(png_structrp png_ptr, png_row_infop row_info)
+{
+   png_alloc_size_t row_size = row_info->rowbytes + 1;
+   png_alloc_size_t have = png_ptr->idat_batch_end - png_ptr->idat_batch_next;
+   png_bytep row;
+   png_const_bytep prev_row;
+
+   if (have < row_size)
+   {
+      png_alloc_size_t avail_out = PNG_IDAT_BATCH_SIZE;
+
+      if (avail_out > png_ptr->idat_batch_left)
+         avail_out = png_ptr->idat_batch_left;
+
+      /* Small images get a small buffer; it grows, while empty, when a later
+       * image read with the same png_struct needs more.
+       */
+      if (have == 0 && png_ptr->idat_batch_size < avail_out)
+      {
+         png_bytep batch = png_ptr->idat_batch;
+
+         png_ptr->idat_batch = NULL;
+         png_ptr->idat_batch_size = 0;
+         png_free(png_ptr, batch);
+
+         png_ptr->idat_batch = png_voidcast(png_bytep, png_malloc(png_ptr,
+             avail_out));
+         png_ptr->idat_batch_size = avail_out;
+      }
+
+      /* The previous row is about to be overwritten; Up, Avg and Paeth of the
+       * next row still need it.
+       */
+      if (png_ptr->idat_batch_prev != NULL)
+      {
+         memcpy(png_ptr->prev_row, png_ptr->idat_batch_prev, row_size);
+         png_ptr->idat_batch_prev = NULL;
+      }
+
+      if (have > 0)
+         memmove(png_ptr->idat_batch,
+             png_ptr->idat_batch + png_ptr->idat_batch_next, have);
+
+      png_ptr->idat_batch_next = 0;
+      png_ptr->idat_batch_end = have;
+
+      avail_out = png_ptr->idat_batch_size - have;
+
+      if (avail_out > png_ptr->idat_batch_left)
+         avail_out = png_ptr->idat_batch_left;
+
+      /* This is an error in png_inflate_IDAT if the row cannot be completed. */
+      avail_out = png_inflate_IDAT(png_ptr, png_ptr->idat_batch + have,
+          row_size - have, avail_out);
+
+      png_ptr->idat_batch_end += avail_out;
+      png_ptr->idat_batch_left -= avail_out;
+   }
+
+   row = png_ptr->idat_batch + png_ptr->idat_batch_next;
+   png_ptr->idat_batch_next += row_size;
+
+   prev_row = png_ptr->idat_batch_prev;
+   if (prev_row == NULL)
+      prev_row = png_ptr->prev_row;
+
+   if (row[0] > PNG_FILTER_VALUE_NONE)
+   {
+      if (row[0] < PNG_FILTER_VALUE_LAST)
+         png_read_filter_row(png_ptr, row_info, row + 1, prev_row + 1, row[0]);
+      else
+         png_error(png_ptr, "bad adaptive filter value");
    }
+
+   /* The transforms work in row_buf, the unfiltered row stays in the batch as
+    * the previous row of the next one.
+    */
+   memcpy(png_ptr->row_buf, row, row_size);
+   png_ptr->idat_batch_prev = row;
 }
 
 void /* PRIVATE */
@@ -4332,6 +4508,7 @@ png_read_finish_row(png_structrp png_ptr)
        * read-ahead of the next row's filter byte.
        */
       memset(png_ptr->prev_row, 0, png_ptr->rowbytes + 1);
+      png_ptr->idat_batch_prev = NULL;
 
       do
       {
@@ -4617,6 +4794,12 @@ defined(PNG_USER_TRANSFORM_PTR_SUPPORTED)
       png_ptr->old_big_row_buf_size = row_bytes + 48;
    }
 
+   /* Kept from an earlier image by png_reset_read_struct; interlaced rows are
+    * combined into row_buf, which is zeroed just as png_calloc does above.
+    */
+   else if (png_ptr->interlaced != 0)
+      memset(png_ptr->big_row_buf, 0, png_ptr->old_big_row_buf_size);
+
 #ifdef PNG_MAX_MALLOC_64K
    if (png_ptr->rowbytes > 65535)
       png_error(png_ptr, "This image requires a row greater than 64KB");
@@ -4627,6 +4810,56 @@ defined(PNG_USER_TRANSFORM_PTR_SUPPORTED)
 
    memset(png_ptr->prev_row, 0, png_ptr->rowbytes + 1);
 
+#ifdef PNG_SEQUENTIAL_READ_SUPPORTED
+   png_ptr->idat_batch_next = 0;
+   png_ptr->idat_batch_end = 0;
+   png_ptr->idat_batch_left = 0;
+   png_ptr->idat_batch_prev = NULL;
+   png_ptr->idat_batch_error = 0;
+
+   /* png_read_row inflates rows into idat_batch when at least two of the
+    * widest rows fit; this needs the size of the whole filtered image.
+    */
+   if (2 * (PNG_ROWBYTES(png_ptr->pixel_depth, png_ptr->width) + 1) <=
+       PNG_IDAT_BATCH_SIZE
+#  ifdef PNG_SET_OPTION_SUPPORTED
+       && ((png_ptr->options >> PNG_IDAT_BATCH) & 3) != PNG_OPTION_OFF
+#  endif
+       )
+   {
+      png_alloc_size_t left = 0;
+      int pass;
+
+      for (pass = 0; pass < (png_ptr->interlaced != 0 ? 7 : 1); ++pass)
+      {
+         png_uint_32 width = png_ptr->width;
+         png_uint_32 height = png_ptr->height;
+         png_alloc_size_t row_size;
+
+         if (png_ptr->interlaced != 0)
+         {
+            width = PNG_PASS_COLS(width, pass);
+            height = PNG_PASS_ROWS(height, pass);
+
+            if (width == 0) /* no filter bytes either */
+               continue;
+         }
+
+         row_size = PNG_ROWBYTES(png_ptr->pixel_depth, width) + 1;
+
+         if (height > (PNG_SIZE_MAX - left) / row_size)
+         {
+            left = 0; /* too big to count, read a row at a time */
+            break;
+         }
+
+         left += height * row_size;
+      }
+
+      png_ptr->idat_batch_left = left;
+   }
+#endif
+
    png_debug1(3, "width = %u,", png_ptr->width);
    png_debug1(3, "height = %u,", png_ptr->height);
    png_debug1(3, "iwidth = %u,", png_ptr->iwidth);
@@ -4636,10 +4869,14 @@ defined(PNG_USER_TRANSFORM_PTR_SUPPORTED)
        (unsigned long)PNG_ROWBYTES(png_ptr->pixel_depth, png_ptr->iwidth) + 1);
 
    /* The sequential reader needs a buffer for IDAT, but the progressive reader
-    * does not, so free the read buffer now regardless; the sequential reader
-    * reallocates it on demand.
+    * does not, so free the read buffer now unless it is no bigger than the
+    * sequential reader needs for IDAT; it reallocates it on demand.
     */
-   if (png_ptr->read_buffer != NULL)
+   if (png_ptr->read_buffer != NULL
+#ifdef PNG_SEQUENTIAL_READ_SUPPORTED
+       && png_ptr->read_buffer_size > png_ptr->IDAT_read_size
+#endif
+       )
    {
       png_bytep buffer = png_ptr->read_buffer;
 
@@ -4656,6 +4893,10 @@ defined(PNG_USER_TRANSFORM_PTR_SUPPORTED)
    if (png_inflate_claim(png_ptr, png_IDAT) != Z_OK)
       png_error(png_ptr, png_ptr->zstream.msg);
 
+#ifdef PNG_READ_TRANSFORMS_SUPPORTED
+   png_init_read_fused(png_ptr);
+#endif
+
    png_ptr->flags |= PNG_FLAG_ROW_INIT;
 }
 #endif /* READ */
@@ -156,6 +156,14 @@ struct png_struct_def
    png_rw_ptr write_data_fn;  /* function for writing output data */
    png_rw_ptr read_data_fn;   /* function for reading input data */
    png_voidp io_ptr;          /* ptr to application struct for I/O functions */
+#ifdef PNG_READ_SUPPORTED
+   /* Set by png_set_read_memory: the whole PNG is in one readable region, the
+    * chunk headers, CRCs and IDAT data are used from it where they lie.
+    */
+   png_const_bytep read_memory;      /* start of the region, or NULL */
+   png_size_t      read_memory_size; /* bytes in the region */
+   png_size_t      read_memory_pos;  /* offset of the next byte to read */
+#endif
 
 #ifdef PNG_READ_USER_TRANSFORM_SUPPORTED
    png_user_transform_ptr read_user_transform_fn; /* user read transform */
@@ -460,6 +468,17 @@ struct png_struct_def
 #endif
 #ifdef PNG_SEQUENTIAL_READ_SUPPORTED
   uInt             IDAT_read_size;   /* limit on read buffer size for IDAT */
+
+  /* png_read_row inflates many rows at once into idat_batch and unfilters
+   * each in place, using the row before it when that is still in the buffer.
+   */
+  png_bytep        idat_batch;       /* inflated rows, filtered until read */
+  png_alloc_size_t idat_batch_size;  /* allocated size of idat_batch */
+  png_alloc_size_t idat_batch_next;  /* offset of the next row to return */
+  png_alloc_size_t idat_batch_end;   /* end of the inflated data */
+  png_alloc_size_t idat_batch_left;  /* image bytes still to inflate */
+  png_const_bytep  idat_batch_prev;  /* previous unfiltered row, or NULL */
+  int              idat_batch_error; /* zlib error after the batched rows */
 #endif
 
 #ifdef PNG_IO_STATE_SUPPORTED
@@ -474,6 +493,23 @@ struct png_struct_def
    void (*read_filter[PNG_FILTER_VALUE_LAST-1])(png_row_infop row_info,
       png_bytep row, png_const_bytep prev_row);
 
+#ifdef PNG_READ_TRANSFORMS_SUPPORTED
+   /* Set by png_init_read_fused when the transforms only move bytes: one
+    * kernel then does the whole chain in png_do_read_transformations.
+    */
+   void (*read_fused)(png_structrp png_ptr, png_row_infop row_info,
+      png_bytep row);
+   png_bytep read_fused_table;     /* 4 output bytes per palette/gray value */
+   png_byte read_fused_map[4];     /* input byte of each output byte */
+   png_byte read_fused_in;         /* input bytes per pixel, map value of filler */
+   png_byte read_fused_out;        /* output bytes per pixel */
+   png_byte read_fused_color_type; /* row color type after the chain */
+   png_byte read_fused_filler;
+#if PNG_INTEL_SSE_IMPLEMENTATION > 0
+   png_byte read_fused_shuffle[48]; /* pshufb controls and filler, 4 pixels */
+#endif
+#endif
+
 #ifdef PNG_READ_SUPPORTED
 #if defined(PNG_COLORSPACE_SUPPORTED) || defined(PNG_GAMMA_SUPPORTED)
    png_colorspace   colorspace;
@@ -493,6 +493,61 @@ png_convert_from_time_t(png_timep ptime, time_t ttime)
 }
 #endif
 
+/* Set up the write specific defaults of a new png_struct, shared by
+ * png_create_write_struct_2 and png_reset_write_struct.
+ */
+static void
+png_write_struct_defaults(png_structrp png_ptr)
+{
+   /* Set the zlib control values to defaults; they can be overridden by the
+    * application after the struct has been created.
+    */
+   png_ptr->zbuffer_size = PNG_ZBUF_SIZE;
+
+   /* The 'zlib_strategy' setting is irrelevant because png_default_claim in
+    * pngwutil.c defaults it according to whether or not filters will be
+    * used, and ignores this setting.
+    */
+   png_ptr->zlib_strategy = PNG_Z_DEFAULT_STRATEGY;
+   png_ptr->zlib_level = PNG_Z_DEFAULT_COMPRESSION;
+   png_ptr->zlib_mem_level = 8;
+   png_ptr->zlib_window_bits = 15;
+   png_ptr->zlib_method = 8;
+
+#ifdef PNG_WRITE_COMPRESSED_TEXT_SUPPORTED
+   png_ptr->zlib_text_strategy = PNG_TEXT_Z_DEFAULT_STRATEGY;
+   png_ptr->zlib_text_level = PNG_TEXT_Z_DEFAULT_COMPRESSION;
+   png_ptr->zlib_text_mem_level = 8;
+   png_ptr->zlib_text_window_bits = 15;
+   png_ptr->zlib_text_method = 8;
+#endif /* WRITE_COMPRESSED_TEXT */
+
+   /* This is a highly dubious configuration option; by default it is off,
+    * but it may be appropriate for private builds that are testing
+    * extensions not conformant to the current specification, or of
+    * applications that must not fail to write at all costs!
+    */
+#ifdef PNG_BENIGN_WRITE_ERRORS_SUPPORTED
+   /* In stable builds only warn if an application error can be completely
+    * handled.
+    */
+   png_ptr->flags |= PNG_FLAG_BENIGN_ERRORS_WARN;
+#endif
+
+   /* App warnings are warnings in release (or release candidate) builds but
+    * are errors during development.
+    */
+#if PNG_RELEASE_BUILD
+   png_ptr->flags |= PNG_FLAG_APP_WARNINGS_WARN;
+#endif
+
+   /* TODO: delay this, it can be done in png_init_io() (if the app doesn't
+    * do it itself) avoiding setting the default function if it is not
+    * required.
+    */
+   png_set_write_fn(png_ptr, NULL, NULL, NULL);
+}
+
 /* Initialize png_ptr structure, and allocate any memory needed */
 PNG_FUNCTION(png_structp,PNGAPI
 png_create_write_struct,(png_const_charp user_png_ver, png_voidp error_ptr,
@@ -516,55 +571,7 @@ png_create_write_struct_2,(png_const_charp user_png_ver, png_voidp error_ptr,
        error_fn, warn_fn, mem_ptr, malloc_fn, free_fn);
 #endif /* USER_MEM */
    if (png_ptr != NULL)
-   {
-      /* Set the zlib control values to defaults; they can be overridden by the
-       * application after the struct has been created.
-       */
-      png_ptr->zbuffer_size = PNG_ZBUF_SIZE;
-
-      /* The 'zlib_strategy' setting is irrelevant because png_default_claim in
-       * pngwutil.c defaults it according to whether or not filters will be
-       * used, and ignores this setting.
-       */
-      png_ptr->zlib_strategy = PNG_Z_DEFAULT_STRATEGY;
-      png_ptr->zlib_level = PNG_Z_DEFAULT_COMPRESSION;
-      png_ptr->zlib_mem_level = 8;
-      png_ptr->zlib_window_bits = 15;
-      png_ptr->zlib_method = 8;
-
-#ifdef PNG_WRITE_COMPRESSED_TEXT_SUPPORTED
-      png_ptr->zlib_text_strategy = PNG_TEXT_Z_DEFAULT_STRATEGY;
-      png_ptr->zlib_text_level = PNG_TEXT_Z_DEFAULT_COMPRESSION;
-      png_ptr->zlib_text_mem_level = 8;
-      png_ptr->zlib_text_window_bits = 15;
-      png_ptr->zlib_text_method = 8;
-#endif /* WRITE_COMPRESSED_TEXT */
-
-      /* This is a highly dubious configuration option; by default it is off,
-       * but it may be appropriate for private builds that are testing
-       * extensions not conformant to the current specification, or of
-       * applications that must not fail to write at all costs!
-       */
-#ifdef PNG_BENIGN_WRITE_ERRORS_SUPPORTED
-      /* In stable builds only warn if an application error can be completely
-       * handled.
-       */
-      png_ptr->flags |= PNG_FLAG_BENIGN_ERRORS_WARN;
-#endif
-
-      /* App warnings are warnings in release (or release candidate) builds but
-       * are errors during development.
-       */
-#if PNG_RELEASE_BUILD
-      png_ptr->flags |= PNG_FLAG_APP_WARNINGS_WARN;
-#endif
-
-      /* TODO: delay this, it can be done in png_init_io() (if the app doesn't
-       * do it itself) avoiding setting the default function if it is not
-       * required.
-       */
-      png_set_write_fn(png_ptr, NULL, NULL, NULL);
-   }
+      png_write_struct_defaults(png_ptr);
 
    return png_ptr;
 }
@@ -948,6 +955,10 @@ png_write_destroy(png_structrp png_ptr)
    png_free_buffer_list(png_ptr, &png_ptr->zbuffer_list);
    png_free(png_ptr, png_ptr->row_buf);
    png_ptr->row_buf = NULL;
+   png_free(png_ptr, png_ptr->big_row_buf);
+   png_free(png_ptr, png_ptr->big_prev_row);
+   png_ptr->big_row_buf = NULL;
+   png_ptr->big_prev_row = NULL;
 #ifdef PNG_WRITE_FILTER_SUPPORTED
    png_free(png_ptr, png_ptr->prev_row);
    png_free(png_ptr, png_ptr->try_row);
@@ -995,6 +1006,120 @@ png_destroy_write_struct(png_structpp png_ptr_ptr, png_infopp info_ptr_ptr)
    }
 }
 
+/* Return a write struct to the state png_create_write_struct left it in so that
+ * the next PNG can be written with it, without giving back what is costly to
+ * set up again: the deflate state with its window and hash tables, the list of
+ * compression buffers and the row and filter buffers.  As with
+ * png_reset_read_struct the error, warning and memory functions, the setjmp
+ * buffer allocation and the png_set_option settings are kept and every other
+ * setting (compression level, filters, transforms, write function) goes back
+ * to its default.  The info struct is emptied as if it had just been created.
+ */
+void PNGAPI
+png_reset_write_struct(png_structrp png_ptr, png_inforp info_ptr)
+{
+   png_struct keep;
+
+   png_debug(1, "in png_reset_write_struct");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (info_ptr != NULL)
+   {
+      png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
+      memset(info_ptr, 0, (sizeof *info_ptr));
+   }
+
+   /* Take the kept stream and buffers out of the struct while the rest is
+    * freed.  The compression buffers only fit the default buffer size.
+    */
+   keep = *png_ptr;
+   png_ptr->flags &= ~PNG_FLAG_ZSTREAM_INITIALIZED;
+   if (png_ptr->zbuffer_size == PNG_ZBUF_SIZE)
+      png_ptr->zbuffer_list = NULL;
+   else
+      keep.zbuffer_list = NULL;
+   png_ptr->row_buf = NULL;
+   png_ptr->prev_row = NULL;
+   png_ptr->big_row_buf = NULL;
+   png_ptr->big_prev_row = NULL;
+#  ifdef PNG_WRITE_FILTER_SUPPORTED
+      png_ptr->try_row = NULL;
+      png_ptr->tst_row = NULL;
+#  endif
+   png_write_destroy(png_ptr);
+
+   memset(png_ptr, 0, (sizeof *png_ptr));
+
+#  ifdef PNG_USER_LIMITS_SUPPORTED
+      png_ptr->user_width_max = PNG_USER_WIDTH_MAX;
+      png_ptr->user_height_max = PNG_USER_HEIGHT_MAX;
+
+#     ifdef PNG_USER_CHUNK_CACHE_MAX
+      png_ptr->user_chunk_cache_max = PNG_USER_CHUNK_CACHE_MAX;
+#     endif
+
+#     ifdef PNG_USER_CHUNK_MALLOC_MAX
+      png_ptr->user_chunk_malloc_max = PNG_USER_CHUNK_MALLOC_MAX;
+#     endif
+#  endif
+
+#  ifdef PNG_SETJMP_SUPPORTED
+      png_ptr->longjmp_fn = keep.longjmp_fn;
+      png_ptr->jmp_buf_size = keep.jmp_buf_size;
+
+      /* The local jmp_buf is at the same address, an allocated one is kept. */
+      png_ptr->jmp_buf_ptr = keep.jmp_buf_ptr;
+#  endif
+
+   png_ptr->error_fn = keep.error_fn;
+#  ifdef PNG_WARNINGS_SUPPORTED
+      png_ptr->warning_fn = keep.warning_fn;
+#  endif
+   png_ptr->error_ptr = keep.error_ptr;
+
+#  ifdef PNG_USER_MEM_SUPPORTED
+      png_ptr->mem_ptr = keep.mem_ptr;
+      png_ptr->malloc_fn = keep.malloc_fn;
+      png_ptr->free_fn = keep.free_fn;
+#  endif
+
+#  ifdef PNG_SET_OPTION_SUPPORTED
+      /* Options such as PNG_INTEL_SIMD are set once for the struct. */
+      png_ptr->options = keep.options;
+#  endif
+
+   /* png_deflate_claim resets the stream with deflateReset when the next IDAT
+    * (or compressed chunk) claims it, and only changes the level or strategy
+    * with deflateParams, so the window and hash tables are reused.
+    */
+   png_ptr->zstream = keep.zstream;
+   png_ptr->flags = keep.flags & PNG_FLAG_ZSTREAM_INITIALIZED;
+   png_ptr->zlib_set_level = keep.zlib_set_level;
+   png_ptr->zlib_set_method = keep.zlib_set_method;
+   png_ptr->zlib_set_window_bits = keep.zlib_set_window_bits;
+   png_ptr->zlib_set_mem_level = keep.zlib_set_mem_level;
+   png_ptr->zlib_set_strategy = keep.zlib_set_strategy;
+   png_ptr->zbuffer_list = keep.zbuffer_list;
+
+   /* png_write_start_row takes the current and previous rows back out of
+    * big_row_buf and big_prev_row while they are large enough; all the row
+    * buffers are old_big_row_buf_size bytes.
+    */
+   png_ptr->big_row_buf = keep.row_buf != NULL ? keep.row_buf :
+       keep.big_row_buf;
+   png_ptr->big_prev_row = keep.prev_row != NULL ? keep.prev_row :
+       keep.big_prev_row;
+#  ifdef PNG_WRITE_FILTER_SUPPORTED
+      png_ptr->try_row = keep.try_row;
+      png_ptr->tst_row = keep.tst_row;
+#  endif
+   png_ptr->old_big_row_buf_size = keep.old_big_row_buf_size;
+
+   png_write_struct_defaults(png_ptr);
+}
+
 /* Allow the application to select one or more row filters to use. */
 void PNGAPI
 png_set_filter(png_structrp png_ptr, int method, int filters)
@@ -1099,10 +1224,10 @@ png_set_filter(png_structrp png_ptr, int method, int filters)
             num_filters++;
 
          /* Allocate needed row buffers if they have not already been
-          * allocated.
+          * allocated, at the size png_write_start_row gave row_buf so that
+          * png_reset_write_struct can keep them together.
           */
-         buf_size = PNG_ROWBYTES(png_ptr->usr_channels * png_ptr->usr_bit_depth,
-             png_ptr->width) + 1;
+         buf_size = png_ptr->old_big_row_buf_size;
 
          if (png_ptr->try_row == NULL)
             png_ptr->try_row = png_voidcast(png_bytep,
@@ -288,6 +288,36 @@ optimize_cmf(png_bytep data, png_alloc_size_t data_size)
 }
 #endif /* WRITE_OPTIMIZE_CMF */
 
+/* Whether deflateParams can be called right after deflateReset.  Before zlib
+ * 1.2.12 deflateParams always ran deflate(Z_BLOCK) when the level changed and
+ * that fails with Z_STREAM_ERROR on a stream with no output buffer.  The check
+ * is on the library actually loaded, not the header libpng was built with.
+ */
+static int
+png_deflate_params_after_reset(void)
+{
+   png_const_charp version = zlibVersion();
+   unsigned int part[3] = { 0, 0, 0 };
+   unsigned int i;
+
+   for (i = 0; i < 3; ++i)
+   {
+      while (*version >= '0' && *version <= '9')
+         part[i] = part[i] * 10 + (unsigned int)(*version++ - '0');
+
+      if (*version++ != '.')
+         break;
+   }
+
+   if (part[0] != 1)
+      return part[0] > 1;
+
+   if (part[1] != 2)
+      return part[1] > 2;
+
+   return part[2] >= 12;
+}
+
 /* Initialize the compressor for the appropriate type of compression. */
 static int
 png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
@@ -385,13 +415,18 @@ png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
          }
       }
 
-      /* Check against the previous initialized values, if any. */
+      /* Check against the previous initialized values, if any.  The level and
+       * strategy can be changed on the existing stream with deflateParams when
+       * zlib allows it, the other values fix the size of the window and hash
+       * tables.
+       */
       if ((png_ptr->flags & PNG_FLAG_ZSTREAM_INITIALIZED) != 0 &&
-         (png_ptr->zlib_set_level != level ||
-         png_ptr->zlib_set_method != method ||
+         (png_ptr->zlib_set_method != method ||
          png_ptr->zlib_set_window_bits != windowBits ||
          png_ptr->zlib_set_mem_level != memLevel ||
-         png_ptr->zlib_set_strategy != strategy))
+         ((png_ptr->zlib_set_level != level ||
+         png_ptr->zlib_set_strategy != strategy) &&
+         png_deflate_params_after_reset() == 0)))
       {
          if (deflateEnd(&png_ptr->zstream) != Z_OK)
             png_warning(png_ptr, "deflateEnd failed (ignored)");
@@ -411,8 +446,18 @@ png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
        * do a simple reset to the previous parameters.
        */
       if ((png_ptr->flags & PNG_FLAG_ZSTREAM_INITIALIZED) != 0)
+      {
          ret = deflateReset(&png_ptr->zstream);
 
+         /* Nothing has been deflated since the reset, so deflateParams does
+          * not need to flush and the window and hash tables are kept.  Only
+          * reached with zlib 1.2.12 or later, see above.
+          */
+         if (ret == Z_OK && (png_ptr->zlib_set_level != level ||
+             png_ptr->zlib_set_strategy != strategy))
+            ret = deflateParams(&png_ptr->zstream, level, strategy);
+      }
+
       else
       {
          ret = deflateInit2(&png_ptr->zstream, level, method, windowBits,
@@ -426,7 +471,14 @@ png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
        * pretty much the same set of error codes.
        */
       if (ret == Z_OK)
+      {
          png_ptr->zowner = owner;
+         png_ptr->zlib_set_level = level;
+         png_ptr->zlib_set_method = method;
+         png_ptr->zlib_set_window_bits = windowBits;
+         png_ptr->zlib_set_mem_level = memLevel;
+         png_ptr->zlib_set_strategy = strategy;
+      }
 
       else
          png_zstream_error(png_ptr, ret);
@@ -1923,8 +1975,35 @@ png_write_start_row(png_structrp png_ptr)
    png_ptr->transformed_pixel_depth = png_ptr->pixel_depth;
    png_ptr->maximum_pixel_depth = (png_byte)usr_pixel_depth;
 
+   /* png_reset_write_struct keeps the row buffers of an earlier image, the
+    * current and previous rows in big_row_buf and big_prev_row.  Drop them if
+    * they are too small for this one.
+    */
+   if (buf_size > png_ptr->old_big_row_buf_size)
+   {
+      png_free(png_ptr, png_ptr->big_row_buf);
+      png_free(png_ptr, png_ptr->big_prev_row);
+      png_ptr->big_row_buf = NULL;
+      png_ptr->big_prev_row = NULL;
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+      png_free(png_ptr, png_ptr->try_row);
+      png_free(png_ptr, png_ptr->tst_row);
+      png_ptr->try_row = NULL;
+      png_ptr->tst_row = NULL;
+#endif
+      png_ptr->old_big_row_buf_size = buf_size;
+   }
+
    /* Set up row buffer */
-   png_ptr->row_buf = png_voidcast(png_bytep, png_malloc(png_ptr, buf_size));
+   if (png_ptr->big_row_buf != NULL)
+   {
+      png_ptr->row_buf = png_ptr->big_row_buf;
+      png_ptr->big_row_buf = NULL;
+   }
+
+   else
+      png_ptr->row_buf = png_voidcast(png_bytep,
+          png_malloc(png_ptr, png_ptr->old_big_row_buf_size));
 
    png_ptr->row_buf[0] = PNG_FILTER_VALUE_NONE;
 
@@ -1943,11 +2022,13 @@ png_write_start_row(png_structrp png_ptr)
    png_ptr->do_filter = filters;
 
    if (((filters & (PNG_FILTER_SUB | PNG_FILTER_UP | PNG_FILTER_AVG |
-       PNG_FILTER_PAETH)) != 0) && png_ptr->try_row == NULL)
+       PNG_FILTER_PAETH)) != 0))
    {
       int num_filters = 0;
 
-      png_ptr->try_row = png_voidcast(png_bytep, png_malloc(png_ptr, buf_size));
+      if (png_ptr->try_row == NULL)
+         png_ptr->try_row = png_voidcast(png_bytep,
+             png_malloc(png_ptr, png_ptr->old_big_row_buf_size));
 
       if (filters & PNG_FILTER_SUB)
          num_filters++;
@@ -1961,17 +2042,27 @@ png_write_start_row(png_structrp png_ptr)
       if (filters & PNG_FILTER_PAETH)
          num_filters++;
 
-      if (num_filters > 1)
+      if (num_filters > 1 && png_ptr->tst_row == NULL)
          png_ptr->tst_row = png_voidcast(png_bytep, png_malloc(png_ptr,
-             buf_size));
+             png_ptr->old_big_row_buf_size));
    }
 
    /* We only need to keep the previous row if we are using one of the following
     * filters.
     */
    if ((filters & (PNG_FILTER_AVG | PNG_FILTER_UP | PNG_FILTER_PAETH)) != 0)
-      png_ptr->prev_row = png_voidcast(png_bytep,
-          png_calloc(png_ptr, buf_size));
+   {
+      if (png_ptr->big_prev_row != NULL)
+      {
+         png_ptr->prev_row = png_ptr->big_prev_row;
+         png_ptr->big_prev_row = NULL;
+         memset(png_ptr->prev_row, 0, buf_size);
+      }
+
+      else
+         png_ptr->prev_row = png_voidcast(png_bytep,
+             png_calloc(png_ptr, png_ptr->old_big_row_buf_size));
+   }
 #endif /* WRITE_FILTER */
 
 #ifdef PNG_WRITE_INTERLACING_SUPPORTED
@@ -6,9 +6,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#ifdef _WIN32
 #include <Windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 #include "png.h"
+#include "zlib.h"
+#include "libimagequant.h"
 
 
 typedef enum LodePNGColorType
@@ -72,32 +81,129 @@ typedef struct LodePNGColorProfile
 	unsigned bits; /*bits per channel (not for palette). 1,2 or 4 for greyscale only. 16 if 16-bit per channel required.*/
 } LodePNGColorProfile;
 
-typedef struct ColorTree ColorTree;
-
 /*
-One node of a color tree
-This is the data structure used to count the number of unique colors and to get a palette
-index for a color. It's like an octree, but because the alpha channel is used too, each
-node has 16 instead of 8 children.
+Bump allocator that serves every allocation made while converting one tile. Nothing
+is given back one by one, tile_arena_reset() releases everything at once. Requests
+that do not fit the block go to malloc, and the next reset grows the block to hold
+all of them, so once the largest tile has been seen no more heap calls are made.
 */
-struct ColorTree
+typedef struct _arena_chunk arena_chunk;
+struct _arena_chunk
+{
+	arena_chunk* next;
+};
+
+typedef struct _tile_arena tile_arena;
+struct _tile_arena
 {
-	ColorTree* children[16]; /*up to 16 pointers to ColorTree of next level*/
-	int index; /*the payload. Only has a meaningful value if this is in the last level*/
+	unsigned char* block;
+	size_t size;
+	size_t used;
+	arena_chunk* overflow; /*malloc'd allocations that did not fit since the last reset*/
+	size_t overflow_size;
 };
 
+#define ARENA_ALIGN 16 /*alignment of every allocation, also the header that remembers its size*/
+
+void tile_arena_init(tile_arena* arena)
+{
+	arena->block = 0;
+	arena->size = 0;
+	arena->used = 0;
+	arena->overflow = 0;
+	arena->overflow_size = 0;
+}
+
+void* tile_arena_alloc(tile_arena* arena, size_t size)
+{
+	unsigned char* p;
+	size_t total = ARENA_ALIGN + ((size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1));
+	if(total < size) return 0; /*overflow*/
+
+	if(arena->size - arena->used >= total)
+	{
+		p = arena->block + arena->used;
+		arena->used += total;
+	}
+	else
+	{
+		arena_chunk* chunk = (arena_chunk*)malloc(ARENA_ALIGN + total);
+		if(!chunk) return 0;
+		chunk->next = arena->overflow;
+		arena->overflow = chunk;
+		arena->overflow_size += total;
+		p = (unsigned char*)chunk + ARENA_ALIGN;
+	}
+	*(size_t*)p = size;
+	return p + ARENA_ALIGN;
+}
+
+static size_t tile_arena_size_of(const void* ptr)
+{
+	return *(const size_t*)((const unsigned char*)ptr - ARENA_ALIGN);
+}
+
+void tile_arena_reset(tile_arena* arena)
+{
+	size_t needed = arena->used + arena->overflow_size;
+	while(arena->overflow)
+	{
+		arena_chunk* next = arena->overflow->next;
+		free(arena->overflow);
+		arena->overflow = next;
+	}
+	arena->overflow_size = 0;
+	arena->used = 0;
+
+	if(needed > arena->size)
+	{
+		free(arena->block);
+		arena->block = (unsigned char*)malloc(needed);
+		arena->size = arena->block ? needed : 0;
+	}
+}
+
+void tile_arena_cleanup(tile_arena* arena)
+{
+	tile_arena_reset(arena);
+	free(arena->block);
+	tile_arena_init(arena);
+}
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/*The arena of the tile the calling thread is converting, 0 outside of a tile.
+While it is set, everything from lodepng_malloc lives until the arena is reset.*/
+static THREAD_LOCAL tile_arena* lodepng_arena = 0;
+
 static void* lodepng_malloc(size_t size)
 {
+	if(lodepng_arena) return tile_arena_alloc(lodepng_arena, size);
 	return malloc(size);
 }
 
 static void lodepng_free(void* ptr)
 {
+	if(lodepng_arena) return; /*released by tile_arena_reset*/
 	free(ptr);
 }
 
 static void* lodepng_realloc(void* ptr, size_t new_size)
 {
+	if(lodepng_arena)
+	{
+		void* data = tile_arena_alloc(lodepng_arena, new_size);
+		if(data && ptr)
+		{
+			size_t size = tile_arena_size_of(ptr);
+			memcpy(data, ptr, size < new_size ? size : new_size);
+		}
+		return data;
+	}
 	return realloc(ptr, new_size);
 }
 
@@ -174,11 +280,59 @@ unsigned lodepng_get_bpp(const LodePNGColorMode* info)
 	return lodepng_get_bpp_lct(info->colortype, info->bitdepth);
 }
 
-static void color_tree_init(ColorTree* tree)
+typedef struct ColorTable ColorTable;
+
+/*
+Open addressing hash table of colors, keyed by the packed 32-bit RGBA value.
+This is the data structure used to count the number of unique colors and to get a palette
+index for a color. It lives on the stack, never allocates and holds at most
+COLOR_TABLE_MAX colors, which is one more than a palette can have.
+*/
+#define COLOR_TABLE_MAX 257
+#define COLOR_TABLE_SIZE 512 /*power of two, keeps the load factor at or below one half*/
+struct ColorTable
+{
+	unsigned keys[COLOR_TABLE_SIZE]; /*packed RGBA, only meaningful where index is not -1*/
+	short index[COLOR_TABLE_SIZE]; /*the payload, -1 for an empty slot*/
+	unsigned count;
+};
+
+static void color_table_init(ColorTable* table)
 {
-	int i;
-	for(i = 0; i != 16; ++i) tree->children[i] = 0;
-	tree->index = -1;
+	unsigned i;
+	for(i = 0; i != COLOR_TABLE_SIZE; ++i) table->index[i] = -1;
+	table->count = 0;
+}
+
+static unsigned color_table_key(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+{
+	return ((unsigned)r << 24) | ((unsigned)g << 16) | ((unsigned)b << 8) | (unsigned)a;
+}
+
+/*returns the slot holding key, or the empty slot where it would go*/
+static unsigned color_table_slot(const ColorTable* table, unsigned key)
+{
+	unsigned slot = ((key * 2654435761u) >> 16) & (COLOR_TABLE_SIZE - 1);
+	while(table->index[slot] >= 0 && table->keys[slot] != key) slot = (slot + 1) & (COLOR_TABLE_SIZE - 1);
+	return slot;
+}
+
+/*returns -1 if color not present, its index otherwise*/
+static int color_table_get(const ColorTable* table, unsigned key)
+{
+	return table->index[color_table_slot(table, key)];
+}
+
+/*Adds the color if it is not present yet and there is room.
+Returns 1 if it was added, 0 if it was already present or the table is full.*/
+static unsigned color_table_add(ColorTable* table, unsigned key, unsigned index)
+{
+	unsigned slot = color_table_slot(table, key);
+	if(table->index[slot] >= 0 || table->count >= COLOR_TABLE_MAX) return 0;
+	table->keys[slot] = key;
+	table->index[slot] = (short)index;
+	++table->count;
+	return 1;
 }
 
 /*Get RGBA16 color of pixel with index i (y * width + x) from the raw image with
@@ -353,63 +507,13 @@ static unsigned getValueRequiredBits(unsigned char value)
 	return 8;
 }
 
-static void color_tree_cleanup(ColorTree* tree)
-{
-	int i;
-	for(i = 0; i != 16; ++i)
-	{
-		if(tree->children[i])
-		{
-			color_tree_cleanup(tree->children[i]);
-			lodepng_free(tree->children[i]);
-		}
-	}
-}
-
-/*returns -1 if color not present, its index otherwise*/
-static int color_tree_get(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
-{
-	int bit = 0;
-	for(bit = 0; bit < 8; ++bit)
-	{
-		int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-		if(!tree->children[i]) return -1;
-		else tree = tree->children[i];
-	}
-	return tree ? tree->index : -1;
-}
-
-static int color_tree_has(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
-{
-	return color_tree_get(tree, r, g, b, a) >= 0;
-}
-
-/*color is not allowed to already exist.
-Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")*/
-static void color_tree_add(ColorTree* tree,
-						   unsigned char r, unsigned char g, unsigned char b, unsigned char a, unsigned index)
-{
-	int bit;
-	for(bit = 0; bit < 8; ++bit)
-	{
-		int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-		if(!tree->children[i])
-		{
-			tree->children[i] = (ColorTree*)lodepng_malloc(sizeof(ColorTree));
-			color_tree_init(tree->children[i]);
-		}
-		tree = tree->children[i];
-	}
-	tree->index = (int)index;
-}
-
 unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 								   const unsigned char* in, unsigned w, unsigned h,
 								   const LodePNGColorMode* mode)
 {
 	unsigned error = 0;
 	size_t i;
-	ColorTree tree;
+	ColorTable table;
 	size_t numpixels = w * h;
 
 	unsigned colored_done = lodepng_is_greyscale_type(mode) ? 1 : 0;
@@ -419,9 +523,10 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 	unsigned bits_done = bpp == 1 ? 1 : 0;
 	unsigned maxnumcolors = 257;
 	unsigned sixteen = 0;
+	unsigned lastkey = 0;
 	if(bpp <= 8) maxnumcolors = bpp == 1 ? 2 : (bpp == 2 ? 4 : (bpp == 4 ? 16 : 256));
 
-	color_tree_init(&tree);
+	color_table_init(&table);
 
 	/*Check if the 16-bit input is truly 16-bit*/
 	if(mode->bitdepth == 16)
@@ -544,9 +649,10 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 
 			if(!numcolors_done)
 			{
-				if(!color_tree_has(&tree, r, g, b, a))
+				unsigned key = color_table_key(r, g, b, a);
+				/*runs of the same color are common, skip the lookup for them*/
+				if((i == 0 || key != lastkey) && color_table_add(&table, key, profile->numcolors))
 				{
-					color_tree_add(&tree, r, g, b, a, profile->numcolors);
 					if(profile->numcolors < 256)
 					{
 						unsigned char* p = profile->palette;
@@ -559,6 +665,7 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 					++profile->numcolors;
 					numcolors_done = profile->numcolors >= maxnumcolors;
 				}
+				lastkey = key;
 			}
 
 			if(alpha_done && numcolors_done && colored_done && bits_done) break;
@@ -583,8 +690,6 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 		profile->key_g += (profile->key_g << 8);
 		profile->key_b += (profile->key_b << 8);
 	}
-
-	color_tree_cleanup(&tree);
 	return error;
 }
 
@@ -645,44 +750,42 @@ unsigned lodepng_color_mode_copy(LodePNGColorMode* dest, const LodePNGColorMode*
 	return 0;
 }
 
-/*Automatically chooses color type that gives smallest amount of bits in the
-output image, e.g. grey if there are only greyscale pixels, palette if there
-are less than 256 colors, ...
-Updates values of mode with a potentially smaller color model. mode_out should
-contain the user chosen color model, but will be overwritten with the new chosen one.*/
-unsigned lodepng_auto_choose_color(LodePNGColorMode* mode_out,
-								   const unsigned char* image, unsigned w, unsigned h,
-								   const LodePNGColorMode* mode_in)
+/*Chooses the color model for an image with the given profile and amount of pixels,
+see lodepng_auto_choose_color. The profile is modified.*/
+static unsigned auto_choose_color_from_profile(LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
+											   LodePNGColorProfile* prof, size_t numpixels)
 {
-	LodePNGColorProfile prof;
 	unsigned error = 0;
 	unsigned i, n, palettebits, grey_ok, palette_ok;
 
-	lodepng_color_profile_init(&prof);
-	error = lodepng_get_color_profile(&prof, image, w, h, mode_in);
-	if(error) return error;
 	mode_out->key_defined = 0;
 
-	if(prof.key && w * h <= 16)
+	if(prof->key && numpixels <= 16)
 	{
-		prof.alpha = 1; /*too few pixels to justify tRNS chunk overhead*/
-		if(prof.bits < 8) prof.bits = 8; /*PNG has no alphachannel modes with less than 8-bit per channel*/
+		prof->alpha = 1; /*too few pixels to justify tRNS chunk overhead*/
+		if(prof->bits < 8) prof->bits = 8; /*PNG has no alphachannel modes with less than 8-bit per channel*/
 	}
-	grey_ok = !prof.colored && !prof.alpha; /*grey without alpha, with potentially low bits*/
-	n = prof.numcolors;
+	grey_ok = !prof->colored && !prof->alpha; /*grey without alpha, with potentially low bits*/
+	n = prof->numcolors;
 	palettebits = n <= 2 ? 1 : (n <= 4 ? 2 : (n <= 16 ? 4 : 8));
-	palette_ok = n <= 256 && (n * 2 < w * h) && prof.bits <= 8;
-	if(w * h < n * 2) palette_ok = 0; /*don't add palette overhead if image has only a few pixels*/
-	if(grey_ok && prof.bits <= palettebits) palette_ok = 0; /*grey is less overhead*/
+	palette_ok = n <= 256 && (n * 2 < numpixels) && prof->bits <= 8;
+	if(numpixels < n * 2) palette_ok = 0; /*don't add palette overhead if image has only a few pixels*/
+	if(grey_ok && prof->bits <= palettebits) palette_ok = 0; /*grey is less overhead*/
 
 	if(palette_ok)
 	{
-		unsigned char* p = prof.palette;
+		unsigned char* p = prof->palette;
+		unsigned opaque;
 		lodepng_palette_clear(mode_out); /*remove potential earlier palette*/
-		for(i = 0; i != prof.numcolors; ++i)
+		/*translucent colors first, so the tRNS chunk can end at the last of them*/
+		for(opaque = 0; opaque != 2 && !error; ++opaque)
 		{
-			error = lodepng_palette_add(mode_out, p[i * 4 + 0], p[i * 4 + 1], p[i * 4 + 2], p[i * 4 + 3]);
-			if(error) break;
+			for(i = 0; i != prof->numcolors; ++i)
+			{
+				if((p[i * 4 + 3] == 255) != opaque) continue;
+				error = lodepng_palette_add(mode_out, p[i * 4 + 0], p[i * 4 + 1], p[i * 4 + 2], p[i * 4 + 3]);
+				if(error) break;
+			}
 		}
 
 		mode_out->colortype = LCT_PALETTE;
@@ -698,16 +801,16 @@ unsigned lodepng_auto_choose_color(LodePNGColorMode* mode_out,
 	}
 	else /*8-bit or 16-bit per channel*/
 	{
-		mode_out->bitdepth = prof.bits;
-		mode_out->colortype = prof.alpha ? (prof.colored ? LCT_RGBA : LCT_GREY_ALPHA)
-			: (prof.colored ? LCT_RGB : LCT_GREY);
+		mode_out->bitdepth = prof->bits;
+		mode_out->colortype = prof->alpha ? (prof->colored ? LCT_RGBA : LCT_GREY_ALPHA)
+			: (prof->colored ? LCT_RGB : LCT_GREY);
 
-		if(prof.key && !prof.alpha)
+		if(prof->key && !prof->alpha)
 		{
 			unsigned mask = (1u << mode_out->bitdepth) - 1u; /*profile always uses 16-bit, mask converts it*/
-			mode_out->key_r = prof.key_r & mask;
-			mode_out->key_g = prof.key_g & mask;
-			mode_out->key_b = prof.key_b & mask;
+			mode_out->key_r = prof->key_r & mask;
+			mode_out->key_g = prof->key_g & mask;
+			mode_out->key_b = prof->key_b & mask;
 			mode_out->key_defined = 1;
 		}
 	}
@@ -715,6 +818,24 @@ unsigned lodepng_auto_choose_color(LodePNGColorMode* mode_out,
 	return error;
 }
 
+/*Automatically chooses color type that gives smallest amount of bits in the
+output image, e.g. grey if there are only greyscale pixels, palette if there
+are less than 256 colors, ...
+Updates values of mode with a potentially smaller color model. mode_out should
+contain the user chosen color model, but will be overwritten with the new chosen one.*/
+unsigned lodepng_auto_choose_color(LodePNGColorMode* mode_out,
+								   const unsigned char* image, unsigned w, unsigned h,
+								   const LodePNGColorMode* mode_in)
+{
+	LodePNGColorProfile prof;
+	unsigned error = 0;
+
+	lodepng_color_profile_init(&prof);
+	error = lodepng_get_color_profile(&prof, image, w, h, mode_in);
+	if(error) return error;
+	return auto_choose_color_from_profile(mode_out, mode_in, &prof, (size_t)w * h);
+}
+
 void lodepng_color_mode_init(LodePNGColorMode* info)
 {
 	info->key_defined = 0;
@@ -964,7 +1085,7 @@ static void addColorBits(unsigned char* out, size_t index, unsigned bits, unsign
 
 /*put a pixel, given its RGBA color, into image of any color type*/
 static unsigned rgba8ToPixel(unsigned char* out, size_t i,
-							 const LodePNGColorMode* mode, ColorTree* tree /*for palette*/,
+							 const LodePNGColorMode* mode, const ColorTable* table /*for palette*/,
 							 unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
 	if(mode->colortype == LCT_GREY)
@@ -996,7 +1117,7 @@ static unsigned rgba8ToPixel(unsigned char* out, size_t i,
 	}
 	else if(mode->colortype == LCT_PALETTE)
 	{
-		int index = color_tree_get(tree, r, g, b, a);
+		int index = color_table_get(table, color_table_key(r, g, b, a));
 		if(index < 0) return 82; /*color not in palette*/
 		if(mode->bitdepth == 8) out[i] = index;
 		else addColorBits(out, i, mode->bitdepth, (unsigned)index);
@@ -1036,43 +1157,47 @@ static unsigned rgba8ToPixel(unsigned char* out, size_t i,
 	return 0; /*no error*/
 }
 
-unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
-						 const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
-						 unsigned w, unsigned h)
+/*Fills table with the palette colors of mode_out, or of mode_in if mode_out has no
+palette values. Only needed when converting to LCT_PALETTE.*/
+void color_table_set_palette(ColorTable* table, const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in)
+{
+	size_t i;
+	size_t palettesize = mode_out->palettesize;
+	const unsigned char* palette = mode_out->palette;
+	size_t palsize = 1u << mode_out->bitdepth;
+	/*if the user specified output palette but did not give the values, assume
+	they want the values of the input color type (assuming that one is palette).
+	Note that we never create a new palette ourselves.*/
+	if(palettesize == 0)
+	{
+		palettesize = mode_in->palettesize;
+		palette = mode_in->palette;
+	}
+	if(palettesize < palsize) palsize = palettesize;
+	color_table_init(table);
+	for(i = 0; i != palsize; ++i)
+	{
+		const unsigned char* p = &palette[i * 4];
+		color_table_add(table, color_table_key(p[0], p[1], p[2], p[3]), (unsigned)i);
+	}
+}
+
+/*Converts numpixels pixels that start on a byte boundary, e.g. one row. For palette
+output, table must have been filled by color_table_set_palette. Pixels of less than
+8 bits are packed from the first byte on, unused bits of the last byte are zero.*/
+unsigned lodepng_convert_pixels(unsigned char* out, const unsigned char* in, size_t numpixels,
+								const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
+								const ColorTable* table)
 {
 	size_t i;
-	ColorTree tree;
-	size_t numpixels = w * h;
 
 	if(lodepng_color_mode_equal(mode_out, mode_in))
 	{
-		size_t numbytes = lodepng_get_raw_size(w, h, mode_in);
+		size_t numbytes = lodepng_get_raw_size((unsigned)numpixels, 1, mode_in);
 		for(i = 0; i != numbytes; ++i) out[i] = in[i];
 		return 0;
 	}
 
-	if(mode_out->colortype == LCT_PALETTE)
-	{
-		size_t palettesize = mode_out->palettesize;
-		const unsigned char* palette = mode_out->palette;
-		size_t palsize = 1u << mode_out->bitdepth;
-		/*if the user specified output palette but did not give the values, assume
-		they want the values of the input color type (assuming that one is palette).
-		Note that we never create a new palette ourselves.*/
-		if(palettesize == 0)
-		{
-			palettesize = mode_in->palettesize;
-			palette = mode_in->palette;
-		}
-		if(palettesize < palsize) palsize = palettesize;
-		color_tree_init(&tree);
-		for(i = 0; i != palsize; ++i)
-		{
-			const unsigned char* p = &palette[i * 4];
-			color_tree_add(&tree, p[0], p[1], p[2], p[3], i);
-		}
-	}
-
 	if(mode_in->bitdepth == 16 && mode_out->bitdepth == 16)
 	{
 		for(i = 0; i != numpixels; ++i)
@@ -1096,323 +1221,49 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
 		for(i = 0; i != numpixels; ++i)
 		{
 			getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
-			CERROR_TRY_RETURN(rgba8ToPixel(out, i, mode_out, &tree, r, g, b, a));
+			CERROR_TRY_RETURN(rgba8ToPixel(out, i, mode_out, table, r, g, b, a));
 		}
 	}
 
-	if(mode_out->colortype == LCT_PALETTE)
-	{
-		color_tree_cleanup(&tree);
-	}
-
 	return 0; /*no error*/
 }
 
-static void setBitOfReversedStream(size_t* bitpointer, unsigned char* bitstream, unsigned char bit)
-{
-  /*the current bit in bitstream may be 0 or 1 for this to work*/
-  if(bit == 0) bitstream[(*bitpointer) >> 3] &=  (unsigned char)(~(1 << (7 - ((*bitpointer) & 0x7))));
-  else         bitstream[(*bitpointer) >> 3] |=  (1 << (7 - ((*bitpointer) & 0x7)));
-  ++(*bitpointer);
-}
-
-static void addPaddingBits(unsigned char* out, const unsigned char* in,
-                           size_t olinebits, size_t ilinebits, unsigned h)
+unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
+						 const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
+						 unsigned w, unsigned h)
 {
-  /*The opposite of the removePaddingBits function
-  olinebits must be >= ilinebits*/
-  unsigned y;
-  size_t diff = olinebits - ilinebits;
-  size_t obp = 0, ibp = 0; /*bit pointers*/
-  for(y = 0; y != h; ++y)
-  {
-    size_t x;
-    for(x = 0; x < ilinebits; ++x)
-    {
-      unsigned char bit = readBitFromReversedStream(&ibp, in);
-      setBitOfReversedStream(&obp, out, bit);
-    }
-    /*obp += diff; --> no, fill in some value in the padding bits too, to avoid
-    "Use of uninitialised value of size ###" warning from valgrind*/
-    for(x = 0; x != diff; ++x) setBitOfReversedStream(&obp, out, 0);
-  }
+	ColorTable table;
+	if(mode_out->colortype == LCT_PALETTE) color_table_set_palette(&table, mode_out, mode_in);
+	return lodepng_convert_pixels(out, in, (size_t)w * h, mode_out, mode_in, &table);
 }
 
+//*************************************Need to vips (Start)***************************************************
 /*
-Paeth predicter, used by PNG filter type 4
-The parameters are of type short, but should come from unsigned chars, the shorts
-are only needed to make the paeth calculation correct.
+Rows of an image in mode, all in one allocation: the pointer array first, the pixel
+rows right behind it. Rows are contiguous, so row_pointer[0] is also the whole image
+as one buffer, which is what the lodepng color functions expect. Inside a worker the
+block comes from the tile's arena.
 */
-static unsigned char paethPredictor(short a, short b, short c)
-{
-  short pa = abs(b - c);
-  short pb = abs(a - c);
-  short pc = abs(a + b - c - c);
-
-  if(pc < pa && pc < pb) return (unsigned char)c;
-  else if(pb < pa) return (unsigned char)b;
-  else return (unsigned char)a;
-}
-
-static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
-                           size_t length, size_t bytewidth, unsigned char filterType)
-{
-  size_t i;
-  switch(filterType)
-  {
-    case 0: /*None*/
-      for(i = 0; i != length; ++i) out[i] = scanline[i];
-      break;
-    case 1: /*Sub*/
-      for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
-      break;
-    case 2: /*Up*/
-      if(prevline)
-      {
-        for(i = 0; i != length; ++i) out[i] = scanline[i] - prevline[i];
-      }
-      else
-      {
-        for(i = 0; i != length; ++i) out[i] = scanline[i];
-      }
-      break;
-    case 3: /*Average*/
-      if(prevline)
-      {
-        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - (prevline[i] >> 1);
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
-      }
-      else
-      {
-        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - (scanline[i - bytewidth] >> 1);
-      }
-      break;
-    case 4: /*Paeth*/
-      if(prevline)
-      {
-        /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
-        for(i = 0; i != bytewidth; ++i) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; ++i)
-        {
-          out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
-        }
-      }
-      else
-      {
-        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-        /*paethPredictor(scanline[i - bytewidth], 0, 0) is always scanline[i - bytewidth]*/
-        for(i = bytewidth; i < length; ++i) out[i] = (scanline[i] - scanline[i - bytewidth]);
-      }
-      break;
-    default: return; /*unexisting filter type given*/
-  }
-}
-
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* info)
-{
-  /*
-  For PNG filter method 0
-  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
-  the scanlines with 1 extra byte per scanline
-  */
-
-  unsigned bpp = lodepng_get_bpp(info);
-  /*the width of a scanline in bytes, not including the filter type*/
-  size_t linebytes = (w * bpp + 7) / 8;
-  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
-  size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
-  unsigned x, y;
-  unsigned error = 0;
-
-  /*
-  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
-   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
-      use fixed filtering, with the filter None).
-   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
-     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
-     all five filters and select the filter that produces the smallest sum of absolute values per row.
-  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
-
-  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
-  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
-  heuristic is used.
-  */
-
-  if(bpp == 0) return 31; /*error: invalid color type*/
-
-  if(info->colortype == LCT_PALETTE || info->bitdepth < 8)
-  {
-    for(y = 0; y != h; ++y)
-    {
-      //size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
-      size_t outindex = linebytes *y;
-      size_t inindex = linebytes * y;
-      out[outindex] = 0; /*filter type byte*/
-      //filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, 0);
-      filterScanline(&out[outindex], &in[inindex], prevline, linebytes, bytewidth, 0);
-      prevline = &in[inindex];
-    }
-  }
-  else return 88;
-
-  return error;
-}
-
-
-/*out must be buffer big enough to contain uncompressed IDAT chunk data, and in must contain the full image.
-return value is error**/
-static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                    unsigned w, unsigned h,
-                                    const LodePNGColorMode* color)
-{
-  /*
-  This function converts the pure 2D image with the PNG's colortype, into filtered-padded-interlaced data. Steps:
-  *) handle with no Adam7, add padding bits (= posible extra bits per scanline if bpp < 8) 2) filter
-  */
-  unsigned bpp = lodepng_get_bpp(color);
-  unsigned error = 0;
-  
-  *outsize = (h * ((w * bpp + 7) / 8));
-  *out = (unsigned char*)lodepng_malloc(*outsize);
-  if(!(*out) && (*outsize)) error = 83; /*alloc fail*/
-  
-  if(!error)
-  {
-	   unsigned char* padded = (unsigned char*)lodepng_malloc(h * ((w * bpp + 7) / 8));
-       if(!padded) error = 83; /*alloc fail*/
-       if(!error)
-       {
-         addPaddingBits(padded, in, ((w * bpp + 7) / 8) * 8, w * bpp, h);
-		 error = filter(*out, padded, w, h, color);
-       }       
-	   lodepng_free(padded);
-  }
-  return error;
-}
-
-//*************************************Need to vips (Start)***************************************************
-void bytep_to_bytepp(const LodePNGColorMode* color, int width, int height, png_bytep in, png_bytepp row_pointer_out)
-{
-	int i,j;
-	int span;
-	int pos=0;
-	int bpp= lodepng_get_bpp(color);
-
-	for(i = 0; i< height; i++)
-	{
-		for(j = 0; j < width; j++)
-		{
-			if(bpp == 32)
-			{
-				row_pointer_out[i][4*j] = in[pos++];
-				row_pointer_out[i][4*j+1] = in[pos++];
-				row_pointer_out[i][4*j+2] = in[pos++];
-				row_pointer_out[i][4*j+3] = in[pos++];
-			}
-			else if(bpp == 24)
-			{
-				row_pointer_out[i][3*j] = in[pos++];
-				row_pointer_out[i][3*j+1] = in[pos++];
-				row_pointer_out[i][3*j+2] = in[pos++];
-			}
-			else if(bpp == 8)
-			{
-				row_pointer_out[i][j] = in[pos++];
-			}
-			else if(bpp < 8)
-			{
-				span = 8/bpp;
-				if(j%span == 0)
-				{
-					row_pointer_out[i][j/span] = in[pos++];
-				}
-			}
-		}
-	}
-}
-
-void bytepp_to_bytep(const LodePNGColorMode* color, int width, int height, png_bytep out, png_bytepp row_pointer_in)
-{
-	int i, j;
-	int pos = 0;
-	int size;
-	
-	int channel = color->colortype == LCT_RGBA ? 4 : 3;
-	size = width * channel;
-	
-	for(i = 0; i < height; i++)
-	{
-		for(j = 0; j < size; j++)
-		{
-			out[pos++] = row_pointer_in[i][j];
-		}
-	}
-}
-
-png_bytep malloc_png_bytep(LodePNGColorMode* mode, int width, int height)
-{
-	png_bytep bytep;
-	int channel = mode->colortype == LCT_RGBA ? 4 :3; 
-	
-	bytep = (png_bytep)malloc(sizeof(png_byte) * width * height * channel);
-	return bytep;
-}
-
 png_bytepp malloc_png_bytepp(LodePNGColorMode* mode, int width, int height)
 {
 	int i;
 	png_bytepp bytepp;
+	png_bytep rows;
 	int bpp = lodepng_get_bpp(mode);
-	bytepp =(png_bytepp) malloc(sizeof(png_bytep) * height);
+	size_t rowbytes = ((size_t)width * bpp + 7) / 8;
+	bytepp = (png_bytepp)lodepng_malloc(sizeof(png_bytep) * height + rowbytes * height);
+	if(!bytepp) return NULL;
+	rows = (png_bytep)(bytepp + height);
 	for (i=0; i < height; i++)
 	{
-		bytepp[i] = (png_bytep)malloc(sizeof(png_byte) * (width * bpp + 7)/8);
+		bytepp[i] = rows + rowbytes * i;
 	}
 	return bytepp;
 }
 
-void free_png_bytepp(int height, png_bytepp row_pointer)
+void free_png_bytepp(png_bytepp row_pointer)
 {
-	int i;
-    if(row_pointer)
-	{
-		for(i =0 ; i< height; i++)
-		{
-			if(row_pointer[i])
-				free(row_pointer[i]);
-		}
-		free(row_pointer);
-	}
-}
-
-void auto_convert_data(LodePNGColorMode* mode_in, LodePNGColorMode* mode_out, int width, int height, png_bytep in, png_bytep* row_pointer_out)
-{
-   unsigned char* data= 0;/*uncompressed version of the IDAT chunk data*/
-   size_t datasize = 0;
-   png_bytep converted;
-   int bpp = lodepng_get_bpp(mode_out);
-   int size = (width * height * lodepng_get_bpp(mode_out) + 7) / 8;
-   int linebits = ((width * bpp + 7) / 8) * 8;
-   converted = (png_bytep)malloc(sizeof(png_byte) * size);
-   
-   lodepng_convert(converted, in, mode_out, mode_in, width, height);
-   if(bpp < 8 && width * bpp != linebits)
-   {
-	   preProcessScanlines(&data, &datasize, converted, width, height, mode_out);
-       bytep_to_bytepp(mode_out, width, height, data, row_pointer_out);
-	   free(data);
-   }
-   else
-   {
-       bytep_to_bytepp(mode_out, width, height, converted, row_pointer_out);
-   }
-
-
-   free(converted);
+	lodepng_free(row_pointer);
 }
 
 void color_mode_init(LodePNGColorMode* mode, png_byte color_type, png_byte bit_depth)
@@ -1444,51 +1295,144 @@ void SetIHDR(png_structp png_ptr, png_infop info_ptr, LodePNGColorMode* mode,int
 		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
 }
 
-void SetPLTE(png_structp png_ptr, png_infop info_ptr, LodePNGColorMode* mode,int width, int hight)
+//PLTE and tRNS: palette alphas up to the last translucent entry, or the color key of grey/RGB.
+//More than 256 palette entries is a png_error, the arrays are on the stack.
+void SetPLTE(png_structp png_ptr, png_infop info_ptr, LodePNGColorMode* mode)
 {
 	int i;
 	if(mode->colortype == LCT_PALETTE)
 	{
-		png_colorp palette=(png_colorp)malloc(sizeof(png_color)* mode->palettesize);
-		for(i=0; i<mode->palettesize; i++)
+		png_color palette[256];
+		png_byte trans[256];
+		int num_palette = (int)mode->palettesize;
+		int num_trans = 0;
+		if(mode->palettesize == 0 || mode->palettesize > 256) png_error(png_ptr, "Invalid palette size");
+		for(i=0; i<num_palette && i<256; i++)
 		{
 			palette[i].red= mode->palette[4*i];
 			palette[i].green = mode->palette[4*i+1];
 			palette[i].blue = mode->palette[4*i+2];
+			trans[i] = mode->palette[4*i+3];
+			if(trans[i] != 255) num_trans = i + 1;
 		}
-		png_set_PLTE(png_ptr, info_ptr, palette, mode->palettesize);
-		free(palette);
+		png_set_PLTE(png_ptr, info_ptr, palette, num_palette);
+		if(num_trans) png_set_tRNS(png_ptr, info_ptr, trans, num_trans, NULL);
+	}
+	else if(mode->key_defined && (mode->colortype == LCT_GREY || mode->colortype == LCT_RGB))
+	{
+		png_color_16 key;
+		key.index = 0;
+		key.gray = (png_uint_16)mode->key_r;
+		key.red = (png_uint_16)mode->key_r;
+		key.green = (png_uint_16)mode->key_g;
+		key.blue = (png_uint_16)mode->key_b;
+		png_set_tRNS(png_ptr, info_ptr, NULL, 0, &key);
 	}
 }
 
-void SetIDAT(png_structp png_ptr, png_bytepp row_pointers, int hight)
+//Nanoseconds from a monotonic clock, for timing the phases of a conversion.
+long long monotonic_ns()
 {
-	png_write_rows(png_ptr, row_pointers, hight);
+#ifdef _WIN32
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	return (long long)((double)now.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+#endif
+}
+
+//Convert the decoded rows from mode_in to mode_out one row at a time, straight into png_write_row.
+//Time spent converting (not writing) is added to convert_ns if given.
+int SetIDAT(png_structp png_ptr, LodePNGColorMode* mode_in, LodePNGColorMode* mode_out, png_bytepp row_pointers, int width, int hight, long long* convert_ns)
+{
+	int y;
+	unsigned error = 0;
+	ColorTable table;
+	png_bytep row;
+
+	//Rows already in the output mode (e.g. quantized indices) go out as they are.
+	if(lodepng_color_mode_equal(mode_out, mode_in))
+	{
+		for(y = 0; y < hight; y++) png_write_row(png_ptr, row_pointers[y]);
+		return 0;
+	}
+
+	row = (png_bytep)lodepng_malloc(((size_t)width * lodepng_get_bpp(mode_out) + 7) / 8);
+	if(!row) return 83; /*alloc fail*/
+
+	if(mode_out->colortype == LCT_PALETTE) color_table_set_palette(&table, mode_out, mode_in);
+	for(y = 0; y < hight && !error; y++)
+	{
+		long long start = convert_ns ? monotonic_ns() : 0;
+		error = lodepng_convert_pixels(row, row_pointers[y], width, mode_out, mode_in, &table);
+		if(convert_ns) *convert_ns += monotonic_ns() - start;
+		if(!error) png_write_row(png_ptr, row);
+	}
+	lodepng_free(row);
+	return error;
 }
 
 //************************************End Need to vips (End)***************************************************
 
 
 //************************************Only for testing (Start)**********************************************
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
 #include <io.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #define PNG_BYTES_TO_CHECK 4
 
+//Quality range handed to imagequant, same as used for JPEG currently.
+#define QUANT_QUALITY_MIN 50
+#define QUANT_QUALITY_MAX 76
+#define QUANT_SPEED 10
+
+//What the imagequant stage did with a tile.
+#define QUANT_NONE 0 /*lossless conversion was enough, quantizer not involved*/
+#define QUANT_DONE 1 /*more than 256 colors, written as an 8 bit palette*/
+#define QUANT_REJECTED 2 /*quality below QUANT_QUALITY_MIN, kept RGB/RGBA*/
+#define QUANT_SKIPPED 3 /*more than 256 colors but not quantizable (16 bit, streamed, liq error)*/
+
+//Tiles of a single color are written from a template instead of being encoded.
+#define UNIFORM_NONE 0
+#define UNIFORM_SOLID 1 /*every pixel the same color*/
+#define UNIFORM_TRANSPARENT 2 /*every pixel fully transparent, whatever its RGB*/
+
 typedef struct _auto_pic_data auto_pic_data;
 struct _auto_pic_data
 {
 	int width;
 	int height;
 	png_bytepp row_pointers;
-	int size; //coverted file size
-	int src_size; //seed file size
+	long long size; //coverted file size, 64 bit as streamed images can pass 2 GB
+	long long src_size; //seed file size
+	int quant; //QUANT_* result of the imagequant stage
+	int uniform; //UNIFORM_* when written from a template
+	int cut; //cut from a larger image by the pyramid, there is no source file to keep
 };
 
 typedef struct _file_type_info file_type_info;
 struct _file_type_info
 {
-	int num;
-	int size;
-	int src_size;
+	long long num;
+	long long size; /*64 bit, tile sets are many GB*/
+	long long src_size;
 };
 
 void file_type_info_init(file_type_info* information)
@@ -1498,6 +1442,84 @@ void file_type_info_init(file_type_info* information)
 	information->src_size =0;
 }
 
+/*
+Time spent per tile in each phase of the conversion. Samples are nanoseconds from a
+monotonic clock, kept in a log-linear histogram: 8 buckets per power of two, so a
+percentile read back from it is within 12.5%. Merging two histograms just adds them.
+*/
+enum
+{
+	PHASE_SCAN, /*directory walk, per directory*/
+	PHASE_READ, /*open, inflate and unfilter with libpng*/
+	PHASE_PROFILE, /*hashing, uniform check, color profile*/
+	PHASE_CONVERT, /*quantization and row conversion to the output mode*/
+	PHASE_DEFLATE, /*filtering and deflate in libpng*/
+	PHASE_WRITE, /*replacing the tile on disk*/
+	PHASE_COUNT
+};
+static const char* phase_names[PHASE_COUNT] = {"scan", "read", "profile", "convert", "deflate", "write"};
+
+#define PHASE_BUCKETS 512
+
+typedef struct _phase_stats phase_stats;
+struct _phase_stats
+{
+	long long count;
+	long long total_ns;
+	long long max_ns;
+	long long buckets[PHASE_BUCKETS];
+};
+
+static int phase_bucket(long long ns)
+{
+	int e = 3;
+	if(ns < 8) return ns < 0 ? 0 : (int)ns;
+	while((ns >> (e + 1)) != 0) e++;
+	return 8 + (e - 3) * 8 + (int)((ns >> (e - 3)) & 7);
+}
+
+//Largest value that falls into bucket.
+static long long phase_bucket_limit(int bucket)
+{
+	int e, sub;
+	if(bucket < 8) return bucket;
+	e = (bucket - 8) / 8 + 3;
+	sub = (bucket - 8) % 8;
+	return ((long long)(8 + sub) << (e - 3)) + ((1LL << (e - 3)) - 1);
+}
+
+void phase_add(phase_stats* phase, long long ns)
+{
+	phase->count++;
+	phase->total_ns += ns;
+	if(ns > phase->max_ns) phase->max_ns = ns;
+	phase->buckets[phase_bucket(ns)]++;
+}
+
+void phase_merge(phase_stats* total, const phase_stats* part)
+{
+	int i;
+	total->count += part->count;
+	total->total_ns += part->total_ns;
+	if(part->max_ns > total->max_ns) total->max_ns = part->max_ns;
+	for(i = 0; i < PHASE_BUCKETS; i++) total->buckets[i] += part->buckets[i];
+}
+
+//The value below which percent of the samples are.
+long long phase_percentile(const phase_stats* phase, double percent)
+{
+	int i;
+	long long seen = 0;
+	long long rank = (long long)(phase->count * percent / 100.0 + 0.5);
+	if(rank < 1) rank = 1;
+	for(i = 0; i < PHASE_BUCKETS; i++)
+	{
+		seen += phase->buckets[i];
+		if(seen >= rank) return phase_bucket_limit(i) < phase->max_ns ? phase_bucket_limit(i) : phase->max_ns;
+	}
+	return phase->max_ns;
+}
+
 typedef struct _pngexportinfo pngexportinfo;
 struct _pngexportinfo
 {
@@ -1513,6 +1535,29 @@ struct _pngexportinfo
 
 	file_type_info rgb;
 	file_type_info rgba;
+
+	file_type_info quantized;
+	file_type_info quant_rejected;
+	file_type_info quant_skipped;
+
+	file_type_info solid;
+	file_type_info transparent;
+
+	long long cache_lookups;
+	long long cache_hits;
+
+	long long writes; /*tiles replaced by a smaller encoding*/
+	long long writes_avoided; /*encoding not smaller, source left untouched*/
+	long long bytes_saved;
+
+	long long manifest_skipped; /*unchanged since the last run*/
+	long long cleaned; /*tiles with RGB under transparent pixels made canonical*/
+	long long search_trials; /*encodes done by the compression search*/
+	long long search_wins; /*tiles where a setting other than the default was smallest*/
+	long long streamed; /*images too big to hold, converted band by band*/
+	long long failed; /*tiles or folders dropped because memory ran out or a folder could not be read*/
+
+	phase_stats phases[PHASE_COUNT];
 };
 static pngexportinfo info;
 
@@ -1523,6 +1568,16 @@ void update_file_type_info(file_type_info* information, auto_pic_data* data)
 	information->src_size +=data->src_size;
 }
 
+//Position in file, 64 bit also where long is 32 bit (Windows).
+static long long file_tell(FILE* file)
+{
+#ifdef _WIN32
+	return _ftelli64(file);
+#else
+	return (long long)ftello(file);
+#endif
+}
+
 static long lodepng_filesize(const char* filename)
 {
 	FILE* file;
@@ -1544,84 +1599,228 @@ static long lodepng_filesize(const char* filename)
 	return size;
 }
 
-void init_info()
+void init_info(pngexportinfo* stats)
 {
-	file_type_info_init(&info.grey_bit1);
-	file_type_info_init(&info.grey_bit2);
-	file_type_info_init(&info.grey_bit4);
-	file_type_info_init(&info.grey_bit8);
+	file_type_info_init(&stats->grey_bit1);
+	file_type_info_init(&stats->grey_bit2);
+	file_type_info_init(&stats->grey_bit4);
+	file_type_info_init(&stats->grey_bit8);
 
-	file_type_info_init(&info.palette_bit1);
-	file_type_info_init(&info.palette_bit2);
-	file_type_info_init(&info.palette_bit4);
-	file_type_info_init(&info.palette_bit8);
+	file_type_info_init(&stats->palette_bit1);
+	file_type_info_init(&stats->palette_bit2);
+	file_type_info_init(&stats->palette_bit4);
+	file_type_info_init(&stats->palette_bit8);
 
-	file_type_info_init(&info.rgb);
-	file_type_info_init(&info.rgba);
-}
+	file_type_info_init(&stats->rgb);
+	file_type_info_init(&stats->rgba);
 
-void display_info()
-{
-	int palette_num=0;
-	int palette_size=0;
-	int palette_src_size=0;
+	file_type_info_init(&stats->quantized);
+	file_type_info_init(&stats->quant_rejected);
+	file_type_info_init(&stats->quant_skipped);
 
-	int grey_num =0;
-	int grey_size=0;
-	int grey_src_size=0;
+	file_type_info_init(&stats->solid);
+	file_type_info_init(&stats->transparent);
 
-	int total_num =0;
-	int total_size=0;
-	int total_src_size=0;
+	stats->cache_lookups = 0;
+	stats->cache_hits = 0;
 
-	grey_num = info.grey_bit1.num + info.grey_bit2.num + info.grey_bit4.num +info.grey_bit8.num;
-	grey_size = info.grey_bit1.size + info.grey_bit2.size + info.grey_bit4.size + info.grey_bit8.size;
-	grey_src_size = info.grey_bit1.src_size + info.grey_bit2.src_size + info.grey_bit4.src_size + info.grey_bit8.src_size;
+	stats->writes = 0;
+	stats->writes_avoided = 0;
+	stats->bytes_saved = 0;
 
-	palette_num =info.palette_bit1.num+info.palette_bit2.num+info.palette_bit4.num+info.palette_bit8.num;
-	palette_size= info.palette_bit1.size+info.palette_bit2.size+info.palette_bit4.size+info.palette_bit8.size;
-	palette_src_size= info.palette_bit1.src_size+info.palette_bit2.src_size+info.palette_bit4.src_size+info.palette_bit8.src_size;
+	stats->manifest_skipped = 0;
+	stats->cleaned = 0;
+	stats->search_trials = 0;
+	stats->search_wins = 0;
+	stats->streamed = 0;
+	stats->failed = 0;
 
-	total_num = grey_num+palette_num+info.rgb.num+info.rgba.num;
-	total_size = grey_size+palette_size+info.rgb.size+info.rgba.size;
-	total_src_size= grey_src_size+ palette_src_size+info.rgb.src_size+info.rgba.src_size;
+	memset(stats->phases, 0, sizeof(stats->phases));
+}
 
-	printf("Total PNG: %3d   size = %d source_size = %d compress = %3f\n\n",total_num , total_size, total_src_size, (float)total_size/total_src_size);
-	printf("All Grey    : %3d   size = %9d percent = %3f, compress = %3f\n",grey_num, grey_size, (float)grey_size/total_size, (float)grey_size/grey_src_size);
-	printf("  Grey 1    : %3d   size = %9d percent = %3f, compress = %3f\n",info.grey_bit1.num, info.grey_bit1.size, (float)info.grey_bit1.size/total_size,(float)info.grey_bit1.size/info.grey_bit1.src_size);
-	printf("  Grey 2    : %3d   size = %9d percent = %3f, compress = %3f\n",info.grey_bit2.num, info.grey_bit2.size, (float)info.grey_bit2.size/total_size,(float)info.grey_bit2.size/info.grey_bit2.src_size);
-	printf("  Grey 4    : %3d   size = %9d percent = %3f, compress = %3f\n",info.grey_bit4.num, info.grey_bit4.size, (float)info.grey_bit4.size/total_size,(float)info.grey_bit4.size/info.grey_bit4.src_size);
-	printf("  Grey 8    : %3d   size = %9d percent = %3f, compress = %3f\n\n",info.grey_bit8.num, info.grey_bit8.size, (float)info.grey_bit8.size/total_size,(float)info.grey_bit8.size/info.grey_bit8.src_size);
-	printf("All Pal     : %3d   size = %9d percent = %3f, compress = %3f\n",palette_num, palette_size, (float)palette_size/total_size, (float)palette_size/palette_src_size);
-	printf("  Palette 1 : %3d   size = %9d percent = %3f, compress = %3f\n",info.palette_bit1.num, info.palette_bit1.size, (float)info.palette_bit1.size/total_size,(float)info.palette_bit1.size/info.palette_bit1.src_size);
-	printf("  Palette 2 : %3d   size = %9d percent = %3f, compress = %3f\n",info.palette_bit2.num, info.palette_bit2.size, (float)info.palette_bit2.size/total_size,(float)info.palette_bit2.size/info.palette_bit2.src_size);
-	printf("  Palette 4 : %3d   size = %9d percent = %3f, compress = %3f\n",info.palette_bit4.num, info.palette_bit4.size, (float)info.palette_bit4.size/total_size,(float)info.palette_bit4.size/info.palette_bit4.src_size);
-	printf("  Palette 8 : %3d   size = %9d percent = %3f, compress = %3f\n\n",info.palette_bit8.num, info.palette_bit8.size, (float)info.palette_bit8.size/total_size,(float)info.palette_bit8.size/info.palette_bit8.src_size);
-	printf("Total RGB   : %3d   size = %9d percent = %3f, compress = %3f\n\n",info.rgb.num, info.rgb.size, (float)info.rgb.size/total_size,(float)info.rgb.size/info.rgb.src_size);
-	printf("Total RGBA  : %3d   size = %9d percent = %3f, compress = %3f\n\n",info.rgba.num, info.rgba.size, (float)info.rgba.size/total_size, (float)info.rgba.size/info.rgba.src_size);
+void merge_file_type_info(file_type_info* information, const file_type_info* part)
+{
+	information->num += part->num;
+	information->size += part->size;
+	information->src_size += part->src_size;
 }
 
-void update_info(char* file_path, LodePNGColorMode* mode, auto_pic_data* data)
+//Add the counters collected by one worker thread into the totals.
+void merge_info(pngexportinfo* total, const pngexportinfo* part)
 {
-	if(mode->colortype == PNG_COLOR_TYPE_GRAY)
-	{
-		if(mode->bitdepth ==1)
+	int i;
+	merge_file_type_info(&total->grey_bit1, &part->grey_bit1);
+	merge_file_type_info(&total->grey_bit2, &part->grey_bit2);
+	merge_file_type_info(&total->grey_bit4, &part->grey_bit4);
+	merge_file_type_info(&total->grey_bit8, &part->grey_bit8);
+
+	merge_file_type_info(&total->palette_bit1, &part->palette_bit1);
+	merge_file_type_info(&total->palette_bit2, &part->palette_bit2);
+	merge_file_type_info(&total->palette_bit4, &part->palette_bit4);
+	merge_file_type_info(&total->palette_bit8, &part->palette_bit8);
+
+	merge_file_type_info(&total->rgb, &part->rgb);
+	merge_file_type_info(&total->rgba, &part->rgba);
+
+	merge_file_type_info(&total->quantized, &part->quantized);
+	merge_file_type_info(&total->quant_rejected, &part->quant_rejected);
+	merge_file_type_info(&total->quant_skipped, &part->quant_skipped);
+
+	merge_file_type_info(&total->solid, &part->solid);
+	merge_file_type_info(&total->transparent, &part->transparent);
+
+	total->cache_lookups += part->cache_lookups;
+	total->cache_hits += part->cache_hits;
+
+	total->writes += part->writes;
+	total->writes_avoided += part->writes_avoided;
+	total->bytes_saved += part->bytes_saved;
+
+	total->manifest_skipped += part->manifest_skipped;
+	total->cleaned += part->cleaned;
+	total->search_trials += part->search_trials;
+	total->search_wins += part->search_wins;
+	total->streamed += part->streamed;
+	total->failed += part->failed;
+
+	for(i = 0; i < PHASE_COUNT; i++) phase_merge(&total->phases[i], &part->phases[i]);
+}
+
+void display_info()
+{
+	int i;
+
+	long long palette_num=0;
+	long long palette_size=0;
+	long long palette_src_size=0;
+
+	long long grey_num =0;
+	long long grey_size=0;
+	long long grey_src_size=0;
+
+	long long total_num =0;
+	long long total_size=0;
+	long long total_src_size=0;
+
+	grey_num = info.grey_bit1.num + info.grey_bit2.num + info.grey_bit4.num +info.grey_bit8.num;
+	grey_size = info.grey_bit1.size + info.grey_bit2.size + info.grey_bit4.size + info.grey_bit8.size;
+	grey_src_size = info.grey_bit1.src_size + info.grey_bit2.src_size + info.grey_bit4.src_size + info.grey_bit8.src_size;
+
+	palette_num =info.palette_bit1.num+info.palette_bit2.num+info.palette_bit4.num+info.palette_bit8.num;
+	palette_size= info.palette_bit1.size+info.palette_bit2.size+info.palette_bit4.size+info.palette_bit8.size;
+	palette_src_size= info.palette_bit1.src_size+info.palette_bit2.src_size+info.palette_bit4.src_size+info.palette_bit8.src_size;
+
+	total_num = grey_num+palette_num+info.rgb.num+info.rgba.num+info.solid.num+info.transparent.num;
+	total_size = grey_size+palette_size+info.rgb.size+info.rgba.size+info.solid.size+info.transparent.size;
+	total_src_size= grey_src_size+ palette_src_size+info.rgb.src_size+info.rgba.src_size+info.solid.src_size+info.transparent.src_size;
+
+	printf("Total PNG: %3lld   size = %lld source_size = %lld compress = %3f\n\n",total_num , total_size, total_src_size, (float)total_size/total_src_size);
+	printf("All Grey    : %3lld   size = %9lld percent = %3f, compress = %3f\n",grey_num, grey_size, (float)grey_size/total_size, (float)grey_size/grey_src_size);
+	printf("  Grey 1    : %3lld   size = %9lld percent = %3f, compress = %3f\n",info.grey_bit1.num, info.grey_bit1.size, (float)info.grey_bit1.size/total_size,(float)info.grey_bit1.size/info.grey_bit1.src_size);
+	printf("  Grey 2    : %3lld   size = %9lld percent = %3f, compress = %3f\n",info.grey_bit2.num, info.grey_bit2.size, (float)info.grey_bit2.size/total_size,(float)info.grey_bit2.size/info.grey_bit2.src_size);
+	printf("  Grey 4    : %3lld   size = %9lld percent = %3f, compress = %3f\n",info.grey_bit4.num, info.grey_bit4.size, (float)info.grey_bit4.size/total_size,(float)info.grey_bit4.size/info.grey_bit4.src_size);
+	printf("  Grey 8    : %3lld   size = %9lld percent = %3f, compress = %3f\n\n",info.grey_bit8.num, info.grey_bit8.size, (float)info.grey_bit8.size/total_size,(float)info.grey_bit8.size/info.grey_bit8.src_size);
+	printf("All Pal     : %3lld   size = %9lld percent = %3f, compress = %3f\n",palette_num, palette_size, (float)palette_size/total_size, (float)palette_size/palette_src_size);
+	printf("  Palette 1 : %3lld   size = %9lld percent = %3f, compress = %3f\n",info.palette_bit1.num, info.palette_bit1.size, (float)info.palette_bit1.size/total_size,(float)info.palette_bit1.size/info.palette_bit1.src_size);
+	printf("  Palette 2 : %3lld   size = %9lld percent = %3f, compress = %3f\n",info.palette_bit2.num, info.palette_bit2.size, (float)info.palette_bit2.size/total_size,(float)info.palette_bit2.size/info.palette_bit2.src_size);
+	printf("  Palette 4 : %3lld   size = %9lld percent = %3f, compress = %3f\n",info.palette_bit4.num, info.palette_bit4.size, (float)info.palette_bit4.size/total_size,(float)info.palette_bit4.size/info.palette_bit4.src_size);
+	printf("  Palette 8 : %3lld   size = %9lld percent = %3f, compress = %3f\n\n",info.palette_bit8.num, info.palette_bit8.size, (float)info.palette_bit8.size/total_size,(float)info.palette_bit8.size/info.palette_bit8.src_size);
+	printf("Total RGB   : %3lld   size = %9lld percent = %3f, compress = %3f\n\n",info.rgb.num, info.rgb.size, (float)info.rgb.size/total_size,(float)info.rgb.size/info.rgb.src_size);
+	printf("Total RGBA  : %3lld   size = %9lld percent = %3f, compress = %3f\n\n",info.rgba.num, info.rgba.size, (float)info.rgba.size/total_size, (float)info.rgba.size/info.rgba.src_size);
+	printf("Solid       : %3lld   size = %9lld percent = %3f, compress = %3f\n",info.solid.num, info.solid.size, (float)info.solid.size/total_size, (float)info.solid.size/info.solid.src_size);
+	printf("Transparent : %3lld   size = %9lld percent = %3f, compress = %3f\n\n",info.transparent.num, info.transparent.size, (float)info.transparent.size/total_size, (float)info.transparent.size/info.transparent.src_size);
+	printf("Quantized   : %3lld   size = %9lld percent = %3f, compress = %3f\n",info.quantized.num, info.quantized.size, (float)info.quantized.size/total_size, (float)info.quantized.size/info.quantized.src_size);
+	printf("  Rejected  : %3lld   size = %9lld percent = %3f, compress = %3f\n",info.quant_rejected.num, info.quant_rejected.size, (float)info.quant_rejected.size/total_size, (float)info.quant_rejected.size/info.quant_rejected.src_size);
+	printf("  Skipped   : %3lld   size = %9lld percent = %3f, compress = %3f\n\n",info.quant_skipped.num, info.quant_skipped.size, (float)info.quant_skipped.size/total_size, (float)info.quant_skipped.size/info.quant_skipped.src_size);
+	printf("Cache hits  : %3lld of %3lld   hit rate = %3f\n\n",info.cache_hits, info.cache_lookups, (float)info.cache_hits/info.cache_lookups);
+	printf("Written     : %3lld   avoided = %3lld   bytes saved = %lld\n\n",info.writes, info.writes_avoided, info.bytes_saved);
+	printf("Unchanged   : %3lld   skipped by the manifest\n\n",info.manifest_skipped);
+	printf("Cleaned     : %3lld   tiles with RGB under transparent pixels\n\n",info.cleaned);
+	printf("Search      : %3lld   trials, %lld tiles better than the default setting\n\n",info.search_trials,info.search_wins);
+	printf("Streamed    : %3lld   images converted band by band\n\n",info.streamed);
+	printf("Failed      : %3lld   tiles or folders dropped\n\n",info.failed);
+
+	printf("Phase       :   count   total ms     p50 us     p95 us     p99 us     max us\n");
+	for(i = 0; i < PHASE_COUNT; i++)
+	{
+		const phase_stats* phase = &info.phases[i];
+		printf("  %-9s : %7lld %10.1f %10.1f %10.1f %10.1f %10.1f\n", phase_names[i], phase->count, phase->total_ns / 1e6,
+			phase_percentile(phase, 50) / 1e3, phase_percentile(phase, 95) / 1e3, phase_percentile(phase, 99) / 1e3, phase->max_ns / 1e3);
+	}
+	printf("\n");
+}
+
+//The same numbers as display_info, as JSON for tracking runs between builds.
+int write_report(const char* path, double wall_seconds)
+{
+	int i;
+	FILE* fp;
+	const char* names[] = {"grey1", "grey2", "grey4", "grey8", "palette1", "palette2", "palette4", "palette8",
+		"rgb", "rgba", "solid", "transparent", "quantized", "quant_rejected", "quant_skipped"};
+	const file_type_info* categories[] = {&info.grey_bit1, &info.grey_bit2, &info.grey_bit4, &info.grey_bit8,
+		&info.palette_bit1, &info.palette_bit2, &info.palette_bit4, &info.palette_bit8,
+		&info.rgb, &info.rgba, &info.solid, &info.transparent, &info.quantized, &info.quant_rejected, &info.quant_skipped};
+	const int num_categories = sizeof(categories) / sizeof(categories[0]);
+
+	fp = fopen(path, "w");
+	if(!fp) return -1;
+
+	fprintf(fp, "{\n  \"wall_seconds\": %.6f,\n  \"categories\": {\n", wall_seconds);
+	for(i = 0; i < num_categories; i++)
+	{
+		fprintf(fp, "    \"%s\": {\"num\": %lld, \"size\": %lld, \"src_size\": %lld}%s\n", names[i],
+			categories[i]->num, categories[i]->size, categories[i]->src_size, i + 1 < num_categories ? "," : "");
+	}
+	fprintf(fp, "  },\n");
+	fprintf(fp, "  \"cache\": {\"lookups\": %lld, \"hits\": %lld},\n", info.cache_lookups, info.cache_hits);
+	fprintf(fp, "  \"writes\": {\"written\": %lld, \"avoided\": %lld, \"bytes_saved\": %lld},\n",
+		info.writes, info.writes_avoided, info.bytes_saved);
+	fprintf(fp, "  \"manifest_skipped\": %lld,\n  \"cleaned\": %lld,\n  \"streamed\": %lld,\n  \"failed\": %lld,\n",
+		info.manifest_skipped, info.cleaned, info.streamed, info.failed);
+	fprintf(fp, "  \"search\": {\"trials\": %lld, \"wins\": %lld},\n  \"phases\": {\n", info.search_trials, info.search_wins);
+	for(i = 0; i < PHASE_COUNT; i++)
+	{
+		const phase_stats* phase = &info.phases[i];
+		fprintf(fp, "    \"%s\": {\"count\": %lld, \"total_ns\": %lld, \"p50_ns\": %lld, \"p95_ns\": %lld, \"p99_ns\": %lld, \"max_ns\": %lld}%s\n",
+			phase_names[i], phase->count, phase->total_ns, phase_percentile(phase, 50), phase_percentile(phase, 95),
+			phase_percentile(phase, 99), phase->max_ns, i + 1 < PHASE_COUNT ? "," : "");
+	}
+	fprintf(fp, "  }\n}\n");
+	return fclose(fp) == 0 ? 0 : -1;
+}
+
+void update_info(pngexportinfo* stats, char* file_path, LodePNGColorMode* mode, auto_pic_data* data)
+{
+	if(data->uniform == UNIFORM_SOLID)
+	{
+		update_file_type_info(&stats->solid, data);
+		return;
+	}
+	else if(data->uniform == UNIFORM_TRANSPARENT)
+	{
+		update_file_type_info(&stats->transparent, data);
+		return;
+	}
+
+	if(mode->colortype == PNG_COLOR_TYPE_GRAY)
+	{
+		if(mode->bitdepth ==1)
 		{
-			update_file_type_info(&info.grey_bit1, data);
+			update_file_type_info(&stats->grey_bit1, data);
 		}
 		else if(mode->bitdepth==2)
 		{
-			update_file_type_info(&info.grey_bit2, data);
+			update_file_type_info(&stats->grey_bit2, data);
 			//printf("P2****** %s",file_path);
 		}
 		else if(mode->bitdepth==4)
 		{
-			update_file_type_info(&info.grey_bit4, data);
+			update_file_type_info(&stats->grey_bit4, data);
 			//printf("P4****** %s",file_path);
 		}
 		else if(mode->bitdepth==8)
 		{
-			update_file_type_info(&info.grey_bit8, data);
+			update_file_type_info(&stats->grey_bit8, data);
 		}
 		else
 		{
@@ -1632,271 +1831,3774 @@ void update_info(char* file_path, LodePNGColorMode* mode, auto_pic_data* data)
 	{
 		if(mode->bitdepth ==1)
 		{
-			update_file_type_info(&info.palette_bit1, data);
+			update_file_type_info(&stats->palette_bit1, data);
 		}
 		else if(mode->bitdepth==2)
 		{
-			update_file_type_info(&info.palette_bit2, data);
+			update_file_type_info(&stats->palette_bit2, data);
 		}
 		else if(mode->bitdepth==4)
 		{
-			update_file_type_info(&info.palette_bit4, data);
+			update_file_type_info(&stats->palette_bit4, data);
 		}
 		else if(mode->bitdepth==8)
 		{
-			update_file_type_info(&info.palette_bit8, data);
+			update_file_type_info(&stats->palette_bit8, data);
+		}
+		else
+		{
+			printf("palette color bitdepth error\n");
+		}
+		
+		//printf("palette bit_%d= %s\n", mode->bitdepth, file_path);
+
+	}
+	else if(mode->colortype ==PNG_COLOR_TYPE_RGB)
+	{
+		update_file_type_info(&stats->rgb, data);
+		printf("%s colortype = RGB\n",file_path);
+	}
+	else if(mode->colortype == PNG_COLOR_TYPE_RGB_ALPHA)
+	{
+		update_file_type_info(&stats->rgba, data);
+		printf("%s colortype = RGBA\n",file_path);
+	}
+
+	if(data->quant == QUANT_DONE)
+	{
+		update_file_type_info(&stats->quantized, data);
+	}
+	else if(data->quant == QUANT_REJECTED)
+	{
+		update_file_type_info(&stats->quant_rejected, data);
+	}
+	else if(data->quant == QUANT_SKIPPED)
+	{
+		update_file_type_info(&stats->quant_skipped, data);
+	}
+	//printf("%s type = %d bit= %d\n",file_path, mode->colortype, mode->bitdepth);
+}
+
+//Thread primitives used by the conversion engine, Win32 threads or pthreads.
+#ifdef _WIN32
+typedef HANDLE engine_thread;
+typedef CRITICAL_SECTION engine_mutex;
+typedef CONDITION_VARIABLE engine_cond;
+#define engine_mutex_init(m) InitializeCriticalSection(m)
+#define engine_mutex_destroy(m) DeleteCriticalSection(m)
+#define engine_mutex_lock(m) EnterCriticalSection(m)
+#define engine_mutex_unlock(m) LeaveCriticalSection(m)
+#define engine_cond_init(c) InitializeConditionVariable(c)
+#define engine_cond_destroy(c)
+#define engine_cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define engine_cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_t engine_thread;
+typedef pthread_mutex_t engine_mutex;
+typedef pthread_cond_t engine_cond;
+#define engine_mutex_init(m) pthread_mutex_init(m, NULL)
+#define engine_mutex_destroy(m) pthread_mutex_destroy(m)
+#define engine_mutex_lock(m) pthread_mutex_lock(m)
+#define engine_mutex_unlock(m) pthread_mutex_unlock(m)
+#define engine_cond_init(c) pthread_cond_init(c, NULL)
+#define engine_cond_destroy(c) pthread_cond_destroy(c)
+#define engine_cond_wait(c, m) pthread_cond_wait(c, m)
+#define engine_cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+//************************************Tile cache (Start)**************************************************
+/*
+Tiles with the same pixels come out the same, so each distinct tile is profiled and
+encoded once. The key is a 128 bit hash of the decoded rows plus width, height and
+color mode. An entry keeps the encoded png (or that the source was already optimal)
+and entries are dropped least recently used first once the cache holds more than
+max_memory bytes. One cache is shared by all workers, every access takes the lock.
+*/
+#define TILE_CACHE_BUCKETS 65536
+#define TILE_CACHE_DEFAULT_MB 64
+
+typedef struct _tile_key tile_key;
+struct _tile_key
+{
+	unsigned long long h1;
+	unsigned long long h2;
+	int width;
+	int height;
+	int colortype;
+	int bitdepth;
+};
+
+//The result of converting one tile, as far as another tile with the same pixels needs it.
+typedef struct _tile_output tile_output;
+struct _tile_output
+{
+	int keep; /*source was already optimal, nothing is written*/
+	int colortype; /*what the tile was written as, for the stats*/
+	int bitdepth;
+	int quant;
+	unsigned char* data; /*encoded png*/
+	size_t size;
+	char* path; /*first file written with data, source for hardlinks*/
+};
+
+typedef struct _cache_entry cache_entry;
+struct _cache_entry
+{
+	tile_key key;
+	tile_output output; /*data and path live right behind the entry*/
+	size_t memory;
+	cache_entry* next; /*bucket chain*/
+	cache_entry* newer; /*LRU list*/
+	cache_entry* older;
+};
+
+typedef struct _tile_cache tile_cache;
+struct _tile_cache
+{
+	engine_mutex lock;
+	cache_entry** buckets;
+	cache_entry* newest;
+	cache_entry* oldest;
+	size_t memory;
+	size_t max_memory;
+	int hardlink; /*link hits to the first output file instead of writing them again*/
+};
+
+static unsigned long long tile_hash_rotl(unsigned long long x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static unsigned long long tile_hash_fmix(unsigned long long k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+//MurmurHash3 x64 128 over the decoded pixels, seeded with the tile size and color mode.
+void tile_key_init(tile_key* key, const unsigned char* data, size_t len, int width, int height, const LodePNGColorMode* mode)
+{
+	const unsigned long long c1 = 0x87c37b91114253d5ULL;
+	const unsigned long long c2 = 0x4cf5ad432745937fULL;
+	unsigned long long h1 = ((unsigned long long)(unsigned)width << 32) | (unsigned)height;
+	unsigned long long h2 = ((unsigned long long)mode->colortype << 32) | mode->bitdepth;
+	unsigned long long k1, k2;
+	unsigned char tail[16];
+	size_t i, nblocks = len / 16;
+
+	for(i = 0; i < nblocks; i++)
+	{
+		memcpy(&k1, data + i * 16, 8);
+		memcpy(&k2, data + i * 16 + 8, 8);
+
+		k1 *= c1; k1 = tile_hash_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = tile_hash_rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = tile_hash_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = tile_hash_rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	/*zero padded tail, len is mixed in below so padding can not collide*/
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, data + nblocks * 16, len & 15);
+	memcpy(&k1, tail, 8);
+	memcpy(&k2, tail + 8, 8);
+	k2 *= c2; k2 = tile_hash_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+	k1 *= c1; k1 = tile_hash_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+
+	h1 ^= len; h2 ^= len;
+	h1 += h2; h2 += h1;
+	h1 = tile_hash_fmix(h1); h2 = tile_hash_fmix(h2);
+	h1 += h2; h2 += h1;
+
+	key->h1 = h1;
+	key->h2 = h2;
+	key->width = width;
+	key->height = height;
+	key->colortype = mode->colortype;
+	key->bitdepth = mode->bitdepth;
+}
+
+static int tile_key_equal(const tile_key* a, const tile_key* b)
+{
+	return a->h1 == b->h1 && a->h2 == b->h2 && a->width == b->width && a->height == b->height
+		&& a->colortype == b->colortype && a->bitdepth == b->bitdepth;
+}
+
+static cache_entry** tile_cache_bucket(tile_cache* cache, const tile_key* key)
+{
+	return &cache->buckets[key->h1 & (TILE_CACHE_BUCKETS - 1)];
+}
+
+static void tile_cache_unlink(tile_cache* cache, cache_entry* entry)
+{
+	if(entry->newer) entry->newer->older = entry->older;
+	else cache->newest = entry->older;
+	if(entry->older) entry->older->newer = entry->newer;
+	else cache->oldest = entry->newer;
+}
+
+static void tile_cache_push(tile_cache* cache, cache_entry* entry)
+{
+	entry->newer = NULL;
+	entry->older = cache->newest;
+	if(cache->newest) cache->newest->newer = entry;
+	cache->newest = entry;
+	if(!cache->oldest) cache->oldest = entry;
+}
+
+static void tile_cache_evict_oldest(tile_cache* cache)
+{
+	cache_entry* entry = cache->oldest;
+	cache_entry** link = tile_cache_bucket(cache, &entry->key);
+	while(*link != entry) link = &(*link)->next;
+	*link = entry->next;
+	tile_cache_unlink(cache, entry);
+	cache->memory -= entry->memory;
+	free(entry);
+}
+
+//max_memory of 0 disables the cache.
+int tile_cache_init(tile_cache* cache, size_t max_memory, int hardlink)
+{
+	cache->buckets = NULL;
+	cache->newest = NULL;
+	cache->oldest = NULL;
+	cache->memory = 0;
+	cache->max_memory = max_memory;
+	cache->hardlink = hardlink;
+	if(!max_memory) return 0;
+
+	cache->buckets = (cache_entry**)calloc(TILE_CACHE_BUCKETS, sizeof(cache_entry*));
+	if(!cache->buckets) return -1;
+	engine_mutex_init(&cache->lock);
+	return 0;
+}
+
+void tile_cache_cleanup(tile_cache* cache)
+{
+	if(!cache->buckets) return;
+	while(cache->oldest) tile_cache_evict_oldest(cache);
+	free(cache->buckets);
+	cache->buckets = NULL;
+	engine_mutex_destroy(&cache->lock);
+}
+
+/*
+Copy the result stored for key into output, its data and path are allocated with
+lodepng_malloc (the tile's arena) so the entry may be evicted right after.
+Returns 1 on a hit.
+*/
+int tile_cache_lookup(tile_cache* cache, const tile_key* key, tile_output* output)
+{
+	cache_entry* entry;
+	int hit = 0;
+	if(!cache->buckets) return 0;
+
+	engine_mutex_lock(&cache->lock);
+	for(entry = *tile_cache_bucket(cache, key); entry; entry = entry->next)
+	{
+		if(tile_key_equal(&entry->key, key)) break;
+	}
+	if(entry)
+	{
+		*output = entry->output;
+		output->data = NULL;
+		output->path = NULL;
+		if(entry->output.size) output->data = (unsigned char*)lodepng_malloc(entry->output.size);
+		if(entry->output.path) output->path = (char*)lodepng_malloc(strlen(entry->output.path) + 1);
+		if((output->data || !entry->output.size) && (output->path || !entry->output.path))
+		{
+			if(output->data) memcpy(output->data, entry->output.data, entry->output.size);
+			if(output->path) strcpy(output->path, entry->output.path);
+			tile_cache_unlink(cache, entry);
+			tile_cache_push(cache, entry);
+			hit = 1;
+		}
+	}
+	engine_mutex_unlock(&cache->lock);
+	return hit;
+}
+
+//Remember output for key, evicting the least recently used entries to stay under max_memory.
+void tile_cache_insert(tile_cache* cache, const tile_key* key, const tile_output* output)
+{
+	cache_entry* entry;
+	cache_entry* other;
+	cache_entry** bucket;
+	size_t path_size = output->path ? strlen(output->path) + 1 : 0;
+	size_t memory = sizeof(cache_entry) + output->size + path_size;
+	if(!cache->buckets || memory > cache->max_memory) return;
+
+	entry = (cache_entry*)malloc(memory);
+	if(!entry) return;
+	entry->key = *key;
+	entry->output = *output;
+	entry->output.data = (unsigned char*)(entry + 1);
+	entry->output.path = path_size ? (char*)entry->output.data + output->size : NULL;
+	if(output->size) memcpy(entry->output.data, output->data, output->size);
+	if(path_size) memcpy(entry->output.path, output->path, path_size);
+	entry->memory = memory;
+
+	engine_mutex_lock(&cache->lock);
+	bucket = tile_cache_bucket(cache, key);
+	for(other = *bucket; other; other = other->next)
+	{
+		if(tile_key_equal(&other->key, key)) break; /*another worker was faster*/
+	}
+	if(!other)
+	{
+		while(cache->oldest && cache->memory + memory > cache->max_memory) tile_cache_evict_oldest(cache);
+		entry->next = *bucket;
+		*bucket = entry;
+		tile_cache_push(cache, entry);
+		cache->memory += memory;
+		entry = NULL;
+	}
+	engine_mutex_unlock(&cache->lock);
+	free(entry);
+}
+//************************************Tile cache (End)****************************************************
+
+//************************************Uniform tiles (Start)***********************************************
+/*
+Single color tiles become a 1 bit image: opaque black or white as grey 0 or 1, every
+other color as a palette of one entry and index 0. The IDAT then only depends on width,
+height and whether the bits are all 0 or all 1, so it is deflated once for each of
+those and kept as a template. Writing a uniform tile is just IHDR/PLTE/tRNS around it.
+*/
+typedef struct _uniform_template uniform_template;
+struct _uniform_template
+{
+	uniform_template* next;
+	int width;
+	int height;
+	unsigned char fill; /*0x00 or 0xff, the byte every row is made of*/
+	unsigned char* idat; /*zlib stream of the rows, right behind the struct*/
+	size_t idat_size;
+};
+
+/*
+Whether all pixels of the 8 bit RGB/RGBA image equal the first one, or are all fully
+transparent. Rows are contiguous, so comparing the image against itself shifted by one
+pixel covers every pixel with a single memcmp, which libc does with wide vector loads.
+The color that represents the tile goes to color (RGBA).
+*/
+int uniform_tile(const unsigned char* data, size_t size, const LodePNGColorMode* mode, unsigned char color[4])
+{
+	size_t i;
+	unsigned alpha = 0;
+	unsigned bpp = lodepng_get_bpp(mode) / 8;
+	if(mode->bitdepth != 8 || size < bpp) return UNIFORM_NONE;
+
+	color[0] = data[0];
+	color[1] = data[1];
+	color[2] = data[2];
+	color[3] = mode->colortype == LCT_RGBA ? data[3] : 255;
+	if(memcmp(data + bpp, data, size - bpp) == 0) return color[3] ? UNIFORM_SOLID : UNIFORM_TRANSPARENT;
+
+	if(mode->colortype != LCT_RGBA) return UNIFORM_NONE;
+	for(i = 3; i < size; i += 4) alpha |= data[i]; /*no early exit, so it vectorizes*/
+	if(alpha) return UNIFORM_NONE;
+	color[0] = color[1] = color[2] = color[3] = 0;
+	return UNIFORM_TRANSPARENT;
+}
+
+static const uniform_template* uniform_template_get(uniform_template** templates, int width, int height, unsigned char fill)
+{
+	uniform_template* tmpl;
+	unsigned char* raw;
+	size_t y;
+	size_t rowbytes = ((size_t)width + 7) / 8;
+	size_t raw_size = (size_t)height * (1 + rowbytes);
+	uLongf idat_size = compressBound((uLong)raw_size);
+
+	for(tmpl = *templates; tmpl; tmpl = tmpl->next)
+	{
+		if(tmpl->width == width && tmpl->height == height && tmpl->fill == fill) return tmpl;
+	}
+
+	raw = (unsigned char*)malloc(raw_size);
+	tmpl = (uniform_template*)malloc(sizeof(uniform_template) + idat_size);
+	if(raw)
+	{
+		memset(raw, fill, raw_size);
+		for(y = 0; y < (size_t)height; y++) raw[y * (1 + rowbytes)] = 0; /*filter type none*/
+	}
+	if(!raw || !tmpl || compress2((Bytef*)(tmpl + 1), &idat_size, raw, (uLong)raw_size, 9) != Z_OK)
+	{
+		free(raw);
+		free(tmpl);
+		return NULL;
+	}
+	free(raw);
+	tmpl->width = width;
+	tmpl->height = height;
+	tmpl->fill = fill;
+	tmpl->idat = (unsigned char*)(tmpl + 1);
+	tmpl->idat_size = idat_size;
+	tmpl->next = *templates;
+	*templates = tmpl;
+	return tmpl;
+}
+
+void uniform_template_cleanup(uniform_template** templates)
+{
+	while(*templates)
+	{
+		uniform_template* next = (*templates)->next;
+		free(*templates);
+		*templates = next;
+	}
+}
+
+static unsigned char* uniform_put_uint32(unsigned char* out, unsigned value)
+{
+	out[0] = (unsigned char)(value >> 24);
+	out[1] = (unsigned char)(value >> 16);
+	out[2] = (unsigned char)(value >> 8);
+	out[3] = (unsigned char)value;
+	return out + 4;
+}
+
+static unsigned char* uniform_put_chunk(unsigned char* out, const char* type, const unsigned char* data, size_t size)
+{
+	unsigned char* start;
+	out = uniform_put_uint32(out, (unsigned)size);
+	start = out;
+	memcpy(out, type, 4);
+	if(size) memcpy(out + 4, data, size);
+	out += 4 + size;
+	return uniform_put_uint32(out, (unsigned)crc32(0, start, (uInt)(4 + size)));
+}
+
+//Encode the tile of width x height in color as a 1 bit png, in the tile's arena.
+//The colortype and bitdepth written go to mode: grey for opaque black or white, else palette.
+unsigned char* encode_uniform_png(uniform_template** templates, int width, int height, const unsigned char color[4],
+	LodePNGColorMode* mode, size_t* png_size)
+{
+	static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+	unsigned char ihdr[13];
+	unsigned char* png;
+	unsigned char* out;
+	size_t size;
+	const uniform_template* tmpl;
+	int grey = color[3] == 255 && color[0] == color[1] && color[1] == color[2] && (color[0] == 0 || color[0] == 255);
+
+	tmpl = uniform_template_get(templates, width, height, grey ? color[0] : 0);
+	if(!tmpl) return NULL;
+
+	size = 8 + (12 + 13) + (12 + 3) + (12 + 1) + (12 + tmpl->idat_size) + 12;
+	png = (unsigned char*)lodepng_malloc(size);
+	if(!png) return NULL;
+
+	uniform_put_uint32(ihdr, (unsigned)width);
+	uniform_put_uint32(ihdr + 4, (unsigned)height);
+	ihdr[8] = 1; /*bit depth*/
+	ihdr[9] = grey ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_PALETTE;
+	ihdr[10] = ihdr[11] = ihdr[12] = 0; /*deflate, adaptive filtering, no interlace*/
+
+	memcpy(png, signature, 8);
+	out = uniform_put_chunk(png + 8, "IHDR", ihdr, 13);
+	if(!grey) out = uniform_put_chunk(out, "PLTE", color, 3);
+	if(!grey && color[3] != 255) out = uniform_put_chunk(out, "tRNS", color + 3, 1);
+	out = uniform_put_chunk(out, "IDAT", tmpl->idat, tmpl->idat_size);
+	out = uniform_put_chunk(out, "IEND", NULL, 0);
+	*png_size = out - png;
+	mode->colortype = grey ? LCT_GREY : LCT_PALETTE;
+	mode->bitdepth = 1;
+	return png;
+}
+//************************************Uniform tiles (End)*************************************************
+
+//************************************Clean transparent (Start)*******************************************
+/*
+RGB under alpha 0 is invisible but still counts as a color in the profile and still
+has to be deflated. With -t it is made canonical before anything looks at the tile:
+zero, so that all transparent pixels are one palette entry (or a color key), and for
+tiles that stay RGBA optionally the pixel above, which is what the Up filter predicts,
+so those bytes filter to zeros. The loops are branch free so the compiler vectorizes
+them, a tile costs a few microseconds.
+*/
+#define CLEAN_NONE 0
+#define CLEAN_ZERO 1 /*RGB under alpha 0 becomes 0*/
+#define CLEAN_UP 2 /*as CLEAN_ZERO, then the RGB of the pixel above for tiles written as RGBA*/
+
+/*
+x86 kernels, picked once by clean_transparent_init from what CPUID reports: AVX2 does 8
+pixels at a time, SSE2 4. Both take whole vectors and return how many bytes they did,
+the C loops below finish the row. A pixel is transparent when its alpha lane compares
+equal to zero, for 16 bit the upper 32 bits of each pixel are compared and broadcast.
+*/
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CLEAN_SIMD 1
+#define CLEAN_TARGET(isa) __attribute__((target(isa)))
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define CLEAN_SIMD 1
+#define CLEAN_TARGET(isa)
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#define CLEAN_SIMD 0
+#endif
+
+typedef size_t (*clean_zero_kernel)(unsigned char* data, size_t bytes, unsigned bitdepth, unsigned* changed);
+typedef size_t (*clean_up_kernel)(unsigned char* row, const unsigned char* above, size_t bytes, unsigned bitdepth);
+
+static clean_zero_kernel clean_zero_simd = NULL;
+static clean_up_kernel clean_up_simd = NULL;
+
+#if CLEAN_SIMD
+CLEAN_TARGET("sse2") static size_t clean_zero_sse2(unsigned char* data, size_t bytes, unsigned bitdepth, unsigned* changed)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha = bitdepth == 8 ? _mm_set1_epi32((int)0xFF000000u) : _mm_set_epi32((int)0xFFFF0000u, 0, (int)0xFFFF0000u, 0);
+	__m128i dirty = zero;
+	size_t i;
+	for(i = 0; i + 16 <= bytes; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+		__m128i clear = _mm_cmpeq_epi32(_mm_and_si128(v, alpha), zero);
+		if(bitdepth != 8) clear = _mm_shuffle_epi32(clear, _MM_SHUFFLE(3, 3, 1, 1));
+		dirty = _mm_or_si128(dirty, _mm_and_si128(v, clear));
+		_mm_storeu_si128((__m128i*)(data + i), _mm_andnot_si128(clear, v));
+	}
+	*changed |= _mm_movemask_epi8(_mm_cmpeq_epi8(dirty, zero)) != 0xFFFF;
+	return i;
+}
+
+CLEAN_TARGET("sse2") static size_t clean_up_sse2(unsigned char* row, const unsigned char* above, size_t bytes, unsigned bitdepth)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha = bitdepth == 8 ? _mm_set1_epi32((int)0xFF000000u) : _mm_set_epi32((int)0xFFFF0000u, 0, (int)0xFFFF0000u, 0);
+	size_t i;
+	for(i = 0; i + 16 <= bytes; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(row + i));
+		__m128i a = _mm_loadu_si128((const __m128i*)(above + i));
+		__m128i take = _mm_cmpeq_epi32(_mm_and_si128(v, alpha), zero);
+		if(bitdepth != 8) take = _mm_shuffle_epi32(take, _MM_SHUFFLE(3, 3, 1, 1));
+		take = _mm_andnot_si128(alpha, take); /*the pixel keeps its own alpha*/
+		_mm_storeu_si128((__m128i*)(row + i), _mm_or_si128(_mm_andnot_si128(take, v), _mm_and_si128(take, a)));
+	}
+	return i;
+}
+
+CLEAN_TARGET("avx2") static size_t clean_zero_avx2(unsigned char* data, size_t bytes, unsigned bitdepth, unsigned* changed)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i alpha = bitdepth == 8 ? _mm256_set1_epi32((int)0xFF000000u) : _mm256_set1_epi64x((long long)0xFFFF000000000000ull);
+	__m256i dirty = zero;
+	size_t i;
+	for(i = 0; i + 32 <= bytes; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+		__m256i clear = bitdepth == 8 ? _mm256_cmpeq_epi32(_mm256_and_si256(v, alpha), zero) : _mm256_cmpeq_epi64(_mm256_and_si256(v, alpha), zero);
+		dirty = _mm256_or_si256(dirty, _mm256_and_si256(v, clear));
+		_mm256_storeu_si256((__m256i*)(data + i), _mm256_andnot_si256(clear, v));
+	}
+	*changed |= !_mm256_testz_si256(dirty, dirty);
+	return i;
+}
+
+CLEAN_TARGET("avx2") static size_t clean_up_avx2(unsigned char* row, const unsigned char* above, size_t bytes, unsigned bitdepth)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i alpha = bitdepth == 8 ? _mm256_set1_epi32((int)0xFF000000u) : _mm256_set1_epi64x((long long)0xFFFF000000000000ull);
+	size_t i;
+	for(i = 0; i + 32 <= bytes; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(row + i));
+		__m256i a = _mm256_loadu_si256((const __m256i*)(above + i));
+		__m256i take = bitdepth == 8 ? _mm256_cmpeq_epi32(_mm256_and_si256(v, alpha), zero) : _mm256_cmpeq_epi64(_mm256_and_si256(v, alpha), zero);
+		take = _mm256_andnot_si256(alpha, take);
+		_mm256_storeu_si256((__m256i*)(row + i), _mm256_blendv_epi8(v, a, take));
+	}
+	return i;
+}
+
+static void clean_cpuid(unsigned leaf, unsigned regs[4])
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuidex(info, (int)leaf, 0);
+	regs[0] = (unsigned)info[0];
+	regs[1] = (unsigned)info[1];
+	regs[2] = (unsigned)info[2];
+	regs[3] = (unsigned)info[3];
+#else
+	__cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+//AVX2 needs the OS to save the YMM registers (XCR0 bits 1 and 2), not only the processor.
+static int clean_ymm_enabled(void)
+{
+#ifdef _MSC_VER
+	return (_xgetbv(0) & 6) == 6;
+#else
+	unsigned eax, edx;
+	__asm__ ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	(void)edx;
+	return (eax & 6) == 6;
+#endif
+}
+#endif
+
+//Pick the kernels for this processor, before any worker runs.
+void clean_transparent_init(void)
+{
+#if CLEAN_SIMD
+	unsigned regs[4];
+	unsigned max_leaf;
+	clean_cpuid(0, regs);
+	max_leaf = regs[0];
+	if(max_leaf < 1) return;
+	clean_cpuid(1, regs);
+	if(!(regs[3] & (1u << 26))) return; /*no SSE2, 32 bit processors only*/
+	clean_zero_simd = clean_zero_sse2;
+	clean_up_simd = clean_up_sse2;
+	//OSXSAVE and AVX, then AVX2 in leaf 7.
+	if((regs[2] & (1u << 27)) && (regs[2] & (1u << 28)) && clean_ymm_enabled() && max_leaf >= 7)
+	{
+		clean_cpuid(7, regs);
+		if(regs[1] & (1u << 5))
+		{
+			clean_zero_simd = clean_zero_avx2;
+			clean_up_simd = clean_up_avx2;
+		}
+	}
+#endif
+}
+
+//Zero the RGB of every pixel with alpha 0 in 8 or 16 bit RGBA, returns whether anything changed.
+int clean_transparent_zero(unsigned char* data, size_t numpixels, unsigned bitdepth)
+{
+	size_t i = 0;
+	size_t bytes = numpixels * (bitdepth == 8 ? 4 : 8);
+	unsigned changed = 0;
+	if(clean_zero_simd) i = clean_zero_simd(data, bytes, bitdepth, &changed);
+	if(bitdepth == 8)
+	{
+		for(; i < bytes; i += 4)
+		{
+			unsigned char* p = data + i;
+			unsigned char keep = (unsigned char)(0u - (p[3] != 0));
+			changed |= (p[0] | p[1] | p[2]) & (unsigned char)~keep;
+			p[0] &= keep;
+			p[1] &= keep;
+			p[2] &= keep;
+		}
+	}
+	else
+	{
+		for(; i < bytes; i += 8)
+		{
+			unsigned char* p = data + i;
+			unsigned char keep = (unsigned char)(0u - ((p[6] | p[7]) != 0));
+			changed |= (p[0] | p[1] | p[2] | p[3] | p[4] | p[5]) & (unsigned char)~keep;
+			p[0] &= keep;
+			p[1] &= keep;
+			p[2] &= keep;
+			p[3] &= keep;
+			p[4] &= keep;
+			p[5] &= keep;
+		}
+	}
+	return changed != 0;
+}
+
+//Give every pixel with alpha 0 the RGB of the pixel above it, 8 or 16 bit RGBA rows.
+void clean_transparent_up(png_bytepp rows, int width, int height, unsigned bitdepth)
+{
+	int y;
+	size_t i;
+	size_t rowbytes = (size_t)width * (bitdepth == 8 ? 4 : 8);
+	for(y = 1; y < height; y++)
+	{
+		unsigned char* row = rows[y];
+		const unsigned char* above = rows[y - 1];
+		i = clean_up_simd ? clean_up_simd(row, above, rowbytes, bitdepth) : 0;
+		if(bitdepth == 8)
+		{
+			for(; i < rowbytes; i += 4)
+			{
+				unsigned char keep = (unsigned char)(0u - (row[i + 3] != 0));
+				row[i] = (row[i] & keep) | (above[i] & (unsigned char)~keep);
+				row[i + 1] = (row[i + 1] & keep) | (above[i + 1] & (unsigned char)~keep);
+				row[i + 2] = (row[i + 2] & keep) | (above[i + 2] & (unsigned char)~keep);
+			}
+		}
+		else
+		{
+			for(; i < rowbytes; i += 8)
+			{
+				unsigned char keep = (unsigned char)(0u - ((row[i + 6] | row[i + 7]) != 0));
+				int c;
+				for(c = 0; c < 6; c++) row[i + c] = (row[i + c] & keep) | (above[i + c] & (unsigned char)~keep);
+			}
+		}
+	}
+}
+//************************************Clean transparent (End)*********************************************
+
+//************************************Manifest (Start)****************************************************
+/*
+Remembers every tile that was optimized, keyed by path: its size and mtime right after
+we were done with it, the hash of its pixels and the color mode it ended up in. On the
+next run a tile whose size and mtime still match is skipped after the stat of the
+directory walk, without being opened.
+
+The file is a header followed by records and is memory mapped read-only when opened.
+Workers append new records under the lock, a later record for the same path replaces
+an earlier one. A torn record at the end (crash while appending) is ignored. On close
+the file is compacted to one record per path.
+*/
+#define MANIFEST_MAGIC "PNGMANI1"
+
+typedef struct _manifest_record manifest_record;
+struct _manifest_record
+{
+	unsigned record_size; /*header, path and padding to 8 bytes*/
+	unsigned path_size;
+	long long size;
+	long long mtime;
+	unsigned long long h1; /*tile_key hash of the pixels*/
+	unsigned long long h2;
+	int colortype;
+	int bitdepth;
+	/*path follows, not 0 terminated*/
+};
+
+//A whole file mapped read only.
+typedef struct _mapped_file mapped_file;
+struct _mapped_file
+{
+	unsigned char* map;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+typedef struct _tile_manifest tile_manifest;
+struct _tile_manifest
+{
+	char* path;
+	engine_mutex lock; /*guards append*/
+	FILE* append;
+
+	mapped_file mapped; /*the file as it was at open*/
+
+	const unsigned char** slots; /*open addressing index into map, by path*/
+	size_t num_slots;
+	size_t valid_end; /*end of the last whole record in map*/
+};
+
+static int rename_file(const char* from, const char* to)
+{
+#ifdef _WIN32
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+	return rename(from, to);
+#endif
+}
+
+//Modification time as the manifest stores it, with nanoseconds where stat has them.
+static long long manifest_mtime(const struct stat* st)
+{
+#ifdef __linux__
+	return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#else
+	return (long long)st->st_mtime;
+#endif
+}
+
+static unsigned long long manifest_hash(const char* path, size_t size)
+{
+	unsigned long long hash = 14695981039346656037ULL; /*FNV-1a*/
+	size_t i;
+	for(i = 0; i < size; i++)
+	{
+		hash ^= (unsigned char)path[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static void mapped_file_init(mapped_file* mapped)
+{
+	mapped->map = NULL;
+	mapped->size = 0;
+#ifdef _WIN32
+	mapped->file = INVALID_HANDLE_VALUE;
+	mapped->mapping = NULL;
+#endif
+}
+
+static void unmap_file(mapped_file* mapped)
+{
+#ifdef _WIN32
+	if(mapped->map) UnmapViewOfFile(mapped->map);
+	if(mapped->mapping) CloseHandle(mapped->mapping);
+	if(mapped->file != INVALID_HANDLE_VALUE) CloseHandle(mapped->file);
+#else
+	if(mapped->map) munmap(mapped->map, mapped->size);
+#endif
+	mapped_file_init(mapped);
+}
+
+//Map all of path. A missing or empty file is no error, map stays NULL then.
+static int map_file(mapped_file* mapped, const char* path)
+{
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	mapped->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if(mapped->file == INVALID_HANDLE_VALUE) return 0;
+	if(!GetFileSizeEx(mapped->file, &size) || size.QuadPart == 0) return 0;
+	mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(!mapped->mapping) return -1;
+	mapped->map = (unsigned char*)MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+	if(!mapped->map) return -1;
+	mapped->size = (size_t)size.QuadPart;
+#else
+	struct stat st;
+	void* map;
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return 0;
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return -1;
+	mapped->map = (unsigned char*)map;
+	mapped->size = (size_t)st.st_size;
+#endif
+	return 0;
+}
+
+static void manifest_unmap(tile_manifest* manifest)
+{
+	free(manifest->slots);
+	manifest->slots = NULL;
+	manifest->num_slots = 0;
+	unmap_file(&manifest->mapped);
+}
+
+static int manifest_map(tile_manifest* manifest)
+{
+	return map_file(&manifest->mapped, manifest->path);
+}
+
+//Cut path to size bytes, the file must not be mapped on Windows.
+static int truncate_file(const char* path, long long size)
+{
+#ifdef _WIN32
+	LARGE_INTEGER end;
+	int ok;
+	HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if(file == INVALID_HANDLE_VALUE) return -1;
+	end.QuadPart = size;
+	ok = SetFilePointerEx(file, end, NULL, FILE_BEGIN) && SetEndOfFile(file);
+	CloseHandle(file);
+	return ok ? 0 : -1;
+#else
+	return truncate(path, (off_t)size);
+#endif
+}
+
+//The record at offset, or NULL at the end of the map or at a torn record.
+static const unsigned char* manifest_record_at(const tile_manifest* manifest, size_t offset, manifest_record* record)
+{
+	if(manifest->mapped.size - offset < sizeof(manifest_record)) return NULL;
+	memcpy(record, manifest->mapped.map + offset, sizeof(manifest_record));
+	if(record->record_size < sizeof(manifest_record) + record->path_size || record->record_size > manifest->mapped.size - offset) return NULL;
+	return manifest->mapped.map + offset;
+}
+
+static const unsigned char** manifest_slot(const tile_manifest* manifest, const char* path, size_t path_size)
+{
+	size_t i = (size_t)manifest_hash(path, path_size) & (manifest->num_slots - 1);
+	while(manifest->slots[i])
+	{
+		manifest_record record;
+		memcpy(&record, manifest->slots[i], sizeof(record));
+		if(record.path_size == path_size && memcmp(manifest->slots[i] + sizeof(record), path, path_size) == 0) break;
+		i = (i + 1) & (manifest->num_slots - 1);
+	}
+	return &manifest->slots[i];
+}
+
+//Index the mapped records by path, the last record of a path wins.
+static int manifest_index(tile_manifest* manifest)
+{
+	manifest_record record;
+	const unsigned char* p;
+	size_t offset, count = 0;
+
+	if(manifest->mapped.size < 8 || memcmp(manifest->mapped.map, MANIFEST_MAGIC, 8) != 0) return 0; /*no or unknown manifest, start over*/
+	for(offset = 8; (p = manifest_record_at(manifest, offset, &record)) != NULL; offset += record.record_size) count++;
+	manifest->valid_end = offset;
+
+	manifest->num_slots = 16;
+	while(manifest->num_slots < count * 2) manifest->num_slots *= 2;
+	manifest->slots = (const unsigned char**)calloc(manifest->num_slots, sizeof(unsigned char*));
+	if(!manifest->slots) return -1;
+
+	for(offset = 8; (p = manifest_record_at(manifest, offset, &record)) != NULL; offset += record.record_size)
+	{
+		*manifest_slot(manifest, (const char*)p + sizeof(record), record.path_size) = p;
+	}
+	return 0;
+}
+
+int manifest_open(tile_manifest* manifest, const char* path)
+{
+	long end;
+	memset(manifest, 0, sizeof(*manifest));
+	mapped_file_init(&manifest->mapped);
+	manifest->path = (char*)malloc(strlen(path) + 1);
+	if(!manifest->path) return -1;
+	strcpy(manifest->path, path);
+
+	if(manifest_map(manifest) != 0 || manifest_index(manifest) != 0)
+	{
+		manifest_unmap(manifest);
+		free(manifest->path);
+		return -1;
+	}
+
+	//A run that died mid append leaves a torn record. Cut it off, or the records appended
+	//after it could never be read back and compaction would drop them.
+	if(manifest->slots && manifest->valid_end < manifest->mapped.size)
+	{
+		long long valid_end = (long long)manifest->valid_end;
+		printf("[manifest] %s ends in a torn record, dropping %lld bytes\n", path, (long long)manifest->mapped.size - valid_end);
+		manifest_unmap(manifest);
+		if(truncate_file(path, valid_end) != 0 || manifest_map(manifest) != 0 || manifest_index(manifest) != 0)
+		{
+			manifest_unmap(manifest);
+			free(manifest->path);
+			return -1;
+		}
+	}
+
+	//Only a missing or empty file starts a new manifest, anything else at path is not ours to overwrite.
+	if(!manifest->slots && manifest->mapped.size > 0)
+	{
+		printf("[manifest] %s is not a manifest, refusing to overwrite it\n", path);
+		manifest_unmap(manifest);
+		free(manifest->path);
+		return -1;
+	}
+	manifest->append = fopen(path, "ab");
+	if(!manifest->append)
+	{
+		manifest_unmap(manifest);
+		free(manifest->path);
+		return -1;
+	}
+	fseek(manifest->append, 0, SEEK_END);
+	end = ftell(manifest->append);
+	if(end == 0) fwrite(MANIFEST_MAGIC, 1, 8, manifest->append);
+	engine_mutex_init(&manifest->lock);
+	return 0;
+}
+
+//Whether file_path was optimized before and has not changed since.
+int manifest_unchanged(const tile_manifest* manifest, const char* file_path, long long size, long long mtime)
+{
+	manifest_record record;
+	const unsigned char* p;
+	if(!manifest->slots) return 0;
+	p = *manifest_slot(manifest, file_path, strlen(file_path));
+	if(!p) return 0;
+	memcpy(&record, p, sizeof(record));
+	return record.size == size && record.mtime == mtime;
+}
+
+//Remember file_path as it is on disk now, after it was optimized. Called by the workers.
+void manifest_add(tile_manifest* manifest, const char* file_path, const tile_key* key, int colortype, int bitdepth)
+{
+	static const unsigned char padding[8] = {0};
+	manifest_record record;
+	struct stat st;
+	size_t path_size = strlen(file_path);
+	if(stat(file_path, &st) != 0) return;
+
+	record.path_size = (unsigned)path_size;
+	record.record_size = (unsigned)((sizeof(record) + path_size + 7) & ~(size_t)7);
+	record.size = (long long)st.st_size;
+	record.mtime = manifest_mtime(&st);
+	record.h1 = key->h1;
+	record.h2 = key->h2;
+	record.colortype = colortype;
+	record.bitdepth = bitdepth;
+
+	engine_mutex_lock(&manifest->lock);
+	fwrite(&record, 1, sizeof(record), manifest->append);
+	fwrite(file_path, 1, path_size, manifest->append);
+	fwrite(padding, 1, record.record_size - sizeof(record) - path_size, manifest->append);
+	fflush(manifest->append);
+	engine_mutex_unlock(&manifest->lock);
+}
+
+//Rewrite the manifest with only the latest record of every path, then release it.
+void manifest_close(tile_manifest* manifest)
+{
+	FILE* out;
+	size_t i;
+	char* tmp = (char*)malloc(strlen(manifest->path) + 5);
+
+	fclose(manifest->append);
+	engine_mutex_destroy(&manifest->lock);
+	manifest_unmap(manifest);
+
+	if(tmp && manifest_map(manifest) == 0 && manifest_index(manifest) == 0 && manifest->slots)
+	{
+		strcpy(tmp, manifest->path);
+		strcat(tmp, ".tmp");
+		out = fopen(tmp, "wb");
+		if(out)
+		{
+			int ok = fwrite(MANIFEST_MAGIC, 1, 8, out) == 8;
+			for(i = 0; i < manifest->num_slots && ok; i++)
+			{
+				manifest_record record;
+				if(!manifest->slots[i]) continue;
+				memcpy(&record, manifest->slots[i], sizeof(record));
+				ok = fwrite(manifest->slots[i], 1, record.record_size, out) == record.record_size;
+			}
+			ok = fclose(out) == 0 && ok;
+			manifest_unmap(manifest); /*Windows can not replace a mapped file*/
+			if(!ok || rename_file(tmp, manifest->path) != 0) remove(tmp);
+		}
+	}
+	manifest_unmap(manifest);
+	free(tmp);
+	free(manifest->path);
+	manifest->path = NULL;
+}
+//************************************Manifest (End)******************************************************
+
+//************************************Tile archive (Start)************************************************
+/*
+Output mode -a archive: instead of one file per tile, every tile ends up in a single
+file, its bytes appended as they are committed. Closing the archive adds an index
+sorted by path hash, so a reader maps the file and finds a tile by binary search
+without reading or copying anything (-x copies one tile back out). Tiles with the same bytes (cache hits, uniform
+tiles) are stored once, their index entries point at the same blob. Tile paths are kept
+relative to the converted folder with '/' separators, pyramid tiles as "z/x/y.png".
+
+	archive_header | blobs, 8 byte aligned | archive_entry[count] | paths
+*/
+#define ARCHIVE_MAGIC "PNGPACK1"
+#define ARCHIVE_BLOB_BUCKETS 65536
+#define ARCHIVE_COPY_SIZE (1 << 20) /*files bigger than this (streamed images) are copied in pieces, not deduplicated*/
+
+typedef struct _archive_header archive_header;
+struct _archive_header
+{
+	char magic[8];
+	unsigned long long count; /*index entries*/
+	unsigned long long index_offset;
+	unsigned long long paths_offset;
+};
+
+typedef struct _archive_entry archive_entry;
+struct _archive_entry
+{
+	unsigned long long hash; /*manifest_hash of the path*/
+	unsigned long long offset; /*of the blob*/
+	unsigned long long size;
+	unsigned long long path_offset; /*from paths_offset, not 0 terminated*/
+	unsigned long long path_size;
+};
+
+//A blob already in the archive, by a tile_key over its bytes.
+typedef struct _archive_blob archive_blob;
+struct _archive_blob
+{
+	tile_key key;
+	unsigned long long offset;
+	archive_blob* next;
+};
+
+typedef struct _tile_archive tile_archive;
+struct _tile_archive
+{
+	char* path;
+	char* tmp; /*written here, renamed to path when closed*/
+	FILE* file;
+	engine_mutex lock; /*guards everything below*/
+	unsigned long long end; /*where the next blob goes*/
+	size_t root_size; /*prefix of the tile paths that is not stored*/
+
+	archive_entry* entries;
+	size_t count;
+	size_t capacity;
+	char* paths;
+	size_t paths_size;
+	size_t paths_capacity;
+
+	archive_blob** blobs;
+	size_t num_blobs;
+	int failed; /*a write went wrong, the archive is dropped on close*/
+};
+
+//Read side, the index and blobs are used in place.
+typedef struct _tile_archive_reader tile_archive_reader;
+struct _tile_archive_reader
+{
+	mapped_file mapped;
+	const archive_entry* entries;
+	size_t count;
+	const char* paths;
+};
+
+int tile_archive_create(tile_archive* archive, const char* path, const char* root)
+{
+	archive_header header;
+	memset(archive, 0, sizeof(*archive));
+	archive->path = (char*)malloc(strlen(path) + 1);
+	archive->tmp = (char*)malloc(strlen(path) + 5);
+	archive->blobs = (archive_blob**)calloc(ARCHIVE_BLOB_BUCKETS, sizeof(archive_blob*));
+	if(!archive->path || !archive->tmp || !archive->blobs) return -1;
+	strcpy(archive->path, path);
+	strcpy(archive->tmp, path);
+	strcat(archive->tmp, ".tmp");
+	archive->root_size = strlen(root);
+
+	archive->file = fopen(archive->tmp, "wb");
+	if(!archive->file) return -1;
+	memset(&header, 0, sizeof(header)); /*written for real on close*/
+	if(fwrite(&header, sizeof(header), 1, archive->file) != 1) return -1;
+	archive->end = sizeof(header);
+	engine_mutex_init(&archive->lock);
+	return 0;
+}
+
+static int archive_grow(void** data, size_t* capacity, size_t needed, size_t unit)
+{
+	size_t grown = *capacity ? *capacity : 1024;
+	void* p;
+	if(needed <= *capacity) return 0;
+	while(grown < needed) grown *= 2;
+	p = realloc(*data, grown * unit);
+	if(!p) return -1;
+	*data = p;
+	*capacity = grown;
+	return 0;
+}
+
+//Index path under the archive lock for the blob at offset.
+static int archive_add_entry(tile_archive* archive, const char* file_path, unsigned long long offset, unsigned long long size)
+{
+	archive_entry* entry;
+	const char* name = file_path;
+	size_t name_size, i;
+
+	if(strlen(file_path) > archive->root_size) name += archive->root_size;
+	while(*name == '/' || *name == '\\') name++;
+	name_size = strlen(name);
+
+	if(archive_grow((void**)&archive->entries, &archive->capacity, archive->count + 1, sizeof(archive_entry)) != 0
+		|| archive_grow((void**)&archive->paths, &archive->paths_capacity, archive->paths_size + name_size, 1) != 0)
+	{
+		return -1;
+	}
+	entry = &archive->entries[archive->count++];
+	entry->offset = offset;
+	entry->size = size;
+	entry->path_offset = archive->paths_size;
+	entry->path_size = name_size;
+	for(i = 0; i < name_size; i++) archive->paths[archive->paths_size + i] = name[i] == '\\' ? '/' : name[i];
+	entry->hash = manifest_hash(archive->paths + archive->paths_size, name_size);
+	archive->paths_size += name_size;
+	return 0;
+}
+
+//Pad the archive to the next 8 bytes after a blob of size bytes.
+static int archive_pad(tile_archive* archive, unsigned long long size)
+{
+	static const unsigned char padding[8] = {0};
+	size_t pad = (size_t)((8 - size % 8) % 8);
+	if(fwrite(padding, 1, pad, archive->file) != pad) return -1;
+	archive->end += size + pad;
+	return 0;
+}
+
+//Store data as the tile at file_path. Safe to call from every worker.
+int tile_archive_add(tile_archive* archive, const char* file_path, const unsigned char* data, size_t size)
+{
+	LodePNGColorMode blob_mode;
+	archive_blob* blob;
+	tile_key key;
+	size_t bucket;
+	int result;
+
+	//The bytes hashed as one row, so equal blobs of any size get different keys.
+	lodepng_color_mode_init(&blob_mode);
+	tile_key_init(&key, data, size, (int)size, 1, &blob_mode);
+	bucket = (size_t)(key.h1 & (ARCHIVE_BLOB_BUCKETS - 1));
+
+	engine_mutex_lock(&archive->lock);
+	for(blob = archive->blobs[bucket]; blob; blob = blob->next)
+	{
+		if(memcmp(&blob->key, &key, sizeof(key)) == 0) break;
+	}
+	if(!blob)
+	{
+		blob = (archive_blob*)malloc(sizeof(archive_blob));
+		if(!blob || fwrite(data, 1, size, archive->file) != size)
+		{
+			archive->failed = 1;
+			free(blob);
+			engine_mutex_unlock(&archive->lock);
+			return -1;
+		}
+		blob->key = key;
+		blob->offset = archive->end;
+		blob->next = archive->blobs[bucket];
+		archive->blobs[bucket] = blob;
+		archive->num_blobs++;
+		if(archive_pad(archive, size) != 0)
+		{
+			archive->failed = 1;
+			engine_mutex_unlock(&archive->lock);
+			return -1;
+		}
+	}
+	result = archive_add_entry(archive, file_path, blob->offset, size);
+	engine_mutex_unlock(&archive->lock);
+	return result;
+}
+
+//Store the file at source_path, as it is on disk, as the tile at file_path.
+int tile_archive_add_file(tile_archive* archive, const char* file_path, const char* source_path)
+{
+	unsigned char* data;
+	long size = lodepng_filesize(source_path);
+	unsigned long long offset;
+	size_t done = 0;
+	FILE* fp;
+	int result = -1;
+	if(size < 0) return -1;
+	data = (unsigned char*)malloc(size > ARCHIVE_COPY_SIZE ? ARCHIVE_COPY_SIZE : (size ? (size_t)size : 1));
+	fp = fopen(source_path, "rb");
+	if(!data || !fp)
+	{
+		if(fp) fclose(fp);
+		free(data);
+		return -1;
+	}
+
+	if(size <= ARCHIVE_COPY_SIZE)
+	{
+		if(fread(data, 1, (size_t)size, fp) == (size_t)size) result = tile_archive_add(archive, file_path, data, (size_t)size);
+	}
+	else
+	{
+		//Big files hold the lock while they are copied, their pieces have to stay together.
+		engine_mutex_lock(&archive->lock);
+		offset = archive->end;
+		while(done < (size_t)size)
+		{
+			size_t piece = fread(data, 1, ARCHIVE_COPY_SIZE, fp);
+			if(piece == 0 || fwrite(data, 1, piece, archive->file) != piece) break;
+			done += piece;
+		}
+		if(done == (size_t)size && archive_pad(archive, done) == 0)
+		{
+			archive->num_blobs++;
+			result = archive_add_entry(archive, file_path, offset, done);
+		}
+		else
+		{
+			archive->failed = 1;
+		}
+		engine_mutex_unlock(&archive->lock);
+	}
+	fclose(fp);
+	free(data);
+	return result;
+}
+
+static const char* archive_sort_paths; /*qsort has no context argument, tile_archive_close is single threaded*/
+
+static int archive_entry_compare(const void* a, const void* b)
+{
+	const archive_entry* x = (const archive_entry*)a;
+	const archive_entry* y = (const archive_entry*)b;
+	size_t size = x->path_size < y->path_size ? (size_t)x->path_size : (size_t)y->path_size;
+	int order;
+	if(x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+	order = memcmp(archive_sort_paths + x->path_offset, archive_sort_paths + y->path_offset, size);
+	if(order) return order;
+	return x->path_size < y->path_size ? -1 : (x->path_size > y->path_size ? 1 : 0);
+}
+
+//Write the index and the header and put the archive in place. The writer is released either way.
+int tile_archive_close(tile_archive* archive)
+{
+	archive_header header;
+	size_t i;
+	int ok = archive->file != NULL;
+	if(ok && archive->failed)
+	{
+		fclose(archive->file);
+		remove(archive->tmp);
+		engine_mutex_destroy(&archive->lock);
+		ok = 0;
+	}
+
+	else if(ok)
+	{
+		archive_sort_paths = archive->paths;
+		if(archive->count) qsort(archive->entries, archive->count, sizeof(archive_entry), archive_entry_compare);
+
+		memcpy(header.magic, ARCHIVE_MAGIC, 8);
+		header.count = archive->count;
+		header.index_offset = archive->end;
+		header.paths_offset = archive->end + archive->count * sizeof(archive_entry);
+		ok = fwrite(archive->entries, sizeof(archive_entry), archive->count, archive->file) == archive->count
+			&& fwrite(archive->paths, 1, archive->paths_size, archive->file) == archive->paths_size
+			&& fseek(archive->file, 0, SEEK_SET) == 0
+			&& fwrite(&header, sizeof(header), 1, archive->file) == 1;
+		ok = fclose(archive->file) == 0 && ok;
+		ok = ok && rename_file(archive->tmp, archive->path) == 0;
+		if(!ok) remove(archive->tmp);
+		engine_mutex_destroy(&archive->lock);
+	}
+
+	for(i = 0; archive->blobs && i < ARCHIVE_BLOB_BUCKETS; i++)
+	{
+		while(archive->blobs[i])
+		{
+			archive_blob* next = archive->blobs[i]->next;
+			free(archive->blobs[i]);
+			archive->blobs[i] = next;
+		}
+	}
+	free(archive->blobs);
+	free(archive->entries);
+	free(archive->paths);
+	free(archive->path);
+	free(archive->tmp);
+	archive->file = NULL;
+	return ok ? 0 : -1;
+}
+
+int tile_archive_open(tile_archive_reader* reader, const char* path)
+{
+	archive_header header;
+	mapped_file_init(&reader->mapped);
+	reader->entries = NULL;
+	reader->count = 0;
+	reader->paths = NULL;
+	if(map_file(&reader->mapped, path) != 0 || reader->mapped.size < sizeof(header)) goto fail;
+
+	memcpy(&header, reader->mapped.map, sizeof(header));
+	if(memcmp(header.magic, ARCHIVE_MAGIC, 8) != 0 || header.index_offset % 8 != 0
+		|| header.index_offset > reader->mapped.size
+		|| header.count > (reader->mapped.size - header.index_offset) / sizeof(archive_entry)
+		|| header.paths_offset != header.index_offset + header.count * sizeof(archive_entry))
+	{
+		goto fail;
+	}
+	reader->entries = (const archive_entry*)(reader->mapped.map + header.index_offset);
+	reader->count = (size_t)header.count;
+	reader->paths = (const char*)reader->mapped.map + header.paths_offset;
+	return 0;
+
+fail:
+	unmap_file(&reader->mapped);
+	return -1;
+}
+
+//The tile stored for path (relative, '/' separated) inside the mapping, or NULL.
+const unsigned char* tile_archive_find(const tile_archive_reader* reader, const char* path, size_t* size)
+{
+	size_t path_size = strlen(path);
+	unsigned long long hash = manifest_hash(path, path_size);
+	size_t low = 0, high = reader->count;
+	const size_t paths_size = reader->mapped.size - (size_t)((const unsigned char*)reader->paths - reader->mapped.map);
+
+	while(low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+		if(reader->entries[mid].hash < hash) low = mid + 1;
+		else high = mid;
+	}
+	for(; low < reader->count && reader->entries[low].hash == hash; low++)
+	{
+		const archive_entry* entry = &reader->entries[low];
+		if(entry->path_size != path_size || entry->path_offset + path_size > paths_size) continue;
+		if(memcmp(reader->paths + entry->path_offset, path, path_size) != 0) continue;
+		if(entry->offset > reader->mapped.size || entry->size > reader->mapped.size - entry->offset) return NULL;
+		*size = (size_t)entry->size;
+		return reader->mapped.map + entry->offset;
+	}
+	return NULL;
+}
+
+//The pyramid tile z/x/y, see tile_archive_find.
+const unsigned char* tile_archive_find_tile(const tile_archive_reader* reader, int z, int x, int y, size_t* size)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "%d/%d/%d.png", z, x, y);
+	return tile_archive_find(reader, path, size);
+}
+
+void tile_archive_close_reader(tile_archive_reader* reader)
+{
+	unmap_file(&reader->mapped);
+	reader->entries = NULL;
+	reader->count = 0;
+}
+
+/*
+Option -x archive tile out.png: copy one tile out of an archive, tile is its path as
+stored ("a/b.png") or a pyramid tile as z/x/y. Returns 0 if it was found and written.
+*/
+int tile_archive_extract(const char* archive_path, const char* tile, const char* out_path)
+{
+	tile_archive_reader reader;
+	const unsigned char* data;
+	size_t size = 0;
+	int z, x, y, end = 0;
+	int ok;
+	FILE* out;
+
+	if(tile_archive_open(&reader, archive_path) != 0)
+	{
+		printf("%s is no tile archive\n", archive_path);
+		return -1;
+	}
+	if(sscanf(tile, "%d/%d/%d%n", &z, &x, &y, &end) == 3 && tile[end] == 0)
+		data = tile_archive_find_tile(&reader, z, x, y, &size);
+	else
+		data = tile_archive_find(&reader, tile, &size);
+	if(!data)
+	{
+		printf("%s is not in %s\n", tile, archive_path);
+		tile_archive_close_reader(&reader);
+		return -1;
+	}
+	out = fopen(out_path, "wb");
+	ok = out && fwrite(data, 1, size, out) == size;
+	if(out) ok = fclose(out) == 0 && ok;
+	if(!ok) printf("could not write %s\n", out_path);
+	else printf("%s: %lld bytes of %lld tiles\n", tile, (long long)size, (long long)reader.count);
+	tile_archive_close_reader(&reader);
+	return ok ? 0 : -1;
+}
+//************************************Tile archive (End)**************************************************
+
+//One tile to convert: a file on disk, or with pixels a tile cut by the pyramid to be written to path.
+typedef struct _tile_job tile_job;
+struct _tile_job
+{
+	unsigned char* pixels; /*RGBA 8, contiguous rows, in the same allocation; NULL for a file*/
+	int width;
+	int height;
+	char path[1]; /*allocated to its length*/
+};
+
+/*
+Double ended queue of tile jobs owned by one worker. The owner pushes and pops
+at the bottom (newest first, the directory it is working on is still in cache),
+other workers steal from the top (oldest first).
+*/
+typedef struct _job_deque job_deque;
+struct _job_deque
+{
+	engine_mutex lock;
+	tile_job** jobs; /*ring buffer of malloc'd jobs*/
+	size_t capacity;
+	size_t top; /*index of the oldest job*/
+	size_t count;
+};
+
+typedef struct _convert_engine convert_engine;
+typedef struct _convert_worker convert_worker;
+
+//Everything one thread needs to convert tiles, nothing in here is shared.
+struct _convert_worker
+{
+	convert_engine* engine;
+	int id;
+	engine_thread thread;
+	job_deque deque;
+
+	pngexportinfo info; /*per-thread counters, merged into the global info at the end*/
+
+	tile_arena arena; /*backs all memory of the tile being converted, except the kept libpng structs*/
+	liq_attr* liq; /*imagequant settings, created once and reused for every tile*/
+
+	tile_key key; /*of the tile being converted*/
+	tile_output output; /*encoded tile, from encode_png or a cache hit*/
+	unsigned char* encoded; /*encode_png's output buffer, reused for every tile*/
+	size_t encoded_capacity;
+	unsigned char* best; /*smallest trial so far while searching, swapped with encoded*/
+	size_t best_capacity;
+
+	long long tile_ns[PHASE_COUNT]; /*time per phase for the current tile, -1 if the phase did not run*/
+	int archived; /*the current tile is in the archive*/
+
+	unsigned char uniform_color[4]; /*of a uniform tile, RGBA*/
+	uniform_template* templates; /*encoded uniform tiles, per tile size*/
+
+	LodePNGColorMode mode_in; /*scratch color modes reused for every tile*/
+	LodePNGColorMode mode_out;
+	auto_pic_data pic_data;
+
+	png_structp read_ptr;
+	png_infop read_info_ptr;
+	png_structp write_ptr;
+	png_infop write_info_ptr;
+};
+
+struct _convert_engine
+{
+	convert_worker* workers;
+	int num_workers;
+	int next_worker; /*round robin target for newly discovered tiles*/
+	tile_cache* cache; /*shared by all workers*/
+	tile_manifest* manifest; /*NULL if not used*/
+	int clean; /*CLEAN_* for RGB under transparent pixels*/
+	long long search_ns; /*per tile budget of the compression search, 0 if not searching*/
+	size_t band_bytes; /*decoded images bigger than this are streamed in bands of this size, 0 never*/
+	tile_archive* archive; /*tiles go here instead of to files, NULL for loose files*/
+	FILE* results; /*service mode: one line per tile, written under lock*/
+	size_t reported; /*tiles written to results*/
+	long long skipped; /*tiles the manifest found unchanged, counted by the directory walk*/
+	long long failed; /*jobs that could not be queued, under lock*/
+	phase_stats scan; /*timed by the directory walk*/
+
+	engine_mutex lock; /*guards pending and done*/
+	engine_cond wake;
+	engine_cond room; /*pending dropped below max_pending*/
+	engine_cond idle; /*nothing pending and nothing active*/
+	size_t pending; /*jobs pushed to a deque and not taken yet*/
+	size_t active; /*jobs taken and still being converted*/
+	size_t max_pending; /*engine_submit_tile waits above this, cut tiles carry their pixels*/
+	int done; /*directory discovery finished*/
+};
+
+//Add ns to the time the current tile spent in phase, samples are taken when the tile is done.
+static void tile_phase(convert_worker* worker, int phase, long long ns)
+{
+	if(worker->tile_ns[phase] < 0) worker->tile_ns[phase] = 0;
+	worker->tile_ns[phase] += ns;
+}
+
+//imagequant pulls RGB tiles through here a row at a time, so no RGBA copy of the tile is made.
+static void rgb_rows_to_rgba_callback(liq_color row_out[], int row, int width, void* user_info)
+{
+	int i;
+	png_bytep rgb_row = ((png_bytepp)user_info)[row];
+
+	for(i = 0; i < width; i++)
+	{
+		row_out[i].r = rgb_row[i*3];
+		row_out[i].g = rgb_row[i*3+1];
+		row_out[i].b = rgb_row[i*3+2];
+		row_out[i].a = 255;
+	}
+}
+
+/*
+Tile with more than 256 colors: let imagequant pick an 8 bit palette for it. libpng's
+rows are handed over as they are, RGBA directly and RGB through the row callback. If
+the quality gate passes, the remapped indices replace the rows in pic_data and mode_in
+becomes the palette mode too, so SetIDAT writes them without another conversion.
+Otherwise nothing is changed and the tile stays RGB/RGBA. Returns a QUANT_* value.
+*/
+static int quantize_png(convert_worker* worker, LodePNGColorMode* mode_in, LodePNGColorMode* mode_out, auto_pic_data* pic_data)
+{
+	int i;
+	int result = QUANT_DONE;
+	int w = pic_data->width;
+	int h = pic_data->height;
+	liq_image* image;
+	liq_result* quant = NULL;
+	liq_error error;
+	const liq_palette* palette;
+	png_bytepp index_rows = NULL;
+	LodePNGColorMode quant_mode;
+
+	if(!worker->liq || mode_in->bitdepth != 8 || mode_out->bitdepth != 8) return QUANT_SKIPPED;
+
+	if(mode_in->colortype == LCT_RGBA)
+	{
+		image = liq_image_create_rgba_rows(worker->liq, (void**)pic_data->row_pointers, w, h, 0);
+	}
+	else
+	{
+		image = liq_image_create_custom(worker->liq, rgb_rows_to_rgba_callback, pic_data->row_pointers, w, h, 0);
+	}
+	if(!image) return QUANT_SKIPPED;
+
+	lodepng_color_mode_init(&quant_mode);
+	quant_mode.colortype = LCT_PALETTE;
+	quant_mode.bitdepth = 8;
+
+	error = liq_image_quantize(image, worker->liq, &quant);
+	if(error == LIQ_QUALITY_TOO_LOW || (error == LIQ_OK && liq_get_quantization_quality(quant) < QUANT_QUALITY_MIN))
+	{
+		result = QUANT_REJECTED;
+	}
+	else if(error != LIQ_OK)
+	{
+		result = QUANT_SKIPPED;
+	}
+
+	if(result == QUANT_DONE)
+	{
+		liq_set_dithering_level(quant, 1.0);
+		index_rows = malloc_png_bytepp(&quant_mode, w, h);
+		if(!index_rows || liq_write_remapped_image_rows(quant, image, index_rows) != LIQ_OK) result = QUANT_SKIPPED;
+	}
+
+	if(result == QUANT_DONE)
+	{
+		//The palette is final only after remapping. Translucent entries go first, like lodepng_auto_choose_color
+		//does it, so the indices are renumbered if imagequant mixed them.
+		unsigned char order[256];
+		int opaque, sorted = 1;
+		palette = liq_get_palette(quant);
+		for(opaque = 0; opaque != 2 && result == QUANT_DONE; opaque++)
+		{
+			for(i = 0; i < (int)palette->count; i++)
+			{
+				const liq_color* c = &palette->entries[i];
+				if((c->a == 255) != opaque) continue;
+				if((size_t)i != quant_mode.palettesize) sorted = 0;
+				order[i] = (unsigned char)quant_mode.palettesize;
+				if(lodepng_palette_add(&quant_mode, c->r, c->g, c->b, c->a)) result = QUANT_SKIPPED;
+			}
+		}
+		if(!sorted)
+		{
+			png_bytep index = index_rows[0]; /*rows are contiguous*/
+			size_t n, size = (size_t)w * h;
+			for(n = 0; n < size; n++) index[n] = order[index[n]];
+		}
+	}
+
+	if(quant) liq_result_destroy(quant);
+	liq_image_destroy(image);
+
+	if(result == QUANT_DONE)
+	{
+		lodepng_color_mode_cleanup(mode_out);
+		lodepng_color_mode_copy(mode_out, &quant_mode);
+		lodepng_color_mode_cleanup(mode_in);
+		lodepng_color_mode_copy(mode_in, &quant_mode);
+		free_png_bytepp(pic_data->row_pointers);
+		pic_data->row_pointers = index_rows;
+	}
+	else if(index_rows)
+	{
+		free_png_bytepp(index_rows);
+	}
+	lodepng_color_mode_cleanup(&quant_mode);
+	return result;
+}
+
+/*
+Streaming, for images whose decoded rows do not fit engine->band_bytes. Instead of
+holding the image, it is read twice a band of rows at a time: profile_bands builds the
+color profile while decode_png has the file open, stream_png reads it again and
+converts and deflates row by row straight into the temp file. Peak memory is about two
+bands whatever the height. Such images are too big to repeat and imagequant needs the
+whole image, so they skip the cache, the uniform check, quantization and the search.
+*/
+#define STREAM_DEFAULT_MB 256 /*band size, and the decoded size above which images are streamed*/
+
+//Rows per band for rows of rowbytes, at least one.
+static int stream_band_rows(convert_engine* engine, size_t rowbytes)
+{
+	size_t rows = engine->band_bytes / (rowbytes ? rowbytes : 1);
+	if(rows < 1) rows = 1;
+	if(rows > INT_MAX) rows = INT_MAX;
+	return (int)rows;
+}
+
+/*
+Fold the profile of one band into the profile of the whole image. A color key is only
+valid if no opaque pixel anywhere has the key's RGB, which one band cannot tell for the
+bands around it, so a key becomes alpha here.
+*/
+static void profile_merge(LodePNGColorProfile* total, ColorTable* colors, const LodePNGColorProfile* band)
+{
+	unsigned i;
+	total->colored |= band->colored;
+	total->alpha |= band->alpha | band->key;
+	if(band->bits > total->bits) total->bits = band->bits;
+	if(total->alpha && total->bits < 8) total->bits = 8; /*PNG has no alphachannel modes with less than 8-bit per channel*/
+
+	if(band->numcolors > 256) total->numcolors = 257;
+	for(i = 0; i != band->numcolors && total->numcolors <= 256; ++i)
+	{
+		const unsigned char* p = band->palette + i * 4;
+		if(color_table_add(colors, color_table_key(p[0], p[1], p[2], p[3]), total->numcolors))
+		{
+			if(total->numcolors < 256) memcpy(total->palette + total->numcolors * 4, p, 4);
+			++total->numcolors;
+		}
+	}
+}
+
+//First pass of streaming: read all rows of the open png band by band and choose mode_out.
+//Returns whether transparent pixels were cleaned.
+static int profile_bands(convert_worker* worker, png_structp png_ptr, LodePNGColorMode* mode_in,
+	LodePNGColorMode* mode_out, int width, int height)
+{
+	LodePNGColorProfile total;
+	LodePNGColorProfile band;
+	ColorTable colors;
+	int band_rows = stream_band_rows(worker->engine, lodepng_get_raw_size(width, 1, mode_in));
+	png_bytepp rows = malloc_png_bytepp(mode_in, width, band_rows);
+	int cleaned = 0;
+	int y, n;
+
+	if(!rows) png_error(png_ptr, "Out of memory");
+	lodepng_color_profile_init(&total);
+	color_table_init(&colors);
+	for(y = 0; y < height; y += n)
+	{
+		n = height - y < band_rows ? height - y : band_rows;
+		png_read_rows(png_ptr, rows, NULL, n);
+		if(worker->engine->clean != CLEAN_NONE && mode_in->colortype == LCT_RGBA)
+		{
+			cleaned |= clean_transparent_zero(rows[0], (size_t)width * n, mode_in->bitdepth);
+		}
+		lodepng_color_profile_init(&band);
+		lodepng_get_color_profile(&band, rows[0], width, n, mode_in);
+		profile_merge(&total, &colors, &band);
+	}
+	auto_choose_color_from_profile(mode_out, mode_in, &total, (size_t)width * height);
+	return cleaned;
+}
+
+/*
+Everything between decoding and encoding a tile held in pic_data: cleaning, the cache
+key, the uniform check, the cache lookup, the color profile and imagequant. Returns 0 to
+encode, -2 if the tile is best left as it is, 3 for a uniform tile and 2 for a cache hit.
+*/
+int reduce_png(convert_worker* worker, LodePNGColorMode* mode_in, LodePNGColorMode* mode_out, auto_pic_data* pic_data)
+{
+	int width = pic_data->width;
+	int height = pic_data->height;
+	int hit = 0;
+	int cleaned = 0;
+	long long start = monotonic_ns();
+
+	if(worker->engine->clean != CLEAN_NONE && mode_in->colortype == LCT_RGBA)
+	{
+		cleaned = clean_transparent_zero(pic_data->row_pointers[0], (size_t)width * height, mode_in->bitdepth);
+		if(cleaned) worker->info.cleaned++;
+	}
+
+	if(worker->engine->cache->buckets || worker->engine->manifest)
+	{
+		tile_key_init(&worker->key, pic_data->row_pointers[0], lodepng_get_raw_size(width, height, mode_in), width, height, mode_in);
+	}
+
+	//A single color needs no profiling and no deflate, see encode_uniform_png.
+	pic_data->uniform = uniform_tile(pic_data->row_pointers[0], lodepng_get_raw_size(width, height, mode_in), mode_in, worker->uniform_color);
+
+	//Same pixels converted before: the result is known, skip profiling and encoding.
+	if(pic_data->uniform == UNIFORM_NONE) hit = tile_cache_lookup(worker->engine->cache, &worker->key, &worker->output);
+
+	if(pic_data->uniform == UNIFORM_NONE && !hit)
+	{
+		lodepng_auto_choose_color(mode_out, pic_data->row_pointers[0], width, height, mode_in);
+	}
+	tile_phase(worker, PHASE_PROFILE, monotonic_ns() - start);
+	if(pic_data->uniform != UNIFORM_NONE) return 3;
+	if(hit) return 2;
+
+	//Still truecolor after the lossless pass, too many colors for a palette: try imagequant.
+	if(mode_out->colortype == LCT_RGB || mode_out->colortype == LCT_RGBA)
+	{
+		start = monotonic_ns();
+		pic_data->quant = quantize_png(worker, mode_in, mode_out, pic_data);
+		tile_phase(worker, PHASE_CONVERT, monotonic_ns() - start);
+		if(pic_data->quant == QUANT_DONE) return 0;
+	}
+
+	if(worker->engine->clean == CLEAN_UP && mode_out->colortype == LCT_RGBA)
+	{
+		start = monotonic_ns();
+		clean_transparent_up(pic_data->row_pointers, width, height, mode_in->bitdepth);
+		tile_phase(worker, PHASE_CONVERT, monotonic_ns() - start);
+	}
+
+	//if mode_out equal mode_in, no need do anything. Unless transparent pixels were cleaned or
+	//the compression is searched, then the same mode may well deflate smaller, commit_png decides.
+	if(lodepng_color_mode_equal(mode_out, mode_in) && !cleaned && !worker->engine->search_ns)
+	{
+		return -2;
+	}
+	return 0;
+}
+
+int decode_png(convert_worker* worker, char *file_path, LodePNGColorMode* mode_in, LodePNGColorMode* mode_out, auto_pic_data* pic_data)
+{
+	png_structp png_ptr;
+	png_infop   info_ptr;
+	int         temp;
+	mapped_file pic_map;
+
+	int width;
+	int height;
+	png_byte color_type;
+	png_byte bit_depth;
+	int cleaned = 0;
+	long long start = monotonic_ns();
+
+	//The tile is read from a mapping of the file, libpng inflates the IDATs where they lie.
+	mapped_file_init(&pic_map);
+	if(map_file(&pic_map, file_path) != 0)
+	{
+		unmap_file(&pic_map);
+		return -1;
+	}
+	if(!pic_map.map) /*missing, or empty and so no PNG*/
+		return lodepng_filesize(file_path) == 0 ? 1 : -1;
+
+	temp = pic_map.size < PNG_BYTES_TO_CHECK ? 1 : png_sig_cmp(pic_map.map, (png_size_t)0, PNG_BYTES_TO_CHECK);
+
+	if (temp!=0) 
+	{
+		unmap_file(&pic_map);
+		return 1;
+	}
+
+	//The read structs belong to the worker so that no two threads ever share one, they live as
+	//long as the worker and png_reset_read_struct keeps the inflate window and row buffers warm.
+	if(!worker->read_info_ptr)
+	{
+		unmap_file(&pic_map);
+		return -1;
+	}
+	png_ptr = worker->read_ptr;
+	info_ptr = worker->read_info_ptr;
+
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		png_reset_read_struct(worker->read_ptr, worker->read_info_ptr, 0);
+		unmap_file(&pic_map);
+		return -1;
+	}
+
+	png_set_read_memory(png_ptr, pic_map.map, pic_map.size);
+	png_read_info(png_ptr, info_ptr);
+	png_set_expand(png_ptr);
+	png_set_interlace_handling(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
+
+	width = png_get_image_width(png_ptr, info_ptr);
+	height = png_get_image_height(png_ptr, info_ptr);
+	color_type = png_get_color_type(png_ptr,info_ptr);
+	bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+
+	pic_data->height = height;
+	pic_data->width = width;
+	pic_data->src_size = (long long)pic_map.size;
+	pic_data->size = pic_data->src_size;
+	pic_data->row_pointers = NULL;
+	//**********************************************************************************
+	color_mode_init(mode_in, color_type, bit_depth);
+    lodepng_color_mode_cleanup(mode_out);
+    lodepng_color_mode_copy(mode_out, mode_in);
+	if(mode_in->colortype !=LCT_RGB && mode_in->colortype !=LCT_RGBA)
+	{
+		png_reset_read_struct(worker->read_ptr, worker->read_info_ptr, 0);
+		unmap_file(&pic_map);
+		return -3; /*nothing to do for this tile*/
+	}
+
+	//Too big to hold: profile it now band by band, convert_png streams it out with stream_png.
+	if(worker->engine->band_bytes && png_get_interlace_type(png_ptr, info_ptr) == PNG_INTERLACE_NONE
+		&& lodepng_get_raw_size(width, 1, mode_in) * height > worker->engine->band_bytes)
+	{
+		cleaned = profile_bands(worker, png_ptr, mode_in, mode_out, width, height);
+		png_read_end(png_ptr, NULL);
+		png_reset_read_struct(worker->read_ptr, worker->read_info_ptr, 0);
+		unmap_file(&pic_map);
+		tile_phase(worker, PHASE_PROFILE, monotonic_ns() - start);
+		worker->info.streamed++;
+		if(cleaned) worker->info.cleaned++;
+		if(mode_out->colortype == LCT_RGB || mode_out->colortype == LCT_RGBA) pic_data->quant = QUANT_SKIPPED;
+		return lodepng_color_mode_equal(mode_out, mode_in) && !cleaned ? -4 : 4;
+	}
+
+	//libpng decodes straight into the contiguous rows that are profiled and converted later,
+	//pic_data owns them from here on so every exit path releases them in convert_png.
+	//A tile that fits is held whole rather than a few rows at a time: the color profile has to
+	//see every pixel before the output mode is known, and a second inflate would cost more than
+	//the memory. Only tiles above band_bytes (-b) are read twice, band by band, to bound memory.
+	pic_data->row_pointers = malloc_png_bytepp(mode_in, width, height);
+	if(!pic_data->row_pointers)
+	{
+		png_reset_read_struct(worker->read_ptr, worker->read_info_ptr, 0);
+		unmap_file(&pic_map);
+		return -1;
+	}
+	png_read_image(png_ptr, pic_data->row_pointers);
+	png_read_end(png_ptr, NULL);
+
+	png_reset_read_struct(worker->read_ptr, worker->read_info_ptr, 0);
+	unmap_file(&pic_map);
+	tile_phase(worker, PHASE_READ, monotonic_ns() - start);
+	return reduce_png(worker, mode_in, mode_out, pic_data);
+}
+
+//libpng writes the encoded tile into the worker's buffer, which grows to the largest tile and is kept.
+static void memory_png_write(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+	convert_worker* worker = (convert_worker*)png_get_io_ptr(png_ptr);
+	tile_output* output = &worker->output;
+
+	if(output->size + length > worker->encoded_capacity)
+	{
+		size_t capacity = worker->encoded_capacity * 2 + length;
+		unsigned char* grown = (unsigned char*)realloc(worker->encoded, capacity);
+		if(!grown) png_error(png_ptr, "Out of memory");
+		worker->encoded = grown;
+		worker->encoded_capacity = capacity;
+	}
+	memcpy(worker->encoded + output->size, data, length);
+	output->data = worker->encoded;
+	output->size += length;
+}
+
+static void memory_png_flush(png_structp png_ptr)
+{
+	(void)png_ptr; /*the tile is in memory, nothing to flush*/
+}
+
+//Reset the worker's write structs after a failed encode.
+static int encode_fail(convert_worker* worker, const char* message)
+{
+	printf("[write_png_file] %s", message);
+	png_reset_write_struct(worker->write_ptr, worker->write_info_ptr);
+	return -1;
+}
+
+/*
+One set of deflate settings for encode_png, ENCODE_DEFAULT leaves the choice to libpng:
+all filters and Z_FILTERED for truecolor and grey 8, no filter and Z_DEFAULT_STRATEGY for
+palette and low bit depths, memLevel 8.
+*/
+#define ENCODE_DEFAULT -1
+
+typedef struct encode_setting
+{
+	int filters; /*PNG_FILTER_* mask*/
+	int strategy; /*Z_* strategy*/
+	int mem_level;
+} encode_setting;
+
+/*
+Candidates of the compression search, modelled on the ones pngcp --search walks through.
+The default comes first so a tile never ends up worse than without searching, then the
+settings that most often win on tiles: no filter with Z_RLE for palette tiles, single
+filters for photos. The budget cuts the list from the end, so cheap likely wins go early.
+*/
+static const encode_setting encode_settings[] =
+{
+	{ENCODE_DEFAULT, ENCODE_DEFAULT, ENCODE_DEFAULT},
+	{PNG_FILTER_NONE, Z_RLE, 9},
+	{PNG_FILTER_NONE, Z_DEFAULT_STRATEGY, 9},
+	{PNG_ALL_FILTERS, Z_DEFAULT_STRATEGY, 9},
+	{PNG_FILTER_PAETH, Z_FILTERED, 9},
+	{PNG_FILTER_UP, Z_RLE, 9},
+	{PNG_FILTER_SUB, Z_FILTERED, 9},
+	{PNG_ALL_FILTERS, Z_RLE, 9},
+	{PNG_FILTER_NONE, Z_FILTERED, 8},
+	{PNG_FILTER_UP | PNG_FILTER_PAETH, Z_FILTERED, 9}
+};
+#define ENCODE_SETTINGS_COUNT (sizeof(encode_settings) / sizeof(encode_settings[0]))
+
+//Encode the tile into worker->output with setting, nothing is written to disk here.
+int encode_png(convert_worker* worker, LodePNGColorMode* mode_in, LodePNGColorMode* mode, auto_pic_data* pic_data, const encode_setting* setting)
+{
+	int w,h;
+	png_structp png_ptr;
+	png_infop info_ptr; 
+	long long start = monotonic_ns();
+	long long convert_ns = 0;
+	h=pic_data->height;
+	w=pic_data->width;
+
+	worker->output.size = 0;
+	//Like the read structs the write structs live as long as the worker, png_reset_write_struct
+	//keeps the deflate window, hash tables and row buffers for the next tile and candidate.
+	if (!worker->write_info_ptr)
+	{
+		printf("[write_png_file] png_create_write_struct failed");
+		return -1;
+	}
+	png_ptr = worker->write_ptr;
+	info_ptr = worker->write_info_ptr;
+
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		return encode_fail(worker, "Error during init_io");
+	}
+	png_set_write_fn(png_ptr, worker, memory_png_write, memory_png_flush);
+
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		return encode_fail(worker, "Error during writing header");
+	}
+
+   png_set_compression_level(png_ptr, 9);
+	if(setting->filters != ENCODE_DEFAULT) png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, setting->filters);
+	if(setting->strategy != ENCODE_DEFAULT) png_set_compression_strategy(png_ptr, setting->strategy);
+	if(setting->mem_level != ENCODE_DEFAULT) png_set_compression_mem_level(png_ptr, setting->mem_level);
+
+	SetIHDR(png_ptr, info_ptr, mode, w, h);
+	SetPLTE(png_ptr, info_ptr, mode);
+
+	/* write bytes */
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		return encode_fail(worker, "Error during writing bytes");
+	}
+
+	png_write_info(png_ptr, info_ptr);
+
+	/* end write */
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		return encode_fail(worker, "Error during end of write");
+	}
+
+	if (SetIDAT(png_ptr, mode_in, mode, pic_data->row_pointers, w, h, &convert_ns) != 0)
+	{
+		return encode_fail(worker, "Error during converting rows");
+	}
+
+	png_write_end(png_ptr, NULL);
+	png_reset_write_struct(worker->write_ptr, worker->write_info_ptr);
+
+	tile_phase(worker, PHASE_CONVERT, convert_ns);
+	tile_phase(worker, PHASE_DEFLATE, monotonic_ns() - start - convert_ns);
+	return 0;
+}
+
+/*
+Encode the tile with the candidate settings one after the other and leave the smallest
+in worker->output. Searching stops early once the tile has used up engine->search_ns,
+the default setting always runs. Without a budget this is a single default encode.
+*/
+int search_png(convert_worker* worker, LodePNGColorMode* mode_in, LodePNGColorMode* mode, auto_pic_data* pic_data)
+{
+	size_t i;
+	size_t best_size = 0;
+	size_t winner = 0;
+	long long start = monotonic_ns();
+
+	if(!worker->engine->search_ns)
+	{
+		return encode_png(worker, mode_in, mode, pic_data, &encode_settings[0]);
+	}
+
+	for(i = 0; i < ENCODE_SETTINGS_COUNT; i++)
+	{
+		if(i > 0 && monotonic_ns() - start >= worker->engine->search_ns) break;
+		if(encode_png(worker, mode_in, mode, pic_data, &encode_settings[i]) != 0) continue;
+		worker->info.search_trials++;
+		if(best_size == 0 || worker->output.size < best_size)
+		{
+			unsigned char* buffer = worker->best;
+			size_t capacity = worker->best_capacity;
+			worker->best = worker->encoded;
+			worker->best_capacity = worker->encoded_capacity;
+			worker->encoded = buffer;
+			worker->encoded_capacity = capacity;
+			best_size = worker->output.size;
+			winner = i;
+		}
+	}
+	if(best_size == 0) return -1;
+
+	if(winner != 0) worker->info.search_wins++;
+	worker->output.data = worker->best;
+	worker->output.size = best_size;
+	return 0;
+}
+
+//file_path with suffix appended, in the tile's arena.
+static char* sibling_path(const char* file_path, const char* suffix)
+{
+	char* path = (char*)lodepng_malloc(strlen(file_path) + strlen(suffix) + 1);
+	if(!path) return NULL;
+	strcpy(path, file_path);
+	strcat(path, suffix);
+	return path;
+}
+
+//Replace file_path with data through a temp file and a rename, so a crash never leaves a truncated tile.
+static int replace_file(const char* file_path, const unsigned char* data, size_t size)
+{
+	FILE* fp;
+	int ok;
+	char* tmp = sibling_path(file_path, ".tmp");
+	if(!tmp) return -1;
+
+	fp = fopen(tmp, "wb");
+	if(!fp) return -1;
+	ok = fwrite(data, 1, size, fp) == size;
+	ok = fclose(fp) == 0 && ok;
+	if(!ok || rename_file(tmp, file_path) != 0)
+	{
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+//Replace file_path with a hardlink to from, through a temp link and a rename.
+static int link_file(const char* from, const char* file_path)
+{
+	int result;
+	char* tmp = sibling_path(file_path, ".lnk");
+	if(!tmp) return -1;
+#ifdef _WIN32
+	result = CreateHardLinkA(tmp, from, NULL) ? 0 : -1;
+#else
+	result = link(from, tmp);
+#endif
+	if(result == 0) result = rename_file(tmp, file_path);
+	if(result != 0) remove(tmp);
+	return result;
+}
+
+/*
+Put the encoded tile in place of file_path, only if it is strictly smaller than the
+source; otherwise the source stays as it is and nothing is written. With link_from
+the tile becomes a hardlink to that file (same bytes) instead of a new copy.
+Returns 1 if file_path was replaced, 0 if it was kept or archived, -1 if writing failed.
+*/
+static int commit_png(convert_worker* worker, const char* file_path, const unsigned char* data, size_t size,
+	const char* link_from, auto_pic_data* pic_data)
+{
+	long long start;
+	if(!pic_data->cut && pic_data->src_size >= 0 && (long long)size >= pic_data->src_size)
+	{
+		pic_data->size = pic_data->src_size;
+		worker->info.writes_avoided++;
+		return 0;
+	}
+
+	start = monotonic_ns();
+	if(worker->engine->archive)
+	{
+		if(tile_archive_add(worker->engine->archive, file_path, data, size) != 0)
+		{
+			printf("[write_png_file] File %s could not be archived\n", file_path);
+			pic_data->size = pic_data->src_size;
+			return -1;
+		}
+		worker->archived = 1;
+	}
+	else if(!(link_from && strcmp(link_from, file_path) != 0 && link_file(link_from, file_path) == 0)
+		&& replace_file(file_path, data, size) != 0)
+	{
+		printf("[write_png_file] File %s could not be replaced\n", file_path);
+		pic_data->size = pic_data->src_size;
+		return -1;
+	}
+	tile_phase(worker, PHASE_WRITE, monotonic_ns() - start);
+
+	pic_data->size = (long long)size;
+	worker->info.writes++;
+	worker->info.bytes_saved += pic_data->src_size - (long long)size;
+	return !worker->archived;
+}
+
+//Release everything of a failed stream_png, the temp file included.
+static int stream_fail(convert_worker* worker, FILE* in_fp, FILE* out_fp, const char* tmp)
+{
+	printf("[write_png_file] Streaming %s failed\n", tmp);
+	png_reset_read_struct(worker->read_ptr, worker->read_info_ptr, 0);
+	png_reset_write_struct(worker->write_ptr, worker->write_info_ptr);
+	fclose(in_fp);
+	fclose(out_fp);
+	remove(tmp);
+	return -1;
+}
+
+/*
+Second pass of streaming: read file_path again band by band, convert to mode_out and
+write the rows to a temp file as they come, which then replaces file_path if it is
+smaller. Reading is timed together with deflating, the two interleave.
+*/
+static int stream_png(convert_worker* worker, const char* file_path, LodePNGColorMode* mode_in,
+	LodePNGColorMode* mode_out, auto_pic_data* pic_data)
+{
+	FILE* in_fp;
+	FILE* out_fp;
+	char* tmp = sibling_path(file_path, ".tmp");
+	int width = pic_data->width;
+	int height = pic_data->height;
+	size_t rowbytes = lodepng_get_raw_size(width, 1, mode_in);
+	int band_rows = stream_band_rows(worker->engine, rowbytes);
+	int same = lodepng_color_mode_equal(mode_out, mode_in);
+	int up = worker->engine->clean == CLEAN_UP && mode_out->colortype == LCT_RGBA;
+	png_bytepp rows; /*rows[0] keeps the last row of the previous band for the Up cleaning*/
+	png_bytep row;
+	ColorTable table;
+	long long start = monotonic_ns();
+	long long convert_ns = 0;
+	long long size;
+	int y, i, n;
+
+	rows = malloc_png_bytepp(mode_in, width, band_rows + 1);
+	row = (png_bytep)lodepng_malloc(((size_t)width * lodepng_get_bpp(mode_out) + 7) / 8);
+	if(!tmp || !rows || !row) return -1;
+	in_fp = fopen(file_path, "rb");
+	if(!in_fp) return -1;
+	out_fp = fopen(tmp, "wb");
+	if(!out_fp)
+	{
+		fclose(in_fp);
+		return -1;
+	}
+
+	if(!worker->read_info_ptr || !worker->write_info_ptr) return stream_fail(worker, in_fp, out_fp, tmp);
+	if(setjmp(png_jmpbuf(worker->read_ptr))) return stream_fail(worker, in_fp, out_fp, tmp);
+	if(setjmp(png_jmpbuf(worker->write_ptr))) return stream_fail(worker, in_fp, out_fp, tmp);
+
+	png_init_io(worker->read_ptr, in_fp);
+	png_read_info(worker->read_ptr, worker->read_info_ptr);
+	png_set_expand(worker->read_ptr);
+	png_set_interlace_handling(worker->read_ptr);
+	png_read_update_info(worker->read_ptr, worker->read_info_ptr);
+
+	png_init_io(worker->write_ptr, out_fp);
+	png_set_compression_level(worker->write_ptr, 9);
+	SetIHDR(worker->write_ptr, worker->write_info_ptr, mode_out, width, height);
+	SetPLTE(worker->write_ptr, worker->write_info_ptr, mode_out);
+	png_write_info(worker->write_ptr, worker->write_info_ptr);
+
+	if(mode_out->colortype == LCT_PALETTE) color_table_set_palette(&table, mode_out, mode_in);
+	for(y = 0; y < height; y += n)
+	{
+		n = height - y < band_rows ? height - y : band_rows;
+		png_read_rows(worker->read_ptr, rows + 1, NULL, n);
+		if(worker->engine->clean != CLEAN_NONE && mode_in->colortype == LCT_RGBA)
+		{
+			clean_transparent_zero(rows[1], (size_t)width * n, mode_in->bitdepth);
+		}
+		if(up) clean_transparent_up(y == 0 ? rows + 1 : rows, width, y == 0 ? n : n + 1, mode_in->bitdepth);
+
+		for(i = 1; i <= n; i++)
+		{
+			long long convert_start;
+			if(same)
+			{
+				png_write_row(worker->write_ptr, rows[i]);
+				continue;
+			}
+			convert_start = monotonic_ns();
+			if(lodepng_convert_pixels(row, rows[i], width, mode_out, mode_in, &table))
+			{
+				png_error(worker->write_ptr, "Error during converting rows");
+			}
+			convert_ns += monotonic_ns() - convert_start;
+			png_write_row(worker->write_ptr, row);
+		}
+		memcpy(rows[0], rows[n], rowbytes);
+	}
+	png_read_end(worker->read_ptr, NULL);
+	png_write_end(worker->write_ptr, NULL);
+	png_reset_read_struct(worker->read_ptr, worker->read_info_ptr, 0);
+	png_reset_write_struct(worker->write_ptr, worker->write_info_ptr);
+	fclose(in_fp);
+	size = file_tell(out_fp);
+	if(fclose(out_fp) != 0) size = -1;
+	tile_phase(worker, PHASE_CONVERT, convert_ns);
+	tile_phase(worker, PHASE_DEFLATE, monotonic_ns() - start - convert_ns);
+
+	//Same rule as commit_png, only strictly smaller replaces the source.
+	if(size < 0 || (pic_data->src_size >= 0 && size >= pic_data->src_size))
+	{
+		remove(tmp);
+		pic_data->size = pic_data->src_size;
+		if(size >= 0) worker->info.writes_avoided++;
+		return size < 0 ? -1 : 0;
+	}
+	start = monotonic_ns();
+	if(worker->engine->archive)
+	{
+		worker->archived = tile_archive_add_file(worker->engine->archive, file_path, tmp) == 0;
+		remove(tmp);
+		if(!worker->archived)
+		{
+			pic_data->size = pic_data->src_size;
+			return -1;
+		}
+	}
+	else if(rename_file(tmp, file_path) != 0)
+	{
+		printf("[write_png_file] File %s could not be replaced\n", file_path);
+		remove(tmp);
+		pic_data->size = pic_data->src_size;
+		return -1;
+	}
+	tile_phase(worker, PHASE_WRITE, monotonic_ns() - start);
+
+	pic_data->size = size;
+	worker->info.writes++;
+	worker->info.bytes_saved += pic_data->src_size - size;
+	return 0;
+}
+
+//Reset the worker's per tile state before a tile is converted.
+static void tile_begin(convert_worker* worker)
+{
+	auto_pic_data* pic_data = &worker->pic_data;
+	int i;
+	pic_data->width = 0;
+	pic_data->height = 0;
+	pic_data->row_pointers = NULL;
+	pic_data->size = 0;
+	pic_data->src_size = 0;
+	pic_data->quant = QUANT_NONE;
+	pic_data->uniform = UNIFORM_NONE;
+	pic_data->cut = 0;
+	memset(&worker->output, 0, sizeof(worker->output));
+	memset(&worker->key, 0, sizeof(worker->key));
+	for(i = 0; i < PHASE_COUNT; i++) worker->tile_ns[i] = -1;
+	worker->archived = 0;
+	lodepng_arena = &worker->arena;
+}
+
+//Encode or copy the tile according to the result of decode_png or reduce_png and write it.
+//Returns -1 if the tile should have been written and was not, 0 otherwise.
+static int store_tile(convert_worker* worker, char* file_path, int result)
+{
+	auto_pic_data* pic_data = &worker->pic_data;
+	LodePNGColorMode* mode_out = &worker->mode_out;
+	LodePNGColorMode* mode_in = &worker->mode_in;
+	tile_output* output = &worker->output;
+	tile_cache* cache = worker->engine->cache;
+	int stored = 0;
+
+	if(result == 0)
+	{
+		stored = -1;
+		if(search_png(worker, mode_in, mode_out, pic_data) == 0)
+		{
+			int written = commit_png(worker, file_path, output->data, output->size, NULL, pic_data);
+			stored = written < 0 ? -1 : 0;
+			if(cache->buckets)
+			{
+				output->colortype = mode_out->colortype;
+				output->bitdepth = mode_out->bitdepth;
+				output->quant = pic_data->quant;
+				output->path = written > 0 ? file_path : NULL;
+				tile_cache_insert(cache, &worker->key, output);
+			}
+		}
+	}
+	else if(result == -2 && cache->buckets)
+	{
+		output->keep = 1;
+		output->colortype = mode_out->colortype;
+		output->bitdepth = mode_out->bitdepth;
+		output->quant = pic_data->quant;
+		tile_cache_insert(cache, &worker->key, output);
+	}
+	else if(result == 4)
+	{
+		stored = stream_png(worker, file_path, mode_in, mode_out, pic_data);
+	}
+	else if(result == 3)
+	{
+		size_t size;
+		unsigned char* png = encode_uniform_png(&worker->templates, pic_data->width, pic_data->height, worker->uniform_color,
+			mode_out, &size);
+		stored = png ? commit_png(worker, file_path, png, size, NULL, pic_data) : -1;
+	}
+	else if(result == 2)
+	{
+		//Cache hit, mode_out and the stats take what the first tile became.
+		mode_out->colortype = (LodePNGColorType)output->colortype;
+		mode_out->bitdepth = output->bitdepth;
+		pic_data->quant = output->quant;
+		if(!output->keep)
+		{
+			stored = commit_png(worker, file_path, output->data, output->size, cache->hardlink ? output->path : NULL, pic_data);
+		}
+	}
+	if(cache->buckets && (result == 0 || result == 2 || result == -2))
+	{
+		worker->info.cache_lookups++;
+		if(result == 2) worker->info.cache_hits++;
+	}
+	return stored < 0 ? -1 : 0;
+}
+
+static void service_report(convert_worker* worker, const char* file_path, int result);
+
+//Count and report the tile and release everything it allocated.
+static void tile_end(convert_worker* worker, char* file_path, int result)
+{
+	auto_pic_data* pic_data = &worker->pic_data;
+	int i;
+
+	update_info(&worker->info, file_path, &worker->mode_out, pic_data);
+	service_report(worker, file_path, result);
+	for(i = 0; i < PHASE_COUNT; i++)
+	{
+		if(worker->tile_ns[i] >= 0) phase_add(&worker->info.phases[i], worker->tile_ns[i]);
+	}
+	//printf("%s end\n", file_path);
+
+	free_png_bytepp(pic_data->row_pointers);
+	pic_data->row_pointers = NULL;
+
+	//Nothing allocated for this tile may outlive the arena reset.
+	lodepng_color_mode_cleanup(&worker->mode_out);
+	lodepng_color_mode_cleanup(&worker->mode_in);
+	tile_arena_reset(&worker->arena);
+	lodepng_arena = 0;
+}
+
+void convert_png(convert_worker* worker, char* file_path)
+{
+	LodePNGColorMode* mode_out = &worker->mode_out;
+	int result, stored;
+	tile_begin(worker);
+    //printf("%s start\n", file_path);
+
+	//Only mode_in is different mode_out, return 0, and encode png file again.
+	result = decode_png(worker, file_path, &worker->mode_in, mode_out, &worker->pic_data);
+	stored = store_tile(worker, file_path, result);
+	//Left as it is, or not convertible at all: the archive still needs the tile.
+	if(worker->engine->archive && !worker->archived)
+	{
+		if(tile_archive_add_file(worker->engine->archive, file_path, file_path) != 0)
+		{
+			printf("[write_png_file] File %s could not be archived\n", file_path);
+			stored = -1;
+		}
+	}
+	//Only a tile that was written, or kept on purpose, is done. After a failed write it is tried again next run.
+	if(worker->engine->manifest && stored == 0 && (result == 0 || result == 2 || result == 3 || result == 4
+		|| result == -2 || result == -3 || result == -4))
+	{
+		manifest_add(worker->engine->manifest, file_path, &worker->key, mode_out->colortype, mode_out->bitdepth);
+	}
+	tile_end(worker, file_path, result);
+}
+
+//Reduce and write a tile the pyramid cut, its RGBA pixels come with the job instead of a file.
+void convert_cut_tile(convert_worker* worker, tile_job* job)
+{
+	auto_pic_data* pic_data = &worker->pic_data;
+	int result = -1;
+	int y;
+	tile_begin(worker);
+
+	pic_data->width = job->width;
+	pic_data->height = job->height;
+	pic_data->src_size = (long long)job->width * job->height * 4;
+	pic_data->size = pic_data->src_size;
+	pic_data->cut = 1;
+	color_mode_init(&worker->mode_in, PNG_COLOR_TYPE_RGBA, 8);
+	lodepng_color_mode_cleanup(&worker->mode_out);
+	lodepng_color_mode_copy(&worker->mode_out, &worker->mode_in);
+
+	pic_data->row_pointers = (png_bytepp)lodepng_malloc(sizeof(png_bytep) * job->height);
+	if(pic_data->row_pointers)
+	{
+		for(y = 0; y < job->height; y++) pic_data->row_pointers[y] = job->pixels + (size_t)y * job->width * 4;
+		//A cut tile has to be written even if RGBA stays best.
+		result = reduce_png(worker, &worker->mode_in, &worker->mode_out, pic_data);
+		store_tile(worker, job->path, result == -2 ? 0 : result);
+	}
+	tile_end(worker, job->path, result);
+}
+
+//************************************Conversion engine (Start)*******************************************
+static void job_deque_init(job_deque* deque)
+{
+	engine_mutex_init(&deque->lock);
+	deque->jobs = NULL;
+	deque->capacity = 0;
+	deque->top = 0;
+	deque->count = 0;
+}
+
+static void job_deque_cleanup(job_deque* deque)
+{
+	while(deque->count)
+	{
+		free(deque->jobs[deque->top]);
+		deque->top = (deque->top + 1) % deque->capacity;
+		deque->count--;
+	}
+	free(deque->jobs);
+	engine_mutex_destroy(&deque->lock);
+}
+
+//Owner side: add a job at the bottom, growing the ring when it is full.
+static int job_deque_push(job_deque* deque, tile_job* job)
+{
+	engine_mutex_lock(&deque->lock);
+	if(deque->count == deque->capacity)
+	{
+		size_t i;
+		size_t capacity = deque->capacity ? deque->capacity * 2 : 256;
+		tile_job** jobs = (tile_job**)malloc(sizeof(tile_job*) * capacity);
+		if(!jobs)
+		{
+			engine_mutex_unlock(&deque->lock);
+			return -1;
+		}
+		for(i = 0; i < deque->count; i++) jobs[i] = deque->jobs[(deque->top + i) % deque->capacity];
+		free(deque->jobs);
+		deque->jobs = jobs;
+		deque->capacity = capacity;
+		deque->top = 0;
+	}
+	deque->jobs[(deque->top + deque->count) % deque->capacity] = job;
+	deque->count++;
+	engine_mutex_unlock(&deque->lock);
+	return 0;
+}
+
+//Owner side: take the newest job.
+static tile_job* job_deque_pop(job_deque* deque)
+{
+	tile_job* job = NULL;
+	engine_mutex_lock(&deque->lock);
+	if(deque->count)
+	{
+		deque->count--;
+		job = deque->jobs[(deque->top + deque->count) % deque->capacity];
+	}
+	engine_mutex_unlock(&deque->lock);
+	return job;
+}
+
+//Thief side: take the oldest job.
+static tile_job* job_deque_steal(job_deque* deque)
+{
+	tile_job* job = NULL;
+	engine_mutex_lock(&deque->lock);
+	if(deque->count)
+	{
+		job = deque->jobs[deque->top];
+		deque->top = (deque->top + 1) % deque->capacity;
+		deque->count--;
+	}
+	engine_mutex_unlock(&deque->lock);
+	return job;
+}
+
+//Own deque first, then try every other worker once, starting with the next one.
+static tile_job* engine_take_job(convert_worker* worker)
+{
+	convert_engine* engine = worker->engine;
+	tile_job* job = job_deque_pop(&worker->deque);
+	int i;
+	for(i = 1; !job && i < engine->num_workers; i++)
+	{
+		job = job_deque_steal(&engine->workers[(worker->id + i) % engine->num_workers].deque);
+	}
+	if(job)
+	{
+		engine_mutex_lock(&engine->lock);
+		engine->pending--;
+		engine->active++;
+		if(engine->pending < engine->max_pending) engine_cond_broadcast(&engine->room);
+		engine_mutex_unlock(&engine->lock);
+	}
+	return job;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI engine_worker_main(LPVOID arg)
+#else
+static void* engine_worker_main(void* arg)
+#endif
+{
+	convert_worker* worker = (convert_worker*)arg;
+	convert_engine* engine = worker->engine;
+	tile_job* job;
+
+	//engine_start holds the lock until it knows how many workers it got.
+	engine_mutex_lock(&engine->lock);
+	engine_mutex_unlock(&engine->lock);
+
+	for(;;)
+	{
+		job = engine_take_job(worker);
+		if(job)
+		{
+			if(job->pixels) convert_cut_tile(worker, job);
+			else convert_png(worker, job->path);
+			free(job);
+			engine_mutex_lock(&engine->lock);
+			engine->active--;
+			if(engine->pending == 0 && engine->active == 0) engine_cond_broadcast(&engine->idle);
+			engine_mutex_unlock(&engine->lock);
+			continue;
+		}
+
+		//Nothing to take, sleep until discovery adds work or finishes.
+		engine_mutex_lock(&engine->lock);
+		while(engine->pending == 0 && !engine->done)
+		{
+			engine_cond_wait(&engine->wake, &engine->lock);
+		}
+		if(engine->pending == 0 && engine->done)
+		{
+			engine_mutex_unlock(&engine->lock);
+			break;
+		}
+		engine_mutex_unlock(&engine->lock);
+	}
+	return 0;
+}
+
+int engine_default_threads()
+{
+#ifdef _WIN32
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	return (int)system_info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+#endif
+}
+
+//Release what engine_start set up for one worker, its thread has ended or never ran.
+static void engine_worker_cleanup(convert_worker* worker)
+{
+	lodepng_color_mode_cleanup(&worker->mode_in);
+	lodepng_color_mode_cleanup(&worker->mode_out);
+	tile_arena_cleanup(&worker->arena);
+	png_destroy_read_struct(&worker->read_ptr, &worker->read_info_ptr, 0);
+	png_destroy_write_struct(&worker->write_ptr, &worker->write_info_ptr);
+	if(worker->liq) liq_attr_destroy(worker->liq);
+	uniform_template_cleanup(&worker->templates);
+	free(worker->encoded);
+	free(worker->best);
+	job_deque_cleanup(&worker->deque);
+}
+
+int engine_start(convert_engine* engine, int num_workers, tile_cache* cache, tile_manifest* manifest, int clean, long long search_ns,
+	size_t band_bytes, tile_archive* archive)
+{
+	int i;
+	if(num_workers < 1) num_workers = 1;
+	engine->workers = (convert_worker*)calloc(num_workers, sizeof(convert_worker));
+	if(!engine->workers) return -1;
+	engine->num_workers = num_workers;
+	engine->next_worker = 0;
+	engine->cache = cache;
+	engine->manifest = manifest;
+	engine->clean = clean;
+	if(clean != CLEAN_NONE) clean_transparent_init();
+	engine->search_ns = search_ns;
+	engine->band_bytes = band_bytes;
+	engine->archive = archive;
+	engine->skipped = 0;
+	engine->failed = 0;
+	memset(&engine->scan, 0, sizeof(engine->scan));
+	engine->results = NULL;
+	engine->reported = 0;
+	engine->pending = 0;
+	engine->active = 0;
+	engine->max_pending = (size_t)num_workers * 4;
+	engine->done = 0;
+	engine_mutex_init(&engine->lock);
+	engine_cond_init(&engine->wake);
+	engine_cond_init(&engine->room);
+	engine_cond_init(&engine->idle);
+
+	for(i = 0; i < num_workers; i++)
+	{
+		convert_worker* worker = &engine->workers[i];
+		worker->engine = engine;
+		worker->id = i;
+		job_deque_init(&worker->deque);
+		init_info(&worker->info);
+		tile_arena_init(&worker->arena);
+		lodepng_color_mode_init(&worker->mode_in);
+		lodepng_color_mode_init(&worker->mode_out);
+		//Not from the arena: the png structs and what png_reset_*_struct keeps (the zlib streams,
+		//row buffers, the fused transform table) outlive the tile. What libpng still allocates per
+		//tile goes to the heap, unlike when the arena served libpng: the PLTE and tRNS of palette
+		//output and any text chunks of the source, a few small calls.
+		worker->read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+		worker->read_info_ptr = worker->read_ptr ? png_create_info_struct(worker->read_ptr) : NULL;
+		worker->write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		worker->write_info_ptr = worker->write_ptr ? png_create_info_struct(worker->write_ptr) : NULL;
+		worker->liq = liq_attr_create();
+		if(worker->liq)
+		{
+			liq_set_quality(worker->liq, QUANT_QUALITY_MIN, QUANT_QUALITY_MAX);
+			liq_set_speed(worker->liq, QUANT_SPEED);
+		}
+	}
+
+	//Workers read num_workers when stealing, so they wait on the lock until it is final.
+	engine_mutex_lock(&engine->lock);
+	for(i = 0; i < num_workers; i++)
+	{
+#ifdef _WIN32
+		engine->workers[i].thread = CreateThread(NULL, 0, engine_worker_main, &engine->workers[i], 0, NULL);
+		if(!engine->workers[i].thread) break;
+#else
+		if(pthread_create(&engine->workers[i].thread, NULL, engine_worker_main, &engine->workers[i]) != 0) break;
+#endif
+	}
+	if(i < num_workers)
+	{
+		int started = i;
+		printf("[engine] only %d of %d conversion threads started\n", started, num_workers);
+		for(; i < num_workers; i++) engine_worker_cleanup(&engine->workers[i]);
+		engine->num_workers = started;
+		engine->max_pending = (size_t)started * 4;
+		if(started == 0)
+		{
+			engine_mutex_unlock(&engine->lock);
+			engine_cond_destroy(&engine->wake);
+			engine_cond_destroy(&engine->room);
+			engine_cond_destroy(&engine->idle);
+			engine_mutex_destroy(&engine->lock);
+			free(engine->workers);
+			engine->workers = NULL;
+			return -1;
+		}
+	}
+	engine_mutex_unlock(&engine->lock);
+	return 0;
+}
+
+//Jobs are dealt round robin and balanced by stealing. Several threads may submit at once,
+//a batch takes its run of workers under the lock and wakes them once.
+static void engine_submit_jobs(convert_engine* engine, tile_job** jobs, size_t count)
+{
+	size_t i;
+	size_t dropped = 0;
+	int next;
+
+	//Counted before the push, a worker may take a job as soon as it is on a deque.
+	engine_mutex_lock(&engine->lock);
+	next = engine->next_worker;
+	engine->next_worker = (int)((next + count) % engine->num_workers);
+	engine->pending += count;
+	engine_mutex_unlock(&engine->lock);
+
+	for(i = 0; i < count; i++)
+	{
+		convert_worker* worker = &engine->workers[(next + i) % engine->num_workers];
+		if(job_deque_push(&worker->deque, jobs[i]) != 0)
+		{
+			printf("[engine] Out of memory, %s not converted\n", jobs[i]->path);
+			free(jobs[i]);
+			dropped++;
+		}
+	}
+
+	engine_mutex_lock(&engine->lock);
+	engine->pending -= dropped;
+	engine->failed += dropped;
+	if(engine->pending < engine->max_pending) engine_cond_broadcast(&engine->room);
+	if(engine->pending == 0 && engine->active == 0) engine_cond_broadcast(&engine->idle);
+	engine_cond_broadcast(&engine->wake);
+	engine_mutex_unlock(&engine->lock);
+}
+
+static void engine_submit_job(convert_engine* engine, tile_job* job)
+{
+	engine_submit_jobs(engine, &job, 1);
+}
+
+//Job for a tile file, the path is copied.
+static tile_job* file_job(const char* file_path)
+{
+	tile_job* job = (tile_job*)malloc(sizeof(tile_job) + strlen(file_path));
+	if(!job) return NULL;
+	job->pixels = NULL;
+	job->width = 0;
+	job->height = 0;
+	strcpy(job->path, file_path);
+	return job;
+}
+
+//Count a tile that could not be queued.
+static void engine_drop(convert_engine* engine, const char* file_path)
+{
+	printf("[engine] Out of memory, %s not converted\n", file_path);
+	engine_mutex_lock(&engine->lock);
+	engine->failed++;
+	engine_mutex_unlock(&engine->lock);
+}
+
+//Queue one tile file.
+void engine_submit(convert_engine* engine, const char* file_path)
+{
+	tile_job* job = file_job(file_path);
+	if(job) engine_submit_job(engine, job);
+	else engine_drop(engine, file_path);
+}
+
+/*
+Queue a cut tile, copying width x height RGBA pixels from rows stride bytes apart.
+Unlike files, these jobs hold their pixels, so the caller waits while max_pending are
+queued and memory stays bounded however fast the source is read.
+*/
+void engine_submit_tile(convert_engine* engine, const char* file_path, const unsigned char* pixels,
+	size_t stride, int width, int height)
+{
+	size_t path_size = strlen(file_path) + 1;
+	size_t rowbytes = (size_t)width * 4;
+	tile_job* job;
+	int y;
+
+	engine_mutex_lock(&engine->lock);
+	while(engine->pending >= engine->max_pending) engine_cond_wait(&engine->room, &engine->lock);
+	engine_mutex_unlock(&engine->lock);
+
+	job = (tile_job*)malloc(sizeof(tile_job) + path_size + rowbytes * height);
+	if(!job)
+	{
+		engine_drop(engine, file_path);
+		return;
+	}
+	memcpy(job->path, file_path, path_size);
+	job->pixels = (unsigned char*)job->path + path_size;
+	job->width = width;
+	job->height = height;
+	for(y = 0; y < height; y++) memcpy(job->pixels + rowbytes * y, pixels + stride * y, rowbytes);
+	engine_submit_job(engine, job);
+}
+
+//Block until every queued tile is converted, the workers keep running for more.
+void engine_wait(convert_engine* engine)
+{
+	engine_mutex_lock(&engine->lock);
+	while(engine->pending || engine->active) engine_cond_wait(&engine->idle, &engine->lock);
+	engine_mutex_unlock(&engine->lock);
+}
+
+//Wait until every queued tile is converted, merge the per-thread counters into total.
+void engine_finish(convert_engine* engine, pngexportinfo* total)
+{
+	int i;
+	engine_mutex_lock(&engine->lock);
+	engine->done = 1;
+	engine_cond_broadcast(&engine->wake);
+	engine_mutex_unlock(&engine->lock);
+
+	for(i = 0; i < engine->num_workers; i++)
+	{
+#ifdef _WIN32
+		WaitForSingleObject(engine->workers[i].thread, INFINITE);
+		CloseHandle(engine->workers[i].thread);
+#else
+		pthread_join(engine->workers[i].thread, NULL);
+#endif
+	}
+
+	//Only now, a worker that is still running may be stealing from any deque.
+	for(i = 0; i < engine->num_workers; i++)
+	{
+		merge_info(total, &engine->workers[i].info);
+		engine_worker_cleanup(&engine->workers[i]);
+	}
+
+	total->manifest_skipped += engine->skipped;
+	total->failed += engine->failed;
+	phase_merge(&total->phases[PHASE_SCAN], &engine->scan);
+	engine_cond_destroy(&engine->wake);
+	engine_cond_destroy(&engine->room);
+	engine_cond_destroy(&engine->idle);
+	engine_mutex_destroy(&engine->lock);
+	free(engine->workers);
+	engine->workers = NULL;
+	engine->num_workers = 0;
+}
+//************************************Conversion engine (End)*********************************************
+
+//************************************Tile pyramid (Start)************************************************
+/*
+Cutting mode, -p source.png with the output folder as path: the source is read once,
+a row at a time, and cut into PYRAMID_TILE_SIZE tiles written to folder/z/x/y.png. The
+deepest zoom holds the source at full size, every zoom above it half the size of the one
+below, down to a single tile at zoom 0. Each zoom keeps one band of tile rows; every two
+rows put into a band are box filtered into one row of the zoom above, so lower zooms never
+read tiles back. Full bands go to the engine tile by tile and are reduced and encoded like
+any other tile. Edges are padded with transparent pixels, every tile has the full size.
+*/
+#define PYRAMID_TILE_SIZE 256
+#define PYRAMID_MAX_ZOOM 24
+#ifndef PATH_MAX
+#define PATH_MAX _MAX_PATH
+#endif
+
+typedef struct _pyramid_level pyramid_level;
+struct _pyramid_level
+{
+	int width; /*pixels at this zoom*/
+	int tiles_x;
+	size_t stride; /*bytes per band row, tiles_x tiles wide*/
+	unsigned char* band; /*PYRAMID_TILE_SIZE rows, transparent where nothing was put*/
+	int rows; /*rows put into the band so far*/
+	int tile_y; /*tile row the band becomes*/
+};
+
+typedef struct _tile_pyramid tile_pyramid;
+struct _tile_pyramid
+{
+	convert_engine* engine;
+	const char* out_dir;
+	int max_zoom;
+	pyramid_level levels[PYRAMID_MAX_ZOOM + 1]; /*by zoom*/
+	unsigned char* row; /*source row as read*/
+	unsigned char* half; /*scratch row for the zoom above*/
+	int tiles;
+};
+
+static void make_dir(const char* path)
+{
+#ifdef _WIN32
+	_mkdir(path);
+#else
+	mkdir(path, 0777);
+#endif
+}
+
+/*
+2x2 box filter of two RGBA rows into one row of out_width pixels. The plain average runs
+over all bytes first, it has no branches and vectorizes; pixels where opaque and
+transparent meet are redone weighted by alpha, so the padding does not darken edges.
+*/
+static void pyramid_downsample(unsigned char* out, const unsigned char* row0, const unsigned char* row1, int out_width)
+{
+	int x, c;
+	for(x = 0; x < out_width; x++)
+	{
+		const unsigned char* p = row0 + x * 8;
+		const unsigned char* q = row1 + x * 8;
+		for(c = 0; c < 4; c++) out[x * 4 + c] = (unsigned char)((p[c] + p[c + 4] + q[c] + q[c + 4] + 2) >> 2);
+	}
+	for(x = 0; x < out_width; x++)
+	{
+		const unsigned char* p = row0 + x * 8;
+		const unsigned char* q = row1 + x * 8;
+		unsigned alpha = p[3] + p[7] + q[3] + q[7];
+		if(alpha == 4 * 255) continue;
+		for(c = 0; c < 3; c++)
+		{
+			out[x * 4 + c] = alpha == 0 ? 0 : (unsigned char)((p[c] * p[3] + p[c + 4] * p[7] + q[c] * q[3]
+				+ q[c + 4] * q[7] + alpha / 2) / alpha);
+		}
+	}
+}
+
+//Hand the band of zoom to the engine as one row of tiles and start the next band.
+static void pyramid_flush(tile_pyramid* pyramid, int zoom)
+{
+	pyramid_level* level = &pyramid->levels[zoom];
+	char path[PATH_MAX];
+	int x;
+	for(x = 0; x < level->tiles_x; x++)
+	{
+		snprintf(path, sizeof(path), "%s/%d/%d/%d.png", pyramid->out_dir, zoom, x, level->tile_y);
+		engine_submit_tile(pyramid->engine, path, level->band + (size_t)x * PYRAMID_TILE_SIZE * 4, level->stride,
+			PYRAMID_TILE_SIZE, PYRAMID_TILE_SIZE);
+		pyramid->tiles++;
+	}
+	memset(level->band, 0, level->stride * PYRAMID_TILE_SIZE);
+	level->rows = 0;
+	level->tile_y++;
+}
+
+//Put the next row of zoom, level->width RGBA pixels, and pass every second row on to the zoom above.
+static void pyramid_put_row(tile_pyramid* pyramid, int zoom, const unsigned char* row)
+{
+	pyramid_level* level = &pyramid->levels[zoom];
+	memcpy(level->band + level->stride * level->rows, row, (size_t)level->width * 4);
+	level->rows++;
+	if(zoom > 0 && level->rows % 2 == 0)
+	{
+		pyramid_downsample(pyramid->half, level->band + level->stride * (level->rows - 2),
+			level->band + level->stride * (level->rows - 1), pyramid->levels[zoom - 1].width);
+		pyramid_put_row(pyramid, zoom - 1, pyramid->half);
+	}
+	if(level->rows == PYRAMID_TILE_SIZE) pyramid_flush(pyramid, zoom);
+}
+
+static int pyramid_init(tile_pyramid* pyramid, convert_engine* engine, const char* out_dir, int width, int height)
+{
+	char path[PATH_MAX];
+	int size = width > height ? width : height;
+	int zoom, x;
+
+	pyramid->engine = engine;
+	pyramid->out_dir = out_dir;
+	pyramid->tiles = 0;
+	for(pyramid->max_zoom = 0; pyramid->max_zoom < PYRAMID_MAX_ZOOM
+		&& ((long long)PYRAMID_TILE_SIZE << pyramid->max_zoom) < size; pyramid->max_zoom++);
+
+	if(!engine->archive) make_dir(out_dir);
+	for(zoom = pyramid->max_zoom; zoom >= 0; zoom--)
+	{
+		pyramid_level* level = &pyramid->levels[zoom];
+		level->width = zoom == pyramid->max_zoom ? width : (pyramid->levels[zoom + 1].width + 1) / 2;
+		level->tiles_x = (level->width + PYRAMID_TILE_SIZE - 1) / PYRAMID_TILE_SIZE;
+		level->stride = (size_t)level->tiles_x * PYRAMID_TILE_SIZE * 4;
+		level->band = (unsigned char*)calloc(PYRAMID_TILE_SIZE, level->stride);
+		level->rows = 0;
+		level->tile_y = 0;
+		if(!level->band) return -1;
+
+		if(engine->archive) continue;
+		snprintf(path, sizeof(path), "%s/%d", out_dir, zoom);
+		make_dir(path);
+		for(x = 0; x < level->tiles_x; x++)
+		{
+			snprintf(path, sizeof(path), "%s/%d/%d", out_dir, zoom, x);
+			make_dir(path);
+		}
+	}
+	pyramid->row = (unsigned char*)malloc((size_t)width * 4);
+	pyramid->half = (unsigned char*)malloc(pyramid->levels[pyramid->max_zoom].stride);
+	return pyramid->row && pyramid->half ? 0 : -1;
+}
+
+//Put the rows that are left, from the deepest zoom up since each one still feeds the next.
+static void pyramid_finish(tile_pyramid* pyramid)
+{
+	int zoom;
+	for(zoom = pyramid->max_zoom; zoom >= 0; zoom--)
+	{
+		pyramid_level* level = &pyramid->levels[zoom];
+		if(zoom > 0 && level->rows % 2 == 1)
+		{
+			memset(pyramid->half, 0, (size_t)level->width * 4);
+			pyramid_put_row(pyramid, zoom, pyramid->half);
+		}
+		if(level->rows > 0) pyramid_flush(pyramid, zoom);
+	}
+}
+
+static void pyramid_cleanup(tile_pyramid* pyramid)
+{
+	int zoom;
+	for(zoom = 0; zoom <= PYRAMID_MAX_ZOOM; zoom++) free(pyramid->levels[zoom].band);
+	free(pyramid->row);
+	free(pyramid->half);
+	free(pyramid);
+}
+
+//Read source once and queue its whole tile pyramid under out_dir. Returns the number of tiles or -1.
+int cut_pyramid(convert_engine* engine, const char* source, const char* out_dir)
+{
+	FILE* fp;
+	png_structp png_ptr;
+	png_infop info_ptr;
+	tile_pyramid* pyramid = (tile_pyramid*)calloc(1, sizeof(tile_pyramid));
+	int tiles;
+	int y;
+
+	fp = fopen(source, "rb");
+	if(!pyramid || !fp)
+	{
+		if(fp) fclose(fp);
+		free(pyramid);
+		return -1;
+	}
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+	info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+	if(!info_ptr || setjmp(png_jmpbuf(png_ptr)))
+	{
+		png_destroy_read_struct(&png_ptr, &info_ptr, 0);
+		fclose(fp);
+		pyramid_cleanup(pyramid);
+		return -1;
+	}
+
+	png_init_io(png_ptr, fp);
+	png_read_info(png_ptr, info_ptr);
+	if(png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE)
+	{
+		png_error(png_ptr, "interlaced sources need the whole image, not supported for cutting");
+	}
+	//Any source becomes 8 bit RGBA, tiles are reduced to what they need later.
+	png_set_expand(png_ptr);
+	png_set_strip_16(png_ptr);
+	png_set_gray_to_rgb(png_ptr);
+	png_set_add_alpha(png_ptr, 0xff, PNG_FILLER_AFTER);
+	png_read_update_info(png_ptr, info_ptr);
+
+	if(pyramid_init(pyramid, engine, out_dir, png_get_image_width(png_ptr, info_ptr),
+		png_get_image_height(png_ptr, info_ptr)) != 0)
+	{
+		png_error(png_ptr, "Out of memory");
+	}
+	for(y = 0; y < (int)png_get_image_height(png_ptr, info_ptr); y++)
+	{
+		png_read_row(png_ptr, pyramid->row, NULL);
+		pyramid_put_row(pyramid, pyramid->max_zoom, pyramid->row);
+	}
+	png_read_end(png_ptr, NULL);
+	png_destroy_read_struct(&png_ptr, &info_ptr, 0);
+	fclose(fp);
+
+	pyramid_finish(pyramid);
+	tiles = pyramid->tiles;
+	pyramid_cleanup(pyramid);
+	return tiles;
+}
+//************************************Tile pyramid (End)**************************************************
+
+
+static int is_png_name(const char* name)
+{
+	size_t len = strlen(name);
+	const char* ext;
+	if(len < 4) return 0;
+	ext = name + len - 4;
+	return ext[0] == '.' && (ext[1] == 'p' || ext[1] == 'P') && (ext[2] == 'n' || ext[2] == 'N')
+		&& (ext[3] == 'g' || ext[3] == 'G');
+}
+
+#ifdef _WIN32
+void convert_folder(convert_engine* engine, const char * dir)
+{
+	intptr_t handle;
+	struct _finddata_t FileInfo;
+	char dirNew[_MAX_PATH];
+	long long start = monotonic_ns();
+	long long spent = 0;
+	if (snprintf(dirNew, sizeof(dirNew), "%s\\*.*", dir) >= (int)sizeof(dirNew))
+		return;
+
+	handle = _findfirst(dirNew, &FileInfo);
+	if (handle == -1)
+		return;
+
+	do
+	{
+		if (strcmp(FileInfo.name, ".") == 0 || strcmp(FileInfo.name, "..") == 0)
+			continue;
+		if (snprintf(dirNew, sizeof(dirNew), "%s\\%s", dir, FileInfo.name) >= (int)sizeof(dirNew))
+			continue;
+
+		if (FileInfo.attrib & _A_SUBDIR)
+		{
+			spent += monotonic_ns() - start; /*subdirectories time themselves*/
+			convert_folder(engine, dirNew);
+			start = monotonic_ns();
 		}
-		else
+		else if(is_png_name(FileInfo.name))
 		{
-			printf("palette color bitdepth error\n");
+			if(engine->manifest && manifest_unchanged(engine->manifest, dirNew, FileInfo.size, FileInfo.time_write))
+				engine->skipped++;
+			else
+				engine_submit(engine, dirNew);
 		}
-		
-		//printf("palette bit_%d= %s\n", mode->bitdepth, file_path);
+	} while (_findnext(handle, &FileInfo) == 0);
 
-	}
-	else if(mode->colortype ==PNG_COLOR_TYPE_RGB)
-	{
-		update_file_type_info(&info.rgb, data);
-		printf("%s colortype = RGB\n",file_path);
-	}
-	else if(mode->colortype == PNG_COLOR_TYPE_RGB_ALPHA)
-	{
-		update_file_type_info(&info.rgba, data);
-		printf("%s colortype = RGBA\n",file_path);
-	}
-	//printf("%s type = %d bit= %d\n",file_path, mode->colortype, mode->bitdepth);
+	_findclose(handle);    // close handle
+	phase_add(&engine->scan, spent + monotonic_ns() - start);
 }
+#elif defined(__linux__)
+/*
+Directory walk on Linux. As many threads as there are workers (-j), the caller of
+convert_folder among them, share a stack of directories still to read. A directory is
+read whole with getdents64 and its entries are told apart by d_type, so the walk itself
+makes no stat calls: only entries of unknown type or symlinks are resolved with fstatat,
+and with a manifest the .png files are, for their size and mtime. Symlinks are followed,
+every directory is fstat'ed once when opened and read only the first time its device
+and inode are seen, so a link back up the tree does not loop. The entries are sorted by
+inode, which on the filesystems we run on is close to their order on disk, then the
+subdirectories go onto the stack and the .png files to the engine in one batch. The
+workers start on a folder as soon as it has been read, while the rest of the tree is
+still being walked.
+*/
+#define SCAN_BUFFER_SIZE 65536 /*getdents64 is given at least this much room*/
 
-int decode_png(char *file_path, LodePNGColorMode* mode_in, LodePNGColorMode* mode_out, auto_pic_data* pic_data)
+//Record as getdents64 returns it, glibc only declares it for _GNU_SOURCE builds.
+typedef struct _scan_dirent scan_dirent;
+struct _scan_dirent
 {
-	png_structp png_ptr;
-	png_infop   info_ptr;
-	char        buf[PNG_BYTES_TO_CHECK];
-	int         temp;
-	FILE *pic_fp;
-
-	int width;
-	int height;
-	png_byte color_type;
-	png_byte bit_depth;
-   png_byte filter_type;
-
-	//*******************************
-    png_byte* in;
-	png_bytep* row_pointer_in;
-	png_bytep* row_pointer_out;
-	//*******************************
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
 
-	pic_fp = fopen(file_path, "rb");
-	if(pic_fp == NULL) 
-		return -1;
+typedef struct _scan_entry scan_entry;
+struct _scan_entry
+{
+	unsigned long long inode;
+	const char* name; /*in the thread's getdents buffer*/
+	int is_dir;
+};
 
-	png_ptr  = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
-	info_ptr = png_create_info_struct(png_ptr);
+//A directory that was read, by device and inode.
+typedef struct _scan_visit scan_visit;
+struct _scan_visit
+{
+	unsigned long long dev;
+	unsigned long long ino; /*0 for a free slot*/
+};
 
-	setjmp(png_jmpbuf(png_ptr)); 
+//A directory still to read, by its full path.
+typedef struct _scan_dir scan_dir;
+struct _scan_dir
+{
+	scan_dir* next;
+	char path[1]; /*allocated to its length*/
+};
 
-	temp = fread(buf,1,PNG_BYTES_TO_CHECK,pic_fp);
-	temp = png_sig_cmp((void*)buf, (png_size_t)0, PNG_BYTES_TO_CHECK);
+typedef struct _dir_scanner dir_scanner;
+struct _dir_scanner
+{
+	convert_engine* engine;
+	engine_mutex lock; /*guards everything below*/
+	engine_cond wake; /*a directory was pushed or the walk is over*/
+	scan_dir* stack;
+	int busy; /*threads reading a directory, they may still push more*/
+	scan_visit* visited; /*open addressing set of the directories read*/
+	size_t visited_slots;
+	size_t visited_count;
+	long long skipped; /*merged from the threads when they end*/
+	long long failed;
+	phase_stats scan;
+};
 
-	if (temp!=0) 
-		return 1;
+//Buffers of one scanning thread, grown to the largest directory and kept.
+typedef struct _scan_state scan_state;
+struct _scan_state
+{
+	char* buffer;
+	size_t buffer_size;
+	scan_entry* entries;
+	size_t entries_capacity;
+	tile_job** jobs;
+	size_t jobs_capacity;
+	long long skipped;
+	long long failed; /*directories not or not fully read for lack of memory*/
+	phase_stats scan;
+};
 
-	rewind(pic_fp);
-	png_init_io(png_ptr, pic_fp);
-	png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_EXPAND, 0);
+static int scan_entry_compare(const void* a, const void* b)
+{
+	unsigned long long x = ((const scan_entry*)a)->inode;
+	unsigned long long y = ((const scan_entry*)b)->inode;
+	return x < y ? -1 : x > y;
+}
 
-	width = png_get_image_width(png_ptr, info_ptr);
-	height = png_get_image_height(png_ptr, info_ptr);
-	color_type = png_get_color_type(png_ptr,info_ptr);
-	bit_depth = png_get_bit_depth(png_ptr, info_ptr);
-	row_pointer_in = png_get_rows(png_ptr, info_ptr);
-   filter_type = png_get_filter_type(png_ptr, info_ptr);
+//Out of memory while walking dir, part of the tree is not converted.
+static void scan_fail(scan_state* state, const char* dir)
+{
+	printf("[scan] Out of memory, %s not fully scanned\n", dir);
+	state->failed++;
+}
 
-	pic_data->height = height;
-	pic_data->width = width;
-	pic_data->src_size = lodepng_filesize(file_path);
-	pic_data->size = pic_data->src_size;
-	pic_data->row_pointers = NULL;
-	//**********************************************************************************
-	color_mode_init(mode_in, color_type, bit_depth);
-    lodepng_color_mode_cleanup(mode_out);
-    lodepng_color_mode_copy(mode_out, mode_in);
-	if(mode_in->colortype !=LCT_RGB && mode_in->colortype !=LCT_RGBA)
+//Remember the directory dev/ino. Returns 1 the first time, 0 if it was read before, -1 out of memory.
+static int scan_visit_dir(dir_scanner* scanner, unsigned long long dev, unsigned long long ino)
+{
+	size_t i;
+	int result = 1;
+	if(ino == 0) ino = ~0ull; /*0 marks free slots*/
+	engine_mutex_lock(&scanner->lock);
+	if(scanner->visited_count * 2 >= scanner->visited_slots)
 	{
-		png_destroy_read_struct(&png_ptr, &info_ptr, 0);
-		fclose(pic_fp);
-		return -1;
+		size_t slots = scanner->visited_slots ? scanner->visited_slots * 2 : 256;
+		scan_visit* grown = (scan_visit*)calloc(slots, sizeof(scan_visit));
+		if(!grown)
+		{
+			engine_mutex_unlock(&scanner->lock);
+			return -1;
+		}
+		for(i = 0; i < scanner->visited_slots; i++)
+		{
+			scan_visit* old = &scanner->visited[i];
+			size_t j;
+			if(!old->ino) continue;
+			j = (size_t)((old->ino ^ old->dev) * 0x9E3779B97F4A7C15ull) & (slots - 1);
+			while(grown[j].ino) j = (j + 1) & (slots - 1);
+			grown[j] = *old;
+		}
+		free(scanner->visited);
+		scanner->visited = grown;
+		scanner->visited_slots = slots;
 	}
-
-	in = malloc_png_bytep(mode_in, width, height);
-   bytepp_to_bytep(mode_in, width, height, in, row_pointer_in);
-	lodepng_auto_choose_color(mode_out, (unsigned char*)in, width, height, mode_in);
-	
-	//if mode_out equal mode_in, no need do anything.
-	if(lodepng_color_mode_equal(mode_out, mode_in))
-	{   
-		png_destroy_read_struct(&png_ptr, &info_ptr, 0);
-		fclose(pic_fp);
-		return -2;
+	i = (size_t)((ino ^ dev) * 0x9E3779B97F4A7C15ull) & (scanner->visited_slots - 1);
+	for(; scanner->visited[i].ino; i = (i + 1) & (scanner->visited_slots - 1))
+	{
+		if(scanner->visited[i].ino == ino && scanner->visited[i].dev == dev)
+		{
+			result = 0;
+			break;
+		}
 	}
-	else
+	if(result)
 	{
-		row_pointer_out = malloc_png_bytepp(mode_out, width, height);
-        auto_convert_data(mode_in, mode_out, width, height, in, row_pointer_out);
-		pic_data->row_pointers = row_pointer_out;
+		scanner->visited[i].dev = dev;
+		scanner->visited[i].ino = ino;
+		scanner->visited_count++;
 	}
-	free(in);
-	//***********************************************************************************
-
-	png_destroy_read_struct(&png_ptr, &info_ptr, 0);
-	fclose(pic_fp);
-	return 0;
-
+	engine_mutex_unlock(&scanner->lock);
+	return result;
 }
 
-int encode_png(char* file_name, LodePNGColorMode* mode, auto_pic_data* pic_data)
+//Push a directory for any thread to read; path is copied.
+static void scan_push(dir_scanner* scanner, scan_state* state, const char* path)
 {
-	int w,h;
-	png_structp png_ptr;
-	png_infop info_ptr; 
-	FILE *fp;
-	h=pic_data->height;
-	w=pic_data->width;
-
-	fp = fopen(file_name, "wb");
-	if (!fp)
+	scan_dir* dir = (scan_dir*)malloc(sizeof(scan_dir) + strlen(path));
+	if(!dir)
 	{
-		printf("[write_png_file] File %s could not be opened for writing", file_name);
-		return -1;
+		scan_fail(state, path);
+		return;
 	}
+	strcpy(dir->path, path);
+	engine_mutex_lock(&scanner->lock);
+	dir->next = scanner->stack;
+	scanner->stack = dir;
+	engine_cond_broadcast(&scanner->wake);
+	engine_mutex_unlock(&scanner->lock);
+}
 
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (!png_ptr)
+//Read all records of the open directory fd into state->buffer. Returns their size in bytes.
+static size_t scan_read(scan_state* state, int fd, const char* dir)
+{
+	size_t used = 0;
+	long n;
+	for(;;)
 	{
-		printf("[write_png_file] png_create_write_struct failed");
-		return -1;
+		if(state->buffer_size - used < SCAN_BUFFER_SIZE)
+		{
+			size_t size = state->buffer_size * 2 + SCAN_BUFFER_SIZE;
+			char* buffer = (char*)realloc(state->buffer, size);
+			if(!buffer)
+			{
+				scan_fail(state, dir);
+				break;
+			}
+			state->buffer = buffer;
+			state->buffer_size = size;
+		}
+		n = syscall(SYS_getdents64, fd, state->buffer + used, state->buffer_size - used);
+		if(n <= 0) break;
+		used += (size_t)n;
 	}
+	return used;
+}
 
-	info_ptr = png_create_info_struct(png_ptr);
-	if (!info_ptr)
+//Read one directory, push its subdirectories and queue its .png files.
+static void scan_directory(dir_scanner* scanner, scan_state* state, const char* dir)
+{
+	convert_engine* engine = scanner->engine;
+	char path[PATH_MAX];
+	struct stat st;
+	size_t size, offset, count = 0, jobs = 0, i;
+	int visit;
+	int fd = openat(AT_FDCWD, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd < 0) return;
+	visit = fstat(fd, &st) != 0 ? -1 : scan_visit_dir(scanner, (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+	if(visit <= 0)
 	{
-		printf("[write_png_file] png_create_info_struct failed");
-		return -1;
+		if(visit < 0) scan_fail(state, dir);
+		close(fd);
+		return;
 	}
 
-	if (setjmp(png_jmpbuf(png_ptr)))
+	size = scan_read(state, fd, dir);
+	for(offset = 0; offset < size; offset += ((scan_dirent*)(state->buffer + offset))->d_reclen)
 	{
-		printf("[write_png_file] Error during init_io");
-		return -1;
+		scan_dirent* record = (scan_dirent*)(state->buffer + offset);
+		const char* name = record->d_name;
+		int is_dir = record->d_type == DT_DIR;
+		if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+		if(record->d_type == DT_UNKNOWN || record->d_type == DT_LNK)
+		{
+			if(fstatat(fd, name, &st, 0) != 0) continue;
+			is_dir = S_ISDIR(st.st_mode);
+			if(!is_dir && !S_ISREG(st.st_mode)) continue;
+		}
+		else if(!is_dir && record->d_type != DT_REG) continue;
+		if(!is_dir && !is_png_name(name)) continue;
+
+		if(count == state->entries_capacity)
+		{
+			size_t capacity = count * 2 + 64;
+			scan_entry* entries = (scan_entry*)realloc(state->entries, capacity * sizeof(scan_entry));
+			if(!entries)
+			{
+				scan_fail(state, dir);
+				break;
+			}
+			state->entries = entries;
+			state->entries_capacity = capacity;
+		}
+		state->entries[count].inode = record->d_ino;
+		state->entries[count].name = name;
+		state->entries[count].is_dir = is_dir;
+		count++;
 	}
-	png_init_io(png_ptr, fp);
+	if(count) qsort(state->entries, count, sizeof(scan_entry), scan_entry_compare);
 
-	if (setjmp(png_jmpbuf(png_ptr)))
+	//Without room for all of them the jobs go to the engine in smaller batches, one by one at worst.
+	if(count > state->jobs_capacity)
 	{
-		printf("[write_png_file] Error during writing header");
-		return -1;
+		tile_job** grown = (tile_job**)realloc(state->jobs, count * sizeof(tile_job*));
+		if(grown)
+		{
+			state->jobs = grown;
+			state->jobs_capacity = count;
+		}
 	}
-
-   png_set_compression_level(png_ptr, 9);
-
-	SetIHDR(png_ptr, info_ptr, mode, w, h);
-	SetPLTE(png_ptr, info_ptr, mode, w, h);
-
-	/* write bytes */
-	if (setjmp(png_jmpbuf(png_ptr)))
+	for(i = 0; i < count; i++)
 	{
-		printf("[write_png_file] Error during writing bytes");
-		return -1;
+		scan_entry* entry = &state->entries[i];
+		if(snprintf(path, sizeof(path), "%s/%s", dir, entry->name) >= (int)sizeof(path)) continue;
+		if(entry->is_dir)
+		{
+			scan_push(scanner, state, path);
+			continue;
+		}
+		if(engine->manifest && fstatat(fd, entry->name, &st, 0) == 0
+			&& manifest_unchanged(engine->manifest, path, st.st_size, manifest_mtime(&st)))
+		{
+			state->skipped++;
+			continue;
+		}
+		if(!state->jobs_capacity)
+		{
+			engine_submit(engine, path);
+			continue;
+		}
+		if(jobs == state->jobs_capacity)
+		{
+			engine_submit_jobs(engine, state->jobs, jobs);
+			jobs = 0;
+		}
+		if((state->jobs[jobs] = file_job(path)) != NULL) jobs++;
+		else engine_drop(engine, path);
 	}
+	close(fd);
+	if(jobs) engine_submit_jobs(engine, state->jobs, jobs);
+}
 
-	png_write_info(png_ptr, info_ptr);
+static void* scan_thread_main(void* arg)
+{
+	dir_scanner* scanner = (dir_scanner*)arg;
+	scan_state state;
+	scan_dir* dir;
+	long long start;
+	memset(&state, 0, sizeof(state));
 
-	/* end write */
-	if (setjmp(png_jmpbuf(png_ptr)))
+	for(;;)
 	{
-		printf("[write_png_file] Error during end of write");
-		return -1;
+		engine_mutex_lock(&scanner->lock);
+		while(!scanner->stack && scanner->busy) engine_cond_wait(&scanner->wake, &scanner->lock);
+		dir = scanner->stack;
+		if(!dir)
+		{
+			engine_mutex_unlock(&scanner->lock);
+			break;
+		}
+		scanner->stack = dir->next;
+		scanner->busy++;
+		engine_mutex_unlock(&scanner->lock);
+
+		start = monotonic_ns();
+		scan_directory(scanner, &state, dir->path);
+		phase_add(&state.scan, monotonic_ns() - start);
+		free(dir);
+
+		engine_mutex_lock(&scanner->lock);
+		scanner->busy--;
+		if(!scanner->stack && !scanner->busy) engine_cond_broadcast(&scanner->wake);
+		engine_mutex_unlock(&scanner->lock);
 	}
 
-	//png_write_image(png_ptr, pic_data->row_pointers);
-	SetIDAT(png_ptr, pic_data->row_pointers, h);
-
-	png_write_end(png_ptr, NULL);
-	fclose(fp);
-
-	pic_data->size = lodepng_filesize(file_name);
+	engine_mutex_lock(&scanner->lock);
+	scanner->skipped += state.skipped;
+	scanner->failed += state.failed;
+	phase_merge(&scanner->scan, &state.scan);
+	engine_mutex_unlock(&scanner->lock);
+	free(state.buffer);
+	free(state.entries);
+	free(state.jobs);
 	return 0;
 }
 
-void convert_png(char* file_path)
+//Walk dir with one thread per worker and queue every .png below it, returns when the walk is done.
+void convert_folder(convert_engine* engine, const char * dir)
 {
-	int i,j;
-	auto_pic_data* pic_data =(auto_pic_data*)malloc(sizeof(auto_pic_data));
-	LodePNGColorMode* mode_out = (LodePNGColorMode*)malloc(sizeof(LodePNGColorMode));
-	LodePNGColorMode* mode_in =(LodePNGColorMode*)malloc(sizeof(LodePNGColorMode));
-	lodepng_color_mode_init(mode_out);
-	lodepng_color_mode_init(mode_in);
-    //printf("%s start\n", file_path);
+	dir_scanner scanner;
+	scan_state first;
+	engine_thread* threads = NULL;
+	int extra = engine->num_workers - 1; /*besides the calling thread*/
+	int started = 0;
+	int i;
 
-	//Only mode_in is different mode_out, return 0, and encode png file again.
-	if(decode_png(file_path, mode_in, mode_out, pic_data) == 0)
+	memset(&scanner, 0, sizeof(scanner));
+	memset(&first, 0, sizeof(first));
+	scanner.engine = engine;
+	engine_mutex_init(&scanner.lock);
+	engine_cond_init(&scanner.wake);
+	scan_push(&scanner, &first, dir);
+	scanner.failed = first.failed;
+
+	if(extra > 0) threads = (engine_thread*)malloc(extra * sizeof(engine_thread));
+	for(i = 0; threads && i < extra; i++)
 	{
-		encode_png(file_path, mode_out, pic_data);
+		if(pthread_create(&threads[started], NULL, scan_thread_main, &scanner) == 0) started++;
 	}
+	scan_thread_main(&scanner);
+	for(i = 0; i < started; i++) pthread_join(threads[i], NULL);
+	free(threads);
+
+	engine->skipped += scanner.skipped;
+	engine_mutex_lock(&engine->lock);
+	engine->failed += scanner.failed;
+	engine_mutex_unlock(&engine->lock);
+	phase_merge(&engine->scan, &scanner.scan);
+	free(scanner.visited);
+	engine_cond_destroy(&scanner.wake);
+	engine_mutex_destroy(&scanner.lock);
+}
+#else
+void convert_folder(convert_engine* engine, const char * dir)
+{
+	DIR* handle;
+	struct dirent* entry;
+	struct stat st;
+	char dirNew[PATH_MAX];
+	long long start = monotonic_ns();
+	long long spent = 0;
+
+	handle = opendir(dir);
+	if (handle == NULL)
+		return;
 
-	update_info(file_path, mode_out, pic_data);
-	//printf("%s end\n", file_path);
+	while ((entry = readdir(handle)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		if (snprintf(dirNew, sizeof(dirNew), "%s/%s", dir, entry->d_name) >= (int)sizeof(dirNew))
+			continue;
+		if (stat(dirNew, &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+		{
+			spent += monotonic_ns() - start; /*subdirectories time themselves*/
+			convert_folder(engine, dirNew);
+			start = monotonic_ns();
+		}
+		else if (is_png_name(entry->d_name))
+		{
+			if (engine->manifest && manifest_unchanged(engine->manifest, dirNew, st.st_size, manifest_mtime(&st)))
+				engine->skipped++;
+			else
+				engine_submit(engine, dirNew);
+		}
+	}
 
-	free_png_bytepp(pic_data->height, pic_data->row_pointers);
-	lodepng_free(pic_data);
-	lodepng_color_mode_cleanup(mode_out);
-	lodepng_color_mode_cleanup(mode_in);
+	closedir(handle);
+	phase_add(&engine->scan, spent + monotonic_ns() - start);
 }
+#endif
+
+//************************************Service mode (Start)************************************************
+/*
+Service mode, -S - for stdin and stdout or -S socket for a Unix domain socket: instead of
+one folder per process the engine stays up and takes jobs, one per line, so the workers
+keep their arenas, imagequant settings, buffers, templates and the cache warm between
+jobs. A job is the path of a tile or of a folder; "quit" ends the service. While a job
+runs every tile sends back a line, then the job ends with a done line, all tab separated:
+
+	tile	path	result	colortype	bitdepth	src_size	size	read_ns	profile_ns	convert_ns	deflate_ns	write_ns
+	done	job	tiles	wall_ns
+
+result is what decode_png returned, 0 converted, -2 kept as it was, 2 cache hit, 3 uniform.
+On stdin the tool's own output moves to stderr so after the start line stdout carries only results.
+Clients on the socket are served one after the other.
+*/
 
-void convert_folder(const char * dir)
+//Write the result line of a finished tile, called by the worker that converted it.
+static void service_report(convert_worker* worker, const char* file_path, int result)
 {
-	long handle;
-	struct _finddata_t FileInfo;
-	char dirNew[_MAX_PATH];
-	char ext[10];
-	strcpy(dirNew, dir);
-	strcat(dirNew, "\\*.*");
+	convert_engine* engine = worker->engine;
+	long long ns[PHASE_COUNT];
+	int i;
+	if(!engine->results) return;
+	for(i = 0; i < PHASE_COUNT; i++) ns[i] = worker->tile_ns[i] < 0 ? 0 : worker->tile_ns[i];
+
+	engine_mutex_lock(&engine->lock);
+	fprintf(engine->results, "tile\t%s\t%d\t%d\t%u\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld\n", file_path, result,
+		(int)worker->mode_out.colortype, worker->mode_out.bitdepth, worker->pic_data.src_size, worker->pic_data.size,
+		ns[PHASE_READ], ns[PHASE_PROFILE], ns[PHASE_CONVERT], ns[PHASE_DEFLATE], ns[PHASE_WRITE]);
+	engine->reported++;
+	engine_mutex_unlock(&engine->lock);
+}
 
-	handle = _findfirst(dirNew, &FileInfo);
-	if (handle == -1)
-		return;
+//Run the jobs read from in until the end of in or "quit", results go to out. Returns 1 after "quit".
+static int service_run(convert_engine* engine, FILE* in, FILE* out)
+{
+	char line[PATH_MAX + 2];
+	struct stat st;
+	int quit = 0;
 
-	do
+	engine->results = out;
+	while(!quit && fgets(line, sizeof(line), in))
 	{
-		if (FileInfo.attrib & _A_SUBDIR)
+		size_t len = strcspn(line, "\r\n");
+		long long start = monotonic_ns();
+		size_t reported;
+		line[len] = 0;
+		if(len == 0) continue;
+		if(strcmp(line, "quit") == 0)
 		{
-			if (strcmp(FileInfo.name, ".") == 0 || strcmp(FileInfo.name, "..") == 0)
-				continue;
+			quit = 1;
+			break;
+		}
 
-			strcpy(dirNew, dir);
-			strcat(dirNew, "\\");
-			strcat(dirNew, FileInfo.name);
-			convert_folder(dirNew);
+		engine_mutex_lock(&engine->lock);
+		reported = engine->reported;
+		engine_mutex_unlock(&engine->lock);
+		if(stat(line, &st) != 0)
+		{
+			fprintf(out, "error\t%s\tnot found\n", line);
+			fflush(out);
+			continue;
 		}
-		else
+		if(S_ISDIR(st.st_mode)) convert_folder(engine, line);
+		else engine_submit(engine, line);
+		engine_wait(engine);
+
+		//The workers are idle now, nothing else writes to out.
+		fprintf(out, "done\t%s\t%lld\t%lld\n", line, (long long)(engine->reported - reported), monotonic_ns() - start);
+		fflush(out);
+		if(ferror(out))
 		{
-			//cout << findData.name << "\t" << findData.size << " bytes.\n";
-			strcpy(dirNew, dir);
-			strcat(dirNew, "\\");
-			strcat(dirNew, FileInfo.name);
+			//The client went away, the job itself was done.
+			printf("[service] client gone after %s\n", line);
+			break;
+		}
+	}
+	engine->results = NULL;
+	return quit;
+}
+
+//Serve jobs until "quit" or, on stdin, its end. Returns 0 or -1 if the service could not start.
+int service(convert_engine* engine, const char* socket_path)
+{
+#ifndef _WIN32
+	//A client that hangs up makes writes fail with EPIPE instead of killing the service.
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	if(strcmp(socket_path, "-") == 0)
+	{
+		//Results own stdout, everything else printed from now on goes to stderr.
+		int result = -1;
+		FILE* out;
+		fflush(stdout);
+#ifdef _WIN32
+		out = _fdopen(_dup(_fileno(stdout)), "w");
+		if(out) _dup2(_fileno(stderr), _fileno(stdout));
+#else
+		out = fdopen(dup(fileno(stdout)), "w");
+		if(out) dup2(fileno(stderr), fileno(stdout));
+#endif
+		if(!out) return -1;
+		service_run(engine, stdin, out);
+		result = ferror(out) ? -1 : 0;
+		fclose(out);
+		return result;
+	}
+#ifdef _WIN32
+	printf("service sockets are not supported on Windows, use -S -\n");
+	return -1;
+#else
+	{
+		struct sockaddr_un address;
+		struct stat st;
+		int listener;
+		int quit = 0;
 
-			_splitpath(dirNew,NULL,NULL,NULL,ext);
-			if(strnicmp(ext,".png",10) == 0)
+		//Only a socket left by an earlier run is replaced, never another file.
+		if(lstat(socket_path, &st) == 0)
+		{
+			if(!S_ISSOCK(st.st_mode))
 			{
-				convert_png(dirNew);
-				//test_info(dirNew);
+				printf("%s exists and is not a socket\n", socket_path);
+				return -1;
 			}
+			unlink(socket_path);
 		}
-	} while (_findnext(handle, &FileInfo) == 0);
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(listener < 0 || strlen(socket_path) >= sizeof(address.sun_path))
+		{
+			if(listener >= 0) close(listener);
+			return -1;
+		}
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		strcpy(address.sun_path, socket_path);
+		if(bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 4) != 0)
+		{
+			close(listener);
+			return -1;
+		}
+		printf("serving on %s\n", socket_path);
+		fflush(stdout);
 
-	_findclose(handle);    // close handle
+		while(!quit)
+		{
+			FILE* in;
+			FILE* out;
+			int client = accept(listener, NULL, NULL);
+			if(client < 0) break;
+			in = fdopen(client, "r");
+			out = in ? fdopen(dup(client), "w") : NULL;
+			if(in && out) quit = service_run(engine, in, out);
+			if(out) fclose(out);
+			if(in) fclose(in);
+			else close(client);
+		}
+		close(listener);
+		unlink(socket_path);
+		return 0;
+	}
+#endif
 }
+//************************************Service mode (End)**************************************************
 
 
 int test_info(char *file_path)
@@ -1953,27 +5655,141 @@ int test_info(char *file_path)
 //*************************************Only for testing (End)*********************************************** 
 
 
+static void usage(void)
+{
+	printf("pngtest.exe [-j threads] [-c cache_mb] [-l] [-m manifest] [-r report.json] [-t zero|up] [-s budget_ms] [-b band_mb] [-p source.png] [-a archive] [-S -|socket] path of tiles file folder (output folder with -p)\n");
+	printf("pngtest.exe -x archive tile out.png (tile as stored, or z/x/y)\n");
+}
+
 int main(int argc, char *argv[])
 {
 	unsigned char* data = 0;
     clock_t begin, end;
 	double cost;
+	int i;
+	const char* folder = "D:\\testing";
+	int threads = engine_default_threads();
+	int cache_mb = TILE_CACHE_DEFAULT_MB;
+	int hardlink = 0;
+	const char* manifest_path = NULL;
+	const char* report_path = NULL;
+	int clean = CLEAN_NONE;
+	long long search_ns = 0;
+	int band_mb = STREAM_DEFAULT_MB;
+	const char* pyramid_source = NULL;
+	const char* archive_path = NULL;
+	const char* service_socket = NULL;
+	long long wall_start = monotonic_ns();
+	double wall;
+	convert_engine engine;
+	tile_cache cache;
+	tile_manifest manifest;
+	tile_archive archive;
+
+	for(i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			cache_mb = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-l") == 0)
+			hardlink = 1;
+		else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+			manifest_path = argv[++i];
+		else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+			report_path = argv[++i];
+		else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+		{
+			i++;
+			if(strcmp(argv[i], "up") == 0) clean = CLEAN_UP;
+			else if(strcmp(argv[i], "zero") == 0) clean = CLEAN_ZERO;
+			else
+			{
+				printf("-t takes zero or up, not %s\n", argv[i]);
+				usage();
+				return -1;
+			}
+		}
+		else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+		{
+			//Per tile budget in ms, 0 tries every setting.
+			int ms = atoi(argv[++i]);
+			search_ns = ms > 0 ? ms * 1000000LL : LLONG_MAX;
+		}
+		else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+			band_mb = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+			pyramid_source = argv[++i];
+		else if(strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+			archive_path = argv[++i];
+		else if(strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+			service_socket = argv[++i];
+		else if(strcmp(argv[i], "-x") == 0 && i + 3 < argc)
+		{
+			i += 3;
+			return tile_archive_extract(argv[i - 2], argv[i - 1], argv[i]) == 0 ? 0 : -1;
+		}
+		else
+			folder = argv[i];
+	}
+
 	begin =clock();
-	init_info();
+	init_info(&info);
 	printf("start\n");
 
 	/*if(argc!=2)
 	{
-	printf("pngtest.exe path of tiles file folder\n");
+	printf("pngtest.exe [-j threads] [-c cache_mb] [-l] [-m manifest] [-r report.json] [-t zero|up] [-s budget_ms] [-b band_mb] [-p source.png] [-a archive] [-S -|socket] path of tiles file folder (output folder with -p)\n");
 	return -1;
-	}
-	convert_folder(argv[1]);*/
+	}*/
 
 	//********************Covert PNG**************************
-	//convert_png("D:\\testing");
-	convert_folder("D:\\testing");
-	//convert_png("D:\\3_2.png");
-     //convert_png("D:\\3_2.png");
+	if(tile_cache_init(&cache, cache_mb > 0 ? (size_t)cache_mb << 20 : 0, hardlink) != 0)
+	{
+		printf("could not allocate the tile cache\n");
+		return -1;
+	}
+	if(archive_path && manifest_path)
+	{
+		printf("the archive needs every tile, the manifest %s is not used\n", manifest_path);
+		manifest_path = NULL;
+	}
+	if(archive_path && tile_archive_create(&archive, archive_path, folder) != 0)
+	{
+		printf("could not create the archive %s\n", archive_path);
+		return -1;
+	}
+	if(manifest_path && manifest_open(&manifest, manifest_path) != 0)
+	{
+		printf("could not open the manifest %s\n", manifest_path);
+		return -1;
+	}
+	if(engine_start(&engine, threads, &cache, manifest_path ? &manifest : NULL, clean, search_ns,
+		band_mb > 0 ? (size_t)band_mb << 20 : 0, archive_path ? &archive : NULL) != 0)
+	{
+		printf("could not start %d conversion threads\n", threads);
+		return -1;
+	}
+	if(service_socket)
+	{
+		if(service(&engine, service_socket) != 0) printf("could not serve on %s\n", service_socket);
+	}
+	else if(pyramid_source)
+	{
+		if(cut_pyramid(&engine, pyramid_source, folder) < 0) printf("could not cut %s\n", pyramid_source);
+	}
+	else
+	{
+		convert_folder(&engine, folder);
+	}
+	engine_finish(&engine, &info);
+	tile_cache_cleanup(&cache);
+	if(manifest_path) manifest_close(&manifest);
+	if(archive_path)
+	{
+		printf("Archive     : %3lld   tiles in %lld blobs\n\n", (long long)archive.count, (long long)archive.num_blobs);
+		if(tile_archive_close(&archive) != 0) printf("could not write the archive %s\n", archive_path);
+	}
 
 	free(data);
 
@@ -1983,8 +5799,14 @@ int main(int argc, char *argv[])
 	//***********************end Covert PNG******************
 	end = clock();
 	cost = (double)(end - begin)/CLOCKS_PER_SEC;
+	wall = (monotonic_ns() - wall_start) / 1e9;
 	printf("end\n");
 	display_info();
+	if(report_path && write_report(report_path, wall) != 0)
+	{
+		printf("could not write the report %s\n", report_path);
+	}
+	printf("wall time is: %lf secs\n", wall);
 	printf("constant CLOCKS_PER_SEC is: %ld, time cost is: %lf secs", CLOCKS_PER_SEC, cost);
 	return 0;
-}
\ No newline at end of file
+}
@@ -30,7 +30,8 @@
 
 #include "zutil.h"      /* for STDC and FAR definitions */
 
-/* Definitions for doing the crc four data bytes at a time. */
+/* Definitions for doing the crc four data bytes at a time.  On little-endian
+   machines sixteen bytes are taken at a time, using sixteen tables. */
 #if !defined(NOBYFOUR) && defined(Z_U4)
 #  define BYFOUR
 #endif
@@ -44,6 +45,30 @@
 #  define TBLS 1
 #endif /* BYFOUR */
 
+/* Definitions for folding the crc with carry-less multiplication on x86
+   processors with PCLMULQDQ, chosen when the crc is computed if the processor
+   has the instruction.  #define NOPCLMUL to leave it out. */
+#if !defined(NOPCLMUL) && defined(BYFOUR) && \
+    (defined(__x86_64__) || defined(__i386__) || \
+     defined(_M_X64) || defined(_M_IX86))
+#  if defined(__GNUC__) || defined(__clang__)
+#    include <cpuid.h>
+#    include <immintrin.h>
+#    define PCLMUL
+#    define PCLMUL_TARGET __attribute__((target("sse2,pclmul")))
+#  elif defined(_MSC_VER)
+#    include <intrin.h>
+#    define PCLMUL
+#    define PCLMUL_TARGET
+#  endif
+#endif
+#ifdef PCLMUL
+#  define PCLMUL_MIN 64     /* the folding needs at least 64 bytes */
+   local int x86_has_pclmul OF((void));
+   local z_crc_t crc32_pclmul OF((z_crc_t, const unsigned char FAR *,
+                        z_size_t));
+#endif /* PCLMUL */
+
 /* Local functions for crc concatenation */
 local unsigned long gf2_matrix_times OF((unsigned long *mat,
                                          unsigned long vec));
@@ -55,6 +80,9 @@ local uLong crc32_combine_ OF((uLong crc1, uLong crc2, z_off64_t len2));
 
 local volatile int crc_table_empty = 1;
 local z_crc_t FAR crc_table[TBLS][256];
+#ifdef BYFOUR
+local z_crc_t FAR crc_slice_table[16][256];
+#endif /* BYFOUR */
 local void make_crc_table OF((void));
 #ifdef MAKECRCH
    local void write_table OF((FILE *, const z_crc_t FAR *));
@@ -125,6 +153,17 @@ local void make_crc_table()
                 crc_table[k + 4][n] = ZSWAP32(c);
             }
         }
+
+        /* generate crc for each value followed by zero to fifteen zeros, for
+           taking sixteen bytes at a time on little-endian machines */
+        for (n = 0; n < 256; n++) {
+            c = crc_table[0][n];
+            crc_slice_table[0][n] = c;
+            for (k = 1; k < 16; k++) {
+                c = crc_table[0][c & 0xff] ^ (c >> 8);
+                crc_slice_table[k][n] = c;
+            }
+        }
 #endif /* BYFOUR */
 
         crc_table_empty = 0;
@@ -156,6 +195,17 @@ local void make_crc_table()
         fprintf(out, "#endif\n");
 #  endif /* BYFOUR */
         fprintf(out, "  }\n};\n");
+#  ifdef BYFOUR
+        fprintf(out, "\n#ifdef BYFOUR\n\n");
+        fprintf(out, "local const z_crc_t FAR ");
+        fprintf(out, "crc_slice_table[16][256] =\n{\n  {\n");
+        write_table(out, crc_slice_table[0]);
+        for (k = 1; k < 16; k++) {
+            fprintf(out, "  },\n  {\n");
+            write_table(out, crc_slice_table[k]);
+        }
+        fprintf(out, "  }\n};\n\n#endif\n");
+#  endif /* BYFOUR */
         fclose(out);
     }
 #endif /* MAKECRCH */
@@ -215,6 +265,17 @@ unsigned long ZEXPORT crc32_z(crc, buf, len)
     if (sizeof(void *) == sizeof(ptrdiff_t)) {
         z_crc_t endian;
 
+#ifdef PCLMUL
+        /* fold whole 16-byte blocks, leaving the rest to the tables */
+        if (len >= PCLMUL_MIN && x86_has_pclmul()) {
+            z_size_t blocks = len & ~(z_size_t)15;
+
+            crc = (unsigned long)~crc32_pclmul(~(z_crc_t)crc, buf, blocks);
+            buf += blocks;
+            len -= blocks;
+        }
+#endif /* PCLMUL */
+
         endian = 1;
         if (*((unsigned char *)(&endian)))
             return crc32_little(crc, buf, len);
@@ -258,9 +319,29 @@ unsigned long ZEXPORT crc32(crc, buf, len)
 
 /* ========================================================================= */
 #define DOLIT4 c ^= *buf4++; \
-        c = crc_table[3][c & 0xff] ^ crc_table[2][(c >> 8) & 0xff] ^ \
-            crc_table[1][(c >> 16) & 0xff] ^ crc_table[0][c >> 24]
-#define DOLIT32 DOLIT4; DOLIT4; DOLIT4; DOLIT4; DOLIT4; DOLIT4; DOLIT4; DOLIT4
+        c = crc_slice_table[3][c & 0xff] ^ \
+            crc_slice_table[2][(c >> 8) & 0xff] ^ \
+            crc_slice_table[1][(c >> 16) & 0xff] ^ \
+            crc_slice_table[0][c >> 24]
+#define DOLIT16 c ^= *buf4++; \
+        c = crc_slice_table[15][c & 0xff] ^ \
+            crc_slice_table[14][(c >> 8) & 0xff] ^ \
+            crc_slice_table[13][(c >> 16) & 0xff] ^ \
+            crc_slice_table[12][c >> 24] ^ \
+            crc_slice_table[11][buf4[0] & 0xff] ^ \
+            crc_slice_table[10][(buf4[0] >> 8) & 0xff] ^ \
+            crc_slice_table[9][(buf4[0] >> 16) & 0xff] ^ \
+            crc_slice_table[8][buf4[0] >> 24] ^ \
+            crc_slice_table[7][buf4[1] & 0xff] ^ \
+            crc_slice_table[6][(buf4[1] >> 8) & 0xff] ^ \
+            crc_slice_table[5][(buf4[1] >> 16) & 0xff] ^ \
+            crc_slice_table[4][buf4[1] >> 24] ^ \
+            crc_slice_table[3][buf4[2] & 0xff] ^ \
+            crc_slice_table[2][(buf4[2] >> 8) & 0xff] ^ \
+            crc_slice_table[1][(buf4[2] >> 16) & 0xff] ^ \
+            crc_slice_table[0][buf4[2] >> 24]; \
+        buf4 += 3
+#define DOLIT64 DOLIT16; DOLIT16; DOLIT16; DOLIT16
 
 /* ========================================================================= */
 local unsigned long crc32_little(crc, buf, len)
@@ -274,14 +355,18 @@ local unsigned long crc32_little(crc, buf, len)
     c = (z_crc_t)crc;
     c = ~c;
     while (len && ((ptrdiff_t)buf & 3)) {
-        c = crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+        c = crc_slice_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
         len--;
     }
 
     buf4 = (const z_crc_t FAR *)(const void FAR *)buf;
-    while (len >= 32) {
-        DOLIT32;
-        len -= 32;
+    while (len >= 64) {
+        DOLIT64;
+        len -= 64;
+    }
+    while (len >= 16) {
+        DOLIT16;
+        len -= 16;
     }
     while (len >= 4) {
         DOLIT4;
@@ -290,7 +375,7 @@ local unsigned long crc32_little(crc, buf, len)
     buf = (const unsigned char FAR *)buf4;
 
     if (len) do {
-        c = crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+        c = crc_slice_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
     } while (--len);
     c = ~c;
     return (unsigned long)c;
@@ -338,6 +423,128 @@ local unsigned long crc32_big(crc, buf, len)
 
 #endif /* BYFOUR */
 
+#ifdef PCLMUL
+
+/* ========================================================================= */
+local int x86_has_pclmul()
+{
+    /* threads may race to set this, they all store the same value, so
+       relaxed atomic loads and stores are enough */
+    static long has_pclmul = -1;
+#  ifdef _MSC_VER
+    int has = (int)_InterlockedCompareExchange(&has_pclmul, -1, -1);
+#  else
+    int has = (int)__atomic_load_n(&has_pclmul, __ATOMIC_RELAXED);
+#  endif
+
+    if (has < 0) {
+#  ifdef _MSC_VER
+        int info[4];
+
+        __cpuid(info, 1);
+        has = (info[2] >> 1) & 1;
+#  else
+        unsigned int eax, ebx, ecx, edx;
+
+        has = __get_cpuid(1, &eax, &ebx, &ecx, &edx) ? (int)(ecx >> 1) & 1 : 0;
+#  endif
+#  ifdef _MSC_VER
+        _InterlockedExchange(&has_pclmul, (long)has);
+#  else
+        __atomic_store_n(&has_pclmul, (long)has, __ATOMIC_RELAXED);
+#  endif
+    }
+    return has;
+}
+
+/*
+   Fold the crc register c (not inverted) over len bytes, a multiple of 16
+   and at least 64, and return the register for the crc of the data so far.
+
+   This is the method of "Fast CRC Computation for Generic Polynomials Using
+   PCLMULQDQ Instruction" (Intel, 2009) for the bit-reflected crc: four 128-bit
+   lanes are carried along, each multiplied by x^512 mod p as the next 64 bytes
+   are added, then folded into one lane with x^128 mod p, reduced to 64 bits
+   and by Barrett reduction to the 32-bit remainder.  The constants are the
+   reflected values x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32) and
+   x^64 mod p, then p itself and floor(x^64 / p).
+ */
+PCLMUL_TARGET local z_crc_t crc32_pclmul(c, buf, len)
+    z_crc_t c;
+    const unsigned char FAR *buf;
+    z_size_t len;
+{
+    __m128i k, x0, x1, x2, x3, t0, t1, t2, t3, mask;
+
+    x0 = _mm_loadu_si128((const __m128i *)(const void FAR *)buf);
+    x1 = _mm_loadu_si128((const __m128i *)(const void FAR *)(buf + 16));
+    x2 = _mm_loadu_si128((const __m128i *)(const void FAR *)(buf + 32));
+    x3 = _mm_loadu_si128((const __m128i *)(const void FAR *)(buf + 48));
+    x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128((int)c));
+    buf += 64;
+    len -= 64;
+
+    /* four lanes, 64 bytes at a time */
+    k = _mm_setr_epi32(0x54442bd4, 1, (int)0xc6e41596UL, 1);
+    while (len >= 64) {
+        t0 = _mm_clmulepi64_si128(x0, k, 0x00);
+        t1 = _mm_clmulepi64_si128(x1, k, 0x00);
+        t2 = _mm_clmulepi64_si128(x2, k, 0x00);
+        t3 = _mm_clmulepi64_si128(x3, k, 0x00);
+        x0 = _mm_clmulepi64_si128(x0, k, 0x11);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+        x0 = _mm_xor_si128(_mm_xor_si128(x0, t0),
+            _mm_loadu_si128((const __m128i *)(const void FAR *)buf));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, t1),
+            _mm_loadu_si128((const __m128i *)(const void FAR *)(buf + 16)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, t2),
+            _mm_loadu_si128((const __m128i *)(const void FAR *)(buf + 32)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, t3),
+            _mm_loadu_si128((const __m128i *)(const void FAR *)(buf + 48)));
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one, then take the rest 16 bytes at a time */
+    k = _mm_setr_epi32((int)0x751997d0UL, 1, (int)0xccaa009eUL, 0);
+    t0 = _mm_clmulepi64_si128(x0, k, 0x00);
+    x0 = _mm_clmulepi64_si128(x0, k, 0x11);
+    x0 = _mm_xor_si128(_mm_xor_si128(x0, t0), x1);
+    t0 = _mm_clmulepi64_si128(x0, k, 0x00);
+    x0 = _mm_clmulepi64_si128(x0, k, 0x11);
+    x0 = _mm_xor_si128(_mm_xor_si128(x0, t0), x2);
+    t0 = _mm_clmulepi64_si128(x0, k, 0x00);
+    x0 = _mm_clmulepi64_si128(x0, k, 0x11);
+    x0 = _mm_xor_si128(_mm_xor_si128(x0, t0), x3);
+    while (len >= 16) {
+        t0 = _mm_clmulepi64_si128(x0, k, 0x00);
+        x0 = _mm_clmulepi64_si128(x0, k, 0x11);
+        x0 = _mm_xor_si128(_mm_xor_si128(x0, t0),
+            _mm_loadu_si128((const __m128i *)(const void FAR *)buf));
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 bits to 64 */
+    mask = _mm_setr_epi32(-1, 0, -1, 0);
+    x0 = _mm_xor_si128(_mm_clmulepi64_si128(x0, k, 0x10),
+        _mm_srli_si128(x0, 8));
+    k = _mm_setr_epi32(0x63cd6124, 1, 0, 0);
+    x0 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x0, mask), k, 0x00),
+        _mm_srli_si128(x0, 4));
+
+    /* Barrett reduction to 32 bits */
+    k = _mm_setr_epi32((int)0xdb710641UL, 1, (int)0xf7011641UL, 1);
+    x1 = _mm_and_si128(_mm_clmulepi64_si128(_mm_and_si128(x0, mask), k, 0x10),
+        mask);
+    x0 = _mm_xor_si128(x0, _mm_clmulepi64_si128(x1, k, 0x00));
+    return (z_crc_t)_mm_cvtsi128_si32(_mm_srli_si128(x0, 4));
+}
+
+#endif /* PCLMUL */
+
 #define GF2_DIM 32      /* dimension of GF(2) vectors (length of CRC) */
 
 /* ========================================================================= */
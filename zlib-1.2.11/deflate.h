@@ -108,7 +108,8 @@ typedef struct internal_state {
     gz_headerp  gzhead;  /* gzip header information to write */
     ulg   gzindex;       /* where in extra, name, or comment */
     Byte  method;        /* can only be DEFLATED */
-    int   last_flush;    /* value of flush param for previous deflate call */
+    int   last_flush;    /* value of flush param for previous deflate call,
+                          * -2 if deflate() was not called since a reset */
 
                 /* used by deflate.c: */
 
@@ -0,0 +1,189 @@
+/* crcbench.c -- check crc32_z() and measure its speed
+ * For conditions of distribution and use, see copyright notice in zlib.h
+ */
+
+/* crcbench checks crc32_z() against a bit at a time crc over every length up
+   to 1 KB at every alignment, in one call and split in two, then prints the
+   speed for lengths from 16 bytes to 1 MB.  That covers the table code and,
+   where the processor has PCLMULQDQ, the folding code and the switch between
+   them.  Next to each speed is that of the zlib 1.2.11 crc32(), four tables a
+   word at a time, copied below as the baseline; both must give the same crc.
+   With -c only the check is run, as "make test" and ctest do. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "zlib.h"
+
+#define local static
+
+#define CHECK_MAX 1024          /* longest buffer checked */
+#define BENCH_MAX (1L << 20)    /* longest buffer timed */
+#define BENCH_BYTES 1000000000.0 /* about this much data for each length */
+
+/* reference crc, one bit at a time */
+local unsigned long crc_bitwise(unsigned long crc, const unsigned char *buf,
+                                size_t len)
+{
+    int k;
+
+    crc = ~crc & 0xffffffffUL;
+    while (len--) {
+        crc ^= *buf++;
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xedb88320UL : crc >> 1;
+    }
+    return ~crc & 0xffffffffUL;
+}
+
+/* zlib 1.2.11 crc32_little(), or its byte loop where words are not four
+   little-endian bytes */
+local unsigned int crc_table_old[4][256];
+
+local void make_crc_table_old(void)
+{
+    unsigned int c;
+    int n, k;
+
+    for (n = 0; n < 256; n++) {
+        c = (unsigned int)n;
+        for (k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+        crc_table_old[0][n] = c;
+    }
+    for (n = 0; n < 256; n++) {
+        c = crc_table_old[0][n];
+        for (k = 1; k < 4; k++) {
+            c = crc_table_old[0][c & 0xff] ^ (c >> 8);
+            crc_table_old[k][n] = c;
+        }
+    }
+}
+
+#define DOLIT4 c ^= *buf4++; \
+        c = crc_table_old[3][c & 0xff] ^ crc_table_old[2][(c >> 8) & 0xff] ^ \
+            crc_table_old[1][(c >> 16) & 0xff] ^ crc_table_old[0][c >> 24]
+#define DOLIT32 DOLIT4; DOLIT4; DOLIT4; DOLIT4; DOLIT4; DOLIT4; DOLIT4; DOLIT4
+
+local unsigned long crc_old(unsigned long crc, const unsigned char *buf,
+                            size_t len)
+{
+    static const unsigned int one = 1;
+    unsigned int c;
+    const unsigned int *buf4;
+
+    c = ~(unsigned int)crc;
+    if (sizeof(unsigned int) == 4 && *(const unsigned char *)&one == 1) {
+        while (len && ((size_t)buf & 3)) {
+            c = crc_table_old[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+            len--;
+        }
+        buf4 = (const unsigned int *)(const void *)buf;
+        while (len >= 32) {
+            DOLIT32;
+            len -= 32;
+        }
+        while (len >= 4) {
+            DOLIT4;
+            len -= 4;
+        }
+        buf = (const unsigned char *)buf4;
+    }
+    while (len--)
+        c = crc_table_old[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+    return (unsigned long)~c & 0xffffffffUL;
+}
+
+/* return the number of mismatches found */
+local int check(const unsigned char *data)
+{
+    size_t len, off, split;
+    unsigned long want, got;
+    int bad = 0;
+
+    for (off = 0; off < 16; off++)
+        for (len = 0; len <= CHECK_MAX; len++) {
+            want = crc_bitwise(0, data + off, len);
+            got = crc32_z(0, data + off, len);
+            split = len / 3;
+            if (crc_old(0, data + off, len) != want) {
+                if (bad < 10)
+                    fprintf(stderr, "baseline mismatch: offset %u length %u\n",
+                            (unsigned)off, (unsigned)len);
+                bad++;
+            }
+            if (got != want ||
+                crc32_z(crc32_z(0, data + off, split), data + off + split,
+                        len - split) != want) {
+                if (bad < 10)
+                    fprintf(stderr, "crc32_z mismatch: offset %u length %u\n",
+                            (unsigned)off, (unsigned)len);
+                bad++;
+            }
+        }
+    return bad;
+}
+
+/* GB/s of reps crcs of len bytes that took secs */
+local double rate(long len, long reps, double secs)
+{
+    return secs > 0 ? (double)len * reps / secs / 1e9 : 0.0;
+}
+
+/* return the number of lengths where the two crcs differ */
+local int bench(const unsigned char *data)
+{
+    long len;
+    long reps, n;
+    unsigned long crc, old;
+    clock_t start;
+    double secs, old_secs;
+    int bad = 0;
+
+    printf("   length    crc32_z     1.2.11  speedup\n");
+    for (len = 16; len <= BENCH_MAX; len <<= 2) {
+        reps = (long)(BENCH_BYTES / (len + 32)) + 1;
+        crc = 0;
+        start = clock();
+        for (n = 0; n < reps; n++)
+            crc = crc32_z(crc, data + (n & 1), (z_size_t)len);
+        secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+        old = 0;
+        start = clock();
+        for (n = 0; n < reps; n++)
+            old = crc_old(old, data + (n & 1), (size_t)len);
+        old_secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+        printf("%9ld %5.2f GB/s %5.2f GB/s %7.2fx%s\n", len,
+               rate(len, reps, secs), rate(len, reps, old_secs),
+               secs > 0 ? old_secs / secs : 0.0,
+               crc == old ? "" : "  crc mismatch");
+        if (crc != old)
+            bad++;
+    }
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned char *data;
+    long i;
+    int bad;
+
+    data = malloc(BENCH_MAX + 16);
+    if (data == NULL) {
+        fprintf(stderr, "crcbench: out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < BENCH_MAX + 16; i++)
+        data[i] = (unsigned char)(i * 7 + (i >> 9));
+
+    make_crc_table_old();
+    bad = check(data);
+    if (bad)
+        fprintf(stderr, "crcbench: %d mismatches\n", bad);
+    else if (argc < 2 || strcmp(argv[1], "-c") != 0)
+        bad = bench(data);
+    free(data);
+    return bad != 0;
+}